@@ -0,0 +1,4 @@
+-- 10000 narrow rows per transaction
+\set v random(1, 1000000)
+INSERT INTO bench_narrow (v)
+SELECT :v + g FROM generate_series(1, 10000) g;
@@ -0,0 +1,117 @@
+#!/bin/bash
+#
+# End-to-end ingest benchmark: runs pgbench workloads against htap_create'd
+# tables and reports, per workload,
+#
+#   rows/s    rows applied to the mirrors per second, from the start of the
+#             run until the worker has caught up with it
+#   p50, p99  commit-to-columnar-visibility lag of probe rows, in ms
+#   cpu       worker CPU time over that interval, as a share of one core
+#   rss       worker peak resident set size
+#
+# Usage: bench/run.sh [workload ...]   (default: narrow wide small_txn bulk_txn)
+#
+# The server must run on this host, with row_to_column loaded and the
+# extension created in the database libpq connects to (PG* variables).
+# Settings, from the environment:
+#
+#   BENCH_CLIENTS      pgbench clients (8)
+#   BENCH_DURATION     seconds per workload (60)
+#   BENCH_PROBE_MS     pause between lag probes (200)
+#   PG_BINDIR          where psql and pgbench are (from PATH)
+#
+# Tables are recreated by bench/setup.sql on every run.
+
+set -euo pipefail
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+CLIENTS=${BENCH_CLIENTS:-8}
+DURATION=${BENCH_DURATION:-60}
+PROBE_MS=${BENCH_PROBE_MS:-200}
+PSQL=${PG_BINDIR:+$PG_BINDIR/}psql
+PGBENCH=${PG_BINDIR:+$PG_BINDIR/}pgbench
+
+WORKLOADS=("$@")
+if [ ${#WORKLOADS[@]} -eq 0 ]; then
+    WORKLOADS=(narrow wide small_txn bulk_txn)
+fi
+
+q() {
+    "$PSQL" -X -q -A -t -v ON_ERROR_STOP=1 -c "$1"
+}
+
+# utime + stime of a process, in clock ticks
+cpu_ticks() {
+    awk '{ print $14 + $15 }' "/proc/$1/stat" 2>/dev/null || echo 0
+}
+
+rss_kb() {
+    awk '/^VmRSS:/ { print $2 }' "/proc/$1/status" 2>/dev/null || echo 0
+}
+
+for w in "${WORKLOADS[@]}"; do
+    if [ ! -f "$BENCH_DIR/$w.sql" ]; then
+        echo "unknown workload \"$w\"" >&2
+        exit 1
+    fi
+done
+
+"$PSQL" -X -q -v ON_ERROR_STOP=1 -f "$BENCH_DIR/setup.sql" >/dev/null
+
+PID=$(q "SELECT pid FROM pg_stat_htap")
+if [ -z "$PID" ] || [ "$PID" = "0" ] || [ ! -r "/proc/$PID/stat" ]; then
+    echo "row_to_column worker not found on this host" >&2
+    exit 1
+fi
+HZ=$(getconf CLK_TCK)
+
+printf '%-10s %10s %10s %10s %10s %8s %10s\n' \
+    workload tps rows/s p50_ms p99_ms cpu rss_mb
+
+for w in "${WORKLOADS[@]}"; do
+    # Start from an idle worker
+    q "SELECT htap_wait_for_current()" >/dev/null
+
+    rows0=$(q "SELECT rows_applied FROM pg_stat_htap")
+    cpu0=$(cpu_ticks "$PID")
+    start=$(date +%s.%N)
+
+    q "CALL bench_probe('$w', $DURATION, $PROBE_MS)" >/dev/null &
+    probe=$!
+
+    (
+        while kill -0 "$probe" 2>/dev/null; do
+            rss_kb "$PID"
+            sleep 1
+        done
+    ) > "$BENCH_DIR/.rss.$w" &
+    sampler=$!
+
+    tps=$("$PGBENCH" -n -f "$BENCH_DIR/$w.sql" -c "$CLIENTS" -j "$CLIENTS" \
+              -T "$DURATION" 2>/dev/null |
+          awk '/^tps/ { printf "%.0f", $3; exit }')
+
+    wait "$probe"
+    q "SELECT htap_wait_for_current()" >/dev/null
+    end=$(date +%s.%N)
+    rows1=$(q "SELECT rows_applied FROM pg_stat_htap")
+    cpu1=$(cpu_ticks "$PID")
+    wait "$sampler" || true
+
+    rss_peak=$(sort -n "$BENCH_DIR/.rss.$w" | tail -1)
+    rm -f "$BENCH_DIR/.rss.$w"
+
+    lag=$(q "SELECT round(percentile_cont(0.5) WITHIN GROUP (ORDER BY lag_ms)::numeric, 1)
+                 || ' ' ||
+                 round(percentile_cont(0.99) WITHIN GROUP (ORDER BY lag_ms)::numeric, 1)
+             FROM bench_lag WHERE workload = '$w'")
+
+    awk -v w="$w" -v tps="$tps" -v rows=$((rows1 - rows0)) \
+        -v t0="$start" -v t1="$end" -v c=$((cpu1 - cpu0)) -v hz="$HZ" \
+        -v lag="$lag" -v rss="${rss_peak:-0}" 'BEGIN {
+            split(lag, l, " ");
+            secs = t1 - t0;
+            printf "%-10s %10s %10.0f %10s %10s %7.0f%% %10.1f\n",
+                   w, tps, rows / secs, l[1], l[2], 100 * c / hz / secs, rss / 1024
+        }'
+done
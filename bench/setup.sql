@@ -0,0 +1,59 @@
+-- Tables for bench/run.sh, recreated on every run.  Needs the extension
+-- installed and its worker running.
+
+\set ON_ERROR_STOP on
+
+CALL htap_drop_table('bench_narrow');
+CALL htap_drop_table('bench_wide');
+CALL htap_drop_table('bench_probe');
+
+CALL htap_create('bench_narrow',
+    'id BIGINT GENERATED ALWAYS AS IDENTITY PRIMARY KEY, v INT NOT NULL');
+
+CALL htap_create('bench_wide',
+    'id BIGINT GENERATED ALWAYS AS IDENTITY PRIMARY KEY, '
+    'i1 INT, i2 INT, i3 INT, i4 INT, i5 INT, '
+    'b1 BIGINT, b2 BIGINT, b3 BIGINT, b4 BIGINT, b5 BIGINT, '
+    'n1 NUMERIC(12,2), n2 NUMERIC(12,2), n3 NUMERIC(12,2), '
+    't1 TEXT, t2 TEXT, t3 TEXT, t4 TEXT, '
+    'ts1 TIMESTAMPTZ, ts2 TIMESTAMPTZ, f1 BOOLEAN');
+
+-- commit-to-columnar-visibility probes, see bench_probe()
+CALL htap_create('bench_probe',
+    'id BIGINT GENERATED ALWAYS AS IDENTITY PRIMARY KEY, t TIMESTAMPTZ NOT NULL');
+
+DROP TABLE IF EXISTS bench_lag;
+CREATE TABLE bench_lag (
+    workload TEXT   NOT NULL,
+    lag_ms   FLOAT8 NOT NULL
+);
+
+-- Every interval_ms for duration_s: commit a probe row, then time how long
+-- until it shows in the live view of its mirror
+CREATE OR REPLACE PROCEDURE bench_probe(workload TEXT, duration_s INT, interval_ms INT)
+LANGUAGE plpgsql AS $$
+DECLARE
+    deadline  TIMESTAMPTZ := clock_timestamp() + make_interval(secs => duration_s);
+    probe_id  BIGINT;
+    committed TIMESTAMPTZ;
+BEGIN
+    WHILE clock_timestamp() < deadline LOOP
+        INSERT INTO bench_probe (t) VALUES (clock_timestamp()) RETURNING id INTO probe_id;
+        COMMIT;
+        committed := clock_timestamp();
+
+        WHILE NOT EXISTS (SELECT 1 FROM bench_probe_col_live WHERE id = probe_id) LOOP
+            IF clock_timestamp() > deadline + interval '10 minutes' THEN
+                RAISE EXCEPTION 'probe % not applied after 10 minutes', probe_id;
+            END IF;
+            PERFORM pg_sleep(0.001);
+        END LOOP;
+
+        INSERT INTO bench_lag
+        VALUES (workload, extract(epoch FROM clock_timestamp() - committed) * 1000);
+        COMMIT;
+
+        PERFORM pg_sleep(interval_ms / 1000.0);
+    END LOOP;
+END;
+$$;
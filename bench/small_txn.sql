@@ -0,0 +1,3 @@
+-- one narrow row per transaction: per-transaction overhead dominates
+\set v random(1, 1000000)
+INSERT INTO bench_narrow (v) VALUES (:v);
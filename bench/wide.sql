@@ -0,0 +1,10 @@
+-- 10 rows of 21 columns per transaction
+\set v random(1, 1000000)
+INSERT INTO bench_wide (i1, i2, i3, i4, i5, b1, b2, b3, b4, b5,
+                        n1, n2, n3, t1, t2, t3, t4, ts1, ts2, f1)
+SELECT :v, :v + 1, :v + 2, :v + 3, :v + g,
+       :v * 10, :v * 11, :v * 12, :v * 13, :v * g,
+       :v / 100.0, :v / 10.0, g / 3.0,
+       md5(:v::text), md5((:v + g)::text), 'customer-' || :v, repeat('x', 40),
+       now(), now() - make_interval(secs => g), g % 2 = 0
+FROM generate_series(1, 10) g;
@@ -1,19 +1,269 @@
--- create publication
+-- create publication: the one row_to_column.workers names for this
+-- database, htap_pub by default
 
-DROP PUBLICATION IF EXISTS htap_pub;
-create publication htap_pub;
+CREATE OR REPLACE FUNCTION htap_publication()
+RETURNS TEXT
+AS 'MODULE_PATHNAME', 'htap_publication'
+LANGUAGE C STRICT STABLE;
 
+DO $$
+BEGIN
+    EXECUTE format('DROP PUBLICATION IF EXISTS %I', htap_publication());
+    EXECUTE format('CREATE PUBLICATION %I', htap_publication());
+END;
+$$;
 
--- DDL Queue table to track changes for the worker to process
+
+-- DDL Queue table to track changes for the worker to process.  relid is
+-- the source table whose mirror a statement changes: the worker runs it
+-- after that table's earlier rows and before its later ones, while other
+-- tables carry on.  NULL waits for every table.
 
 CREATE TABLE IF NOT EXISTS ddl_queue (
     id         BIGSERIAL PRIMARY KEY,
     ddl_sql    TEXT        NOT NULL,
     ddl_type   TEXT        NOT NULL,
-    created_at TIMESTAMPTZ NOT NULL DEFAULT clock_timestamp()
+    created_at TIMESTAMPTZ NOT NULL DEFAULT clock_timestamp(),
+    relid      oid
+);
+
+DO $$
+BEGIN
+    EXECUTE format('ALTER PUBLICATION %I ADD TABLE ddl_queue', htap_publication());
+END;
+$$;
+
+
+-- Mirrors are append-only: every row version in <tbl>_col and every
+-- retired replica identity in <tbl>_col_dv (delete vector) carries the LSN
+-- of its change in _htap_lsn.  <tbl>_col_live shows the versions not
+-- retired by a later change nor older than the last replicated TRUNCATE.
+
+CREATE TABLE IF NOT EXISTS htap_truncations (
+    mirror regclass PRIMARY KEY,
+    lsn    pg_lsn   NOT NULL
+);
+
+-- tables being converted by htap_convert(): the worker drops their changes
+-- while lsn is NULL, then those committed before it (the copy has them)
+
+CREATE TABLE IF NOT EXISTS htap_sync (
+    relid     oid PRIMARY KEY,
+    lsn       pg_lsn,
+    copied_at TIMESTAMPTZ
+);
+
+DO $$
+BEGIN
+    EXECUTE format('ALTER PUBLICATION %I ADD TABLE htap_sync', htap_publication());
+END;
+$$;
+
+-- how far the worker applied each table while it held back the rows of
+-- others to fill columnar stripes; a restart skips what is in the mirror
+
+CREATE TABLE IF NOT EXISTS htap_progress (
+    relid oid    PRIMARY KEY,
+    lsn   pg_lsn NOT NULL
 );
 
-alter publication htap_pub add table ddl_queue;
+-- ALTER COLUMN TYPE statements for mirrors that the compactor runs in the
+-- background, queued by the worker; it holds the table's later rows until
+-- the row is gone
+
+CREATE TABLE IF NOT EXISTS htap_retypes (
+    relid        oid         PRIMARY KEY,
+    ddl_sql      TEXT        NOT NULL,
+    requested_at TIMESTAMPTZ NOT NULL DEFAULT clock_timestamp()
+);
+
+-- compression of each mirror, set by htap_set_compression(): by the worker
+-- from a sample of the first rows it applied (sample says how each codec
+-- and column did), or by hand (sample NULL), which the worker leaves alone.
+-- compression_level NULL keeps columnar's.
+
+CREATE TABLE IF NOT EXISTS htap_codecs (
+    relid             oid         PRIMARY KEY,
+    compression       TEXT        NOT NULL,
+    compression_level INT,
+    sample            JSONB,
+    chosen_at         TIMESTAMPTZ NOT NULL DEFAULT clock_timestamp()
+);
+
+-- rows the worker could not apply, with the error; row_data is the change's
+-- pgoutput TupleData, kind I for <tbl>_col, D for <tbl>_col_dv and R for
+-- the rollups of <tbl>
+
+CREATE TABLE IF NOT EXISTS htap_dead_letter (
+    id        BIGSERIAL   PRIMARY KEY,
+    relid     oid         NOT NULL,
+    mirror    TEXT        NOT NULL,
+    kind      "char"      NOT NULL,
+    lsn       pg_lsn      NOT NULL,
+    error     TEXT        NOT NULL,
+    row_data  BYTEA       NOT NULL,
+    failed_at TIMESTAMPTZ NOT NULL DEFAULT clock_timestamp()
+);
+
+-- tables whose mirror is range-partitioned on part_column, a date or
+-- timestamp: htap_partition_maintain() keeps premake partitions of
+-- part_interval ahead of now and drops those older than retention
+
+CREATE TABLE IF NOT EXISTS htap_partitions (
+    relid         oid      PRIMARY KEY,
+    part_column   NAME     NOT NULL,
+    part_interval INTERVAL NOT NULL,
+    premake       INT      NOT NULL DEFAULT 4,
+    retention     INTERVAL
+);
+
+-- rollups kept up to date by the worker from the rows inserted into relid
+-- from lsn on, see htap_create_rollup(); published so the worker sees them
+-- in change order.  columns are the source columns passed to merge_sql, an
+-- array each.
+
+CREATE TABLE IF NOT EXISTS htap_rollups (
+    relid     oid      NOT NULL,
+    lsn       pg_lsn   NOT NULL DEFAULT pg_current_wal_insert_lsn(),
+    rollup    regclass PRIMARY KEY,
+    columns   NAME[]   NOT NULL,
+    merge_sql TEXT     NOT NULL
+);
+
+DO $$
+BEGIN
+    EXECUTE format('ALTER PUBLICATION %I ADD TABLE htap_rollups', htap_publication());
+END;
+$$;
+
+-- replica identity of a table: its primary key, or all columns without one
+
+CREATE OR REPLACE FUNCTION htap_identity_columns(tbl_name TEXT)
+RETURNS TABLE (attname NAME, atttype TEXT)
+LANGUAGE sql STABLE AS $$
+    SELECT a.attname, format_type(a.atttypid, a.atttypmod)
+    FROM pg_attribute a
+    WHERE a.attrelid = quote_ident(tbl_name)::regclass
+      AND a.attnum > 0
+      AND NOT a.attisdropped
+      AND (EXISTS (SELECT 1 FROM pg_index i
+                   WHERE i.indrelid = a.attrelid AND i.indisprimary
+                     AND a.attnum = ANY (i.indkey))
+           OR NOT EXISTS (SELECT 1 FROM pg_index i
+                          WHERE i.indrelid = a.attrelid AND i.indisprimary))
+    ORDER BY a.attnum
+$$;
+
+-- column list and row filter of a table in the publication, in the form
+-- ALTER PUBLICATION ... ADD TABLE takes after the table name, leaving
+-- without_col out of the list; '' for none
+
+CREATE OR REPLACE FUNCTION htap_pub_spec(tbl_name TEXT, without_col NAME DEFAULT NULL)
+RETURNS TEXT
+LANGUAGE sql STABLE AS $$
+    SELECT COALESCE((
+        SELECT COALESCE((SELECT ' (' || string_agg(quote_ident(a.attname), ', '
+                                                   ORDER BY a.attnum) || ')'
+                         FROM pg_attribute a
+                         WHERE a.attrelid = r.prrelid
+                           AND a.attnum = ANY (r.prattrs::int2[])
+                           AND a.attname IS DISTINCT FROM without_col), '')
+            || COALESCE(' WHERE (' || pg_get_expr(r.prqual, r.prrelid) || ')', '')
+        FROM pg_publication_rel r
+        JOIN pg_publication p ON p.oid = r.prpubid
+        WHERE p.pubname = htap_publication()
+          AND r.prrelid = quote_ident(tbl_name)::regclass), '')
+$$;
+
+-- columns a mirror holds: those of the table's column list in the
+-- publication, or all of them.  pgoutput sends no others.
+
+CREATE OR REPLACE FUNCTION htap_mirror_columns(tbl_name TEXT)
+RETURNS TABLE (attname NAME, atttype TEXT, attnotnull BOOLEAN)
+LANGUAGE sql STABLE AS $$
+    SELECT a.attname,
+           format_type(a.atttypid, a.atttypmod) ||
+           CASE WHEN a.attcollation <> 0 AND a.attcollation <> t.typcollation
+                THEN ' COLLATE ' || a.attcollation::regcollation
+                ELSE ''
+           END,
+           a.attnotnull
+    FROM pg_attribute a
+    JOIN pg_type t ON t.oid = a.atttypid
+    LEFT JOIN (pg_publication_rel r
+               JOIN pg_publication p ON p.oid = r.prpubid
+                                    AND p.pubname = htap_publication())
+           ON r.prrelid = a.attrelid
+    WHERE a.attrelid = quote_ident(tbl_name)::regclass
+      AND a.attnum > 0
+      AND NOT a.attisdropped
+      AND (r.prattrs IS NULL OR a.attnum = ANY (r.prattrs::int2[]))
+    ORDER BY a.attnum
+$$;
+
+-- merge-on-read view over a mirror and its delete vector.  With a primary
+-- key a retired identity hides the versions of it before.  Without one the
+-- identity is the whole row, and identical rows are interchangeable: each
+-- retirement after the first of them hides one, the oldest.
+
+CREATE OR REPLACE FUNCTION htap_live_view_sql(tbl_name TEXT)
+RETURNS TEXT
+LANGUAGE plpgsql STABLE AS $$
+DECLARE
+    has_pk    BOOLEAN;
+    key_cmp   TEXT;
+    key_cols  TEXT;
+    view_cols TEXT;
+    watermark TEXT;
+BEGIN
+    SELECT EXISTS (
+        SELECT 1 FROM pg_index
+        WHERE indrelid = quote_ident(tbl_name)::regclass
+          AND indisprimary
+    ) INTO has_pk;
+
+    -- full-row identities may contain NULLs
+    SELECT string_agg(
+               format(CASE WHEN has_pk THEN 'd.%1$I = c.%1$I'
+                           ELSE 'd.%1$I IS NOT DISTINCT FROM c.%1$I' END,
+                      attname),
+               ' AND '),
+           string_agg(format('c.%I', attname), ', ')
+    INTO key_cmp, key_cols
+    FROM htap_identity_columns(tbl_name);
+
+    watermark := format('c._htap_lsn >= COALESCE((SELECT t.lsn FROM htap_truncations t '
+                        'WHERE t.mirror = %L::regclass), ''0/0'')',
+                        quote_ident(tbl_name || '_col'));
+
+    IF has_pk THEN
+        RETURN format(
+            'CREATE OR REPLACE VIEW %1$I_col_live AS '
+            'SELECT c.* FROM %1$I_col c '
+            'WHERE %2$s '
+            'AND NOT EXISTS (SELECT 1 FROM %1$I_col_dv d '
+            'WHERE %3$s AND d._htap_lsn > c._htap_lsn)',
+            tbl_name, watermark, key_cmp
+        );
+    END IF;
+
+    SELECT string_agg(format('c.%I', attname), ', ')
+    INTO view_cols
+    FROM htap_mirror_columns(tbl_name);
+
+    RETURN format(
+        'CREATE OR REPLACE VIEW %1$I_col_live AS '
+        'SELECT %2$s, c._htap_lsn FROM ('
+        'SELECT c.*, row_number() OVER (PARTITION BY %3$s ORDER BY c._htap_lsn DESC) AS _htap_n, '
+        'count(*) OVER (PARTITION BY %3$s) AS _htap_count, '
+        'min(c._htap_lsn) OVER (PARTITION BY %3$s) AS _htap_first '
+        'FROM %1$I_col c WHERE %4$s) c '
+        'WHERE c._htap_n <= c._htap_count - (SELECT count(*) FROM %1$I_col_dv d '
+        'WHERE %5$s AND d._htap_lsn > c._htap_first)',
+        tbl_name, view_cols, key_cols, watermark, key_cmp
+    );
+END;
+$$;
 
 
 
@@ -49,11 +299,23 @@ BEGIN
         tbl_name, col_name, col_type
     );
 
-    INSERT INTO ddl_queue (ddl_sql, ddl_type)
+    -- a column list does not grow with the table
+    IF NOT EXISTS (
+        SELECT 1 FROM htap_mirror_columns(tbl_name)
+        WHERE attname = col_name
+    ) THEN
+        RAISE NOTICE 'Table "%" mirrors a column list; column "%" is not mirrored.',
+                     tbl_name, col_name;
+        RETURN;
+    END IF;
+
+    INSERT INTO ddl_queue (ddl_sql, ddl_type, relid)
     VALUES (
-        format('ALTER TABLE %I_col ADD COLUMN %I %s',
-               tbl_name, col_name, col_type),
-        'ALTER'
+        format('DROP VIEW IF EXISTS %1$I_col_live; '
+               'ALTER TABLE %1$I_col ADD COLUMN %2$I %3$s; %4$s',
+               tbl_name, col_name, col_type, htap_live_view_sql(tbl_name)),
+        'ALTER',
+        quote_ident(tbl_name)::regclass
     );
 
     RAISE LOG 'Added column "%" to table "%".', col_name, tbl_name;
@@ -72,6 +334,9 @@ CREATE OR REPLACE PROCEDURE htap_drop_col(
     col_name TEXT
 )
 LANGUAGE plpgsql AS $$
+DECLARE
+    mirrored BOOLEAN;
+    spec     TEXT;
 BEGIN
     IF NOT EXISTS (
         SELECT 1 FROM information_schema.columns
@@ -82,12 +347,68 @@ BEGIN
         RETURN;
     END IF;
 
+    -- the delete vector is keyed on the identity
+    IF EXISTS (
+        SELECT 1 FROM htap_identity_columns(tbl_name)
+        WHERE attname = col_name
+    ) AND EXISTS (
+        SELECT 1 FROM pg_index
+        WHERE indrelid = quote_ident(tbl_name)::regclass
+          AND indisprimary
+    ) THEN
+        RAISE NOTICE 'Column "%" is part of the primary key of table "%". Skipping.', col_name, tbl_name;
+        RETURN;
+    END IF;
+
+    IF EXISTS (
+        SELECT 1 FROM htap_partitions
+        WHERE relid = quote_ident(tbl_name)::regclass
+          AND part_column = col_name
+    ) THEN
+        RAISE NOTICE 'Column "%" partitions the mirror of table "%". Skipping.', col_name, tbl_name;
+        RETURN;
+    END IF;
+
+    mirrored := EXISTS (
+        SELECT 1 FROM htap_mirror_columns(tbl_name)
+        WHERE attname = col_name
+    );
+
+    -- a column list depends on its columns: publish the table again
+    -- without this one so the drop does not need CASCADE
+    IF mirrored AND EXISTS (
+        SELECT 1 FROM pg_publication_rel r
+        JOIN pg_publication p ON p.oid = r.prpubid
+        WHERE p.pubname = htap_publication()
+          AND r.prrelid = quote_ident(tbl_name)::regclass
+          AND r.prattrs IS NOT NULL
+    ) THEN
+        spec := htap_pub_spec(tbl_name, col_name);
+        EXECUTE format('ALTER PUBLICATION %I DROP TABLE %I', htap_publication(), tbl_name);
+        EXECUTE format('ALTER PUBLICATION %I ADD TABLE %I%s', htap_publication(), tbl_name, spec);
+    END IF;
+
     EXECUTE format('ALTER TABLE %I DROP COLUMN %I', tbl_name, col_name);
 
-    INSERT INTO ddl_queue (ddl_sql, ddl_type)
+    IF NOT mirrored THEN
+        RAISE LOG 'Dropped unmirrored column "%" from table "%".', col_name, tbl_name;
+        RETURN;
+    END IF;
+
+    INSERT INTO ddl_queue (ddl_sql, ddl_type, relid)
     VALUES (
-        format('ALTER TABLE %I_col DROP COLUMN %I', tbl_name, col_name),
-        'ALTER'
+        format('DROP VIEW IF EXISTS %1$I_col_live; '
+               'ALTER TABLE %1$I_col DROP COLUMN %2$I; %3$s',
+               tbl_name, col_name,
+               CASE WHEN EXISTS (
+                        SELECT 1 FROM pg_index
+                        WHERE indrelid = quote_ident(tbl_name)::regclass
+                          AND indisprimary)
+                    THEN ''
+                    ELSE format('ALTER TABLE %I_col_dv DROP COLUMN %I; ', tbl_name, col_name)
+               END || htap_live_view_sql(tbl_name)),
+        'ALTER',
+        quote_ident(tbl_name)::regclass
     );
 
     RAISE LOG 'Dropped column "%" from table "%".', col_name, tbl_name;
@@ -106,6 +427,8 @@ CREATE OR REPLACE PROCEDURE htap_rename_table(
     new_name TEXT
 )
 LANGUAGE plpgsql AS $$
+DECLARE
+    spec TEXT;
 BEGIN
     IF NOT EXISTS (
         SELECT 1 FROM pg_class WHERE relname = old_name
@@ -114,14 +437,20 @@ BEGIN
         RETURN;
     END IF;
 
-    EXECUTE format('ALTER PUBLICATION htap_pub DROP TABLE %I', old_name);
+    -- keep the column list and row filter it was published with
+    spec := htap_pub_spec(old_name);
+    EXECUTE format('ALTER PUBLICATION %I DROP TABLE %I', htap_publication(), old_name);
     EXECUTE format('ALTER TABLE %I RENAME TO %I', old_name, new_name);
-    EXECUTE format('ALTER PUBLICATION htap_pub ADD TABLE %I', new_name);
+    EXECUTE format('ALTER PUBLICATION %I ADD TABLE %I%s', htap_publication(), new_name, spec);
 
-    INSERT INTO ddl_queue (ddl_sql, ddl_type)
+    INSERT INTO ddl_queue (ddl_sql, ddl_type, relid)
     VALUES (
-        format('ALTER TABLE %I_col RENAME TO %I_col', old_name, new_name),
-        'RENAME'
+        format('ALTER TABLE %1$I_col RENAME TO %2$I_col; '
+               'ALTER TABLE %1$I_col_dv RENAME TO %2$I_col_dv; '
+               'ALTER VIEW %1$I_col_live RENAME TO %2$I_col_live',
+               old_name, new_name),
+        'RENAME',
+        quote_ident(new_name)::regclass
     );
 
     RAISE LOG 'Renamed table "%" to "%".', old_name, new_name;
@@ -177,16 +506,49 @@ BEGIN
         RETURN;
     END IF;
 
+    -- a rollup's merge_sql takes the column by name
+    IF EXISTS (
+        SELECT 1 FROM htap_rollups
+        WHERE relid = quote_ident(tbl_name)::regclass
+          AND old_col = ANY (columns)
+    ) THEN
+        RAISE NOTICE 'Column "%" of table "%" is used by a rollup. Skipping rename.',
+                     old_col, tbl_name;
+        RETURN;
+    END IF;
+
     EXECUTE format(
         'ALTER TABLE %I RENAME COLUMN %I TO %I',
         tbl_name, old_col, new_col
     );
 
-    INSERT INTO ddl_queue (ddl_sql, ddl_type)
+    UPDATE htap_partitions SET part_column = new_col
+    WHERE relid = quote_ident(tbl_name)::regclass
+      AND part_column = old_col;
+
+    IF NOT EXISTS (
+        SELECT 1 FROM htap_mirror_columns(tbl_name)
+        WHERE attname = new_col
+    ) THEN
+        RAISE LOG 'Renamed unmirrored column "%" to "%" on table "%".',
+                  old_col, new_col, tbl_name;
+        RETURN;
+    END IF;
+
+    INSERT INTO ddl_queue (ddl_sql, ddl_type, relid)
     VALUES (
-        format('ALTER TABLE %I_col RENAME COLUMN %I TO %I',
-               tbl_name, old_col, new_col),
-        'RENAME'
+        format('DROP VIEW IF EXISTS %1$I_col_live; '
+               'ALTER TABLE %1$I_col RENAME COLUMN %2$I TO %3$I; %4$s%5$s',
+               tbl_name, old_col, new_col,
+               CASE WHEN EXISTS (SELECT 1 FROM htap_identity_columns(tbl_name)
+                                 WHERE attname = new_col)
+                    THEN format('ALTER TABLE %I_col_dv RENAME COLUMN %I TO %I; ',
+                                tbl_name, old_col, new_col)
+                    ELSE ''
+               END,
+               htap_live_view_sql(tbl_name)),
+        'RENAME',
+        quote_ident(tbl_name)::regclass
     );
 
     RAISE LOG 'Renamed column "%" to "%" on table "%".',
@@ -241,16 +603,56 @@ BEGIN
         RETURN;
     END IF;
 
+    -- a partition key keeps its type
+    IF EXISTS (
+        SELECT 1 FROM htap_partitions
+        WHERE relid = quote_ident(tbl_name)::regclass
+          AND part_column = col_name
+    ) THEN
+        RAISE NOTICE 'Column "%" partitions the mirror of table "%". Skipping ALTER TYPE.',
+                     col_name, tbl_name;
+        RETURN;
+    END IF;
+
+    -- a rollup's merge_sql takes the column by name and type
+    IF EXISTS (
+        SELECT 1 FROM htap_rollups
+        WHERE relid = quote_ident(tbl_name)::regclass
+          AND col_name = ANY (columns)
+    ) THEN
+        RAISE NOTICE 'Column "%" of table "%" is used by a rollup. Skipping ALTER TYPE.',
+                     col_name, tbl_name;
+        RETURN;
+    END IF;
+
     EXECUTE format(
         'ALTER TABLE %I ALTER COLUMN %I TYPE %s',
         tbl_name, col_name, new_type
     );
 
-    INSERT INTO ddl_queue (ddl_sql, ddl_type)
+    IF NOT EXISTS (
+        SELECT 1 FROM htap_mirror_columns(tbl_name)
+        WHERE attname = col_name
+    ) THEN
+        RAISE LOG 'Changed unmirrored column "%" type on table "%" to "%".',
+                  col_name, tbl_name, new_type;
+        RETURN;
+    END IF;
+
+    INSERT INTO ddl_queue (ddl_sql, ddl_type, relid)
     VALUES (
-        format('ALTER TABLE %I_col ALTER COLUMN %I TYPE %s',
-               tbl_name, col_name, new_type),
-        'ALTER'
+        format('DROP VIEW IF EXISTS %1$I_col_live; '
+               'ALTER TABLE %1$I_col ALTER COLUMN %2$I TYPE %3$s; %4$s%5$s',
+               tbl_name, col_name, new_type,
+               CASE WHEN EXISTS (SELECT 1 FROM htap_identity_columns(tbl_name)
+                                 WHERE attname = col_name)
+                    THEN format('ALTER TABLE %I_col_dv ALTER COLUMN %I TYPE %s; ',
+                                tbl_name, col_name, new_type)
+                    ELSE ''
+               END,
+               htap_live_view_sql(tbl_name)),
+        'ALTER TYPE',
+        quote_ident(tbl_name)::regclass
     );
 
     RAISE LOG 'Changed column "%" type on table "%" to "%".',
@@ -283,10 +685,13 @@ BEGIN
 
     EXECUTE format('TRUNCATE TABLE %I CASCADE', tbl_name);
 
-    INSERT INTO ddl_queue (ddl_sql, ddl_type)
+    INSERT INTO ddl_queue (ddl_sql, ddl_type, relid)
     VALUES (
-        format('TRUNCATE TABLE %I_col CASCADE', tbl_name),
-        'TRUNCATE'
+        format('TRUNCATE TABLE %1$I_col, %1$I_col_dv CASCADE; '
+               'DELETE FROM htap_truncations WHERE mirror = to_regclass(%2$L)',
+               tbl_name, quote_ident(tbl_name || '_col')),
+        'TRUNCATE',
+        quote_ident(tbl_name)::regclass
     );
 
     RAISE LOG 'Truncated table "%".', tbl_name;
@@ -302,6 +707,8 @@ $$;
 
 CREATE OR REPLACE PROCEDURE htap_drop_table(tbl_name TEXT)
 LANGUAGE plpgsql AS $$
+DECLARE
+    tbl OID;
 BEGIN
     IF NOT EXISTS (
         SELECT 1 FROM pg_class WHERE relname = tbl_name
@@ -310,12 +717,23 @@ BEGIN
         RETURN;
     END IF;
 
+    tbl := quote_ident(tbl_name)::regclass;
+    DELETE FROM htap_sync WHERE relid = tbl;
+    DELETE FROM htap_progress WHERE relid = tbl;
+    DELETE FROM htap_partitions WHERE relid = tbl;
+    DELETE FROM htap_rollups WHERE relid = tbl;
+    DELETE FROM htap_retypes WHERE relid = tbl;
+    DELETE FROM htap_codecs WHERE relid = tbl;
     EXECUTE format('DROP TABLE %I CASCADE', tbl_name);
 
-    INSERT INTO ddl_queue (ddl_sql, ddl_type)
+    INSERT INTO ddl_queue (ddl_sql, ddl_type, relid)
     VALUES (
-        format('DROP TABLE IF EXISTS %I_col CASCADE', tbl_name),
-        'DROP'
+        format('DELETE FROM htap_truncations WHERE mirror = to_regclass(%2$L); '
+               'DROP TABLE IF EXISTS %1$I_col CASCADE; '
+               'DROP TABLE IF EXISTS %1$I_col_dv',
+               tbl_name, quote_ident(tbl_name || '_col')),
+        'DROP',
+        tbl
     );
 
     RAISE LOG 'Dropped table "%".', tbl_name;
@@ -327,30 +745,802 @@ EXCEPTION
 END;
 $$;
 
--- create table with add publication
+-- statements creating the mirror, delete vector and live view of a table
+
+CREATE OR REPLACE FUNCTION htap_mirror_sql(tbl_name TEXT)
+RETURNS TEXT
+LANGUAGE plpgsql STABLE AS $$
+DECLARE
+    has_pk      BOOLEAN;
+    col_columns TEXT;
+    col_storage TEXT;
+    dv_columns  TEXT;
+    dv_key      TEXT;
+BEGIN
+    SELECT EXISTS (
+        SELECT 1 FROM pg_index
+        WHERE indrelid = quote_ident(tbl_name)::regclass
+          AND indisprimary
+    ) INTO has_pk;
+
+    -- The mirror holds every row version, so it takes the published
+    -- columns of the heap but none of its keys; the delete vector holds
+    -- the identities.
+    SELECT string_agg(format('%I %s%s', attname, atttype,
+                             CASE WHEN attnotnull THEN ' NOT NULL' ELSE '' END), ', ')
+    INTO col_columns
+    FROM htap_mirror_columns(tbl_name);
+
+    -- a partitioned mirror stores nothing itself, its partitions are columnar
+    SELECT COALESCE((SELECT format('PARTITION BY RANGE (%I)', part_column)
+                     FROM htap_partitions
+                     WHERE relid = quote_ident(tbl_name)::regclass),
+                    'USING columnar')
+    INTO col_storage;
+
+    SELECT string_agg(format('%I %s', attname, atttype), ', '),
+           string_agg(format('%I', attname), ', ')
+    INTO dv_columns, dv_key
+    FROM htap_identity_columns(tbl_name);
+
+    RETURN format(
+        'CREATE TABLE IF NOT EXISTS %1$I_col (%5$s, _htap_lsn pg_lsn) %6$s; '
+        'CREATE TABLE IF NOT EXISTS %1$I_col_dv (%2$s, _htap_lsn pg_lsn NOT NULL); '
+        '%3$s'
+        '%4$s',
+        tbl_name, dv_columns,
+        CASE WHEN has_pk
+             THEN format('CREATE INDEX IF NOT EXISTS %1$I ON %2$I_col_dv (%3$s); ',
+                         tbl_name || '_col_dv_key', tbl_name, dv_key)
+             ELSE ''
+        END,
+        htap_live_view_sql(tbl_name),
+        col_columns, col_storage
+    );
+END;
+$$;
+
+-- create the partitions a partitioned mirror needs next and drop the
+-- expired ones, for one table or all; run by the worker every minute.
+-- Partitions are attached rather than created as such, which does not
+-- wait for queries on the mirror; dropping one does, up to lock_timeout,
+-- and is retried on the next run.  Any other failure is logged and
+-- retried the same way, the worker carries on.  Returns the partitions
+-- created and dropped.
+
+CREATE OR REPLACE FUNCTION htap_partition_maintain(tbl_name TEXT DEFAULT NULL)
+RETURNS INT
+LANGUAGE plpgsql
+SET lock_timeout = '1s'
+AS $$
+DECLARE
+    p          RECORD;
+    mirror     TEXT;
+    prefix     TEXT;
+    suffix     TEXT;
+    leaf_name  TEXT;
+    bound      TIMESTAMP;
+    next_bound TIMESTAMP;
+    changes    INT := 0;
+BEGIN
+    FOR p IN
+        SELECT h.*, c.relname::TEXT AS relname,
+               format_type(a.atttypid, NULL) = 'date' AS by_date
+        FROM htap_partitions h
+        JOIN pg_class c ON c.oid = h.relid
+        LEFT JOIN pg_attribute a ON a.attrelid = h.relid AND a.attname = h.part_column
+        WHERE tbl_name IS NULL OR c.relname = tbl_name
+    LOOP
+        mirror := p.relname || '_col';
+        CONTINUE WHEN to_regclass(quote_ident(mirror)) IS NULL;
+
+        IF p.by_date AND date_trunc('day', p.part_interval) <> p.part_interval THEN
+            RAISE WARNING 'htap_partition_maintain: % is partitioned on a date by %, not whole days',
+                          mirror, p.part_interval;
+            CONTINUE;
+        END IF;
+
+        BEGIN
+            -- partitions are contiguous: carry on from the last upper bound
+            SELECT max(substring(pg_get_expr(c.relpartbound, c.oid)
+                                 FROM 'TO \(''([^'']*)''\)')::TIMESTAMP)
+            INTO bound
+            FROM pg_inherits i
+            JOIN pg_class c ON c.oid = i.inhrelid
+            WHERE i.inhparent = quote_ident(mirror)::regclass;
+
+            IF bound IS NULL THEN
+                bound := date_trunc(CASE WHEN p.part_interval >= INTERVAL '1 month' THEN 'month'
+                                         WHEN p.part_interval >= INTERVAL '1 day' THEN 'day'
+                                         ELSE 'hour' END,
+                                    localtimestamp);
+            END IF;
 
-CREATE OR REPLACE PROCEDURE htap_create(tbl_name TEXT, columns_definition TEXT)
+            WHILE bound < localtimestamp + p.premake * p.part_interval LOOP
+                next_bound := bound + p.part_interval;
+                suffix := to_char(bound, CASE WHEN p.part_interval >= INTERVAL '1 day'
+                                              THEN 'YYYYMMDD'
+                                              ELSE 'YYYYMMDD_HH24MI' END);
+                leaf_name := format('%s_p%s', mirror, suffix);
+                -- cut at NAMEDATALEN it could name another mirror's partition:
+                -- shorten the mirror's part and tell it apart by a hash
+                IF octet_length(leaf_name) > 63 THEN
+                    prefix := mirror;
+                    LOOP
+                        leaf_name := format('%s_%s_p%s', prefix, left(md5(mirror), 8), suffix);
+                        EXIT WHEN octet_length(leaf_name) <= 63;
+                        prefix := left(prefix, -1);
+                    END LOOP;
+                END IF;
+                BEGIN
+                    EXECUTE format('CREATE TABLE %I (LIKE %I INCLUDING DEFAULTS) USING columnar',
+                                   leaf_name, mirror);
+                    EXECUTE format('ALTER TABLE %I ATTACH PARTITION %I FOR VALUES FROM (%L) TO (%L)',
+                                   mirror, leaf_name, bound, next_bound);
+                    changes := changes + 1;
+                EXCEPTION
+                    WHEN lock_not_available THEN
+                        RAISE LOG 'htap_partition_maintain: % is busy, adding % later',
+                                  mirror, leaf_name;
+                        EXIT;
+                    WHEN OTHERS THEN
+                        RAISE WARNING 'htap_partition_maintain: could not add % to %: %',
+                                      leaf_name, mirror, SQLERRM;
+                        EXIT;
+                END;
+                -- a codec columnar no longer takes leaves the default
+                BEGIN
+                    PERFORM columnar.alter_table_set(quote_ident(leaf_name)::regclass,
+                                                     compression => c.compression,
+                                                     compression_level => c.compression_level)
+                    FROM htap_codecs c WHERE c.relid = p.relid;
+                EXCEPTION
+                    WHEN OTHERS THEN
+                        RAISE WARNING 'htap_partition_maintain: could not set the compression of %: %',
+                                      leaf_name, SQLERRM;
+                END;
+                bound := next_bound;
+            END LOOP;
+
+            CONTINUE WHEN p.retention IS NULL;
+
+            FOR leaf_name IN
+                SELECT c.relname
+                FROM pg_inherits i
+                JOIN pg_class c ON c.oid = i.inhrelid
+                WHERE i.inhparent = quote_ident(mirror)::regclass
+                  AND substring(pg_get_expr(c.relpartbound, c.oid)
+                                FROM 'TO \(''([^'']*)''\)')::TIMESTAMP
+                      <= localtimestamp - p.retention
+            LOOP
+                BEGIN
+                    EXECUTE format('DROP TABLE %I', leaf_name);
+                    changes := changes + 1;
+                EXCEPTION
+                    WHEN lock_not_available THEN
+                        RAISE LOG 'htap_partition_maintain: % is busy, dropping % later',
+                                  mirror, leaf_name;
+                    WHEN OTHERS THEN
+                        RAISE WARNING 'htap_partition_maintain: could not drop % of %: %',
+                                      leaf_name, mirror, SQLERRM;
+                END;
+            END LOOP;
+        EXCEPTION
+            WHEN OTHERS THEN
+                RAISE WARNING 'htap_partition_maintain: could not maintain %: %',
+                              mirror, SQLERRM;
+        END;
+    END LOOP;
+
+    RETURN changes;
+END;
+$$;
+
+-- compression of a table's mirror, or of each of its partitions, for the
+-- stripes written from now on.  With a sample (the worker's choice), a
+-- setting made by hand is kept, a codec columnar rejects is only logged
+-- and a table gone meanwhile is skipped; returns whether it was applied.
+-- The worker names the table by oid.
+-- Example: SELECT htap_set_compression('orders', 'zstd', 9);
+
+CREATE OR REPLACE FUNCTION htap_set_compression(
+    tbl               OID,
+    compression       TEXT,
+    compression_level INT DEFAULT NULL,
+    sample            JSONB DEFAULT NULL
+)
+RETURNS BOOLEAN
+LANGUAGE plpgsql AS $$
+DECLARE
+    tbl_name TEXT;
+    mirror   REGCLASS;
+    part     REGCLASS;
+BEGIN
+    -- the worker's choice may come after the table was dropped or renamed
+    SELECT c.relname INTO tbl_name FROM pg_class c WHERE c.oid = tbl;
+    mirror := to_regclass(quote_ident(tbl_name || '_col'));
+    IF mirror IS NULL THEN
+        IF sample IS NOT NULL THEN
+            RETURN false;
+        END IF;
+        RAISE EXCEPTION 'Table "%" has no mirror.', COALESCE(tbl_name, tbl::TEXT);
+    END IF;
+
+    IF to_regclass('columnar.options') IS NULL OR (sample IS NOT NULL AND EXISTS (
+        SELECT 1 FROM htap_codecs c WHERE c.relid = tbl AND c.sample IS NULL
+    )) THEN
+        RETURN false;
+    END IF;
+
+    BEGIN
+        FOR part IN
+            SELECT o.relation FROM columnar.options o
+            WHERE o.relation = mirror
+               OR o.relation IN (SELECT i.inhrelid FROM pg_inherits i WHERE i.inhparent = mirror)
+        LOOP
+            PERFORM columnar.alter_table_set(part, compression => htap_set_compression.compression,
+                                             compression_level => htap_set_compression.compression_level);
+        END LOOP;
+    EXCEPTION
+        WHEN OTHERS THEN
+            IF sample IS NULL THEN
+                RAISE;
+            END IF;
+            RAISE LOG 'htap_set_compression: keeping the compression of %: %', mirror, SQLERRM;
+            RETURN false;
+    END;
+
+    INSERT INTO htap_codecs (relid, compression, compression_level, sample)
+    VALUES (tbl, htap_set_compression.compression, htap_set_compression.compression_level,
+            htap_set_compression.sample)
+    ON CONFLICT (relid) DO UPDATE
+    SET compression = EXCLUDED.compression,
+        compression_level = EXCLUDED.compression_level,
+        sample = EXCLUDED.sample,
+        chosen_at = EXCLUDED.chosen_at;
+
+    RETURN true;
+END;
+$$;
+
+CREATE OR REPLACE FUNCTION htap_set_compression(
+    tbl_name          TEXT,
+    compression       TEXT,
+    compression_level INT DEFAULT NULL,
+    sample            JSONB DEFAULT NULL
+)
+RETURNS BOOLEAN
+LANGUAGE sql AS $$
+    SELECT htap_set_compression(quote_ident(tbl_name)::regclass::oid, compression,
+                                compression_level, sample)
+$$;
+
+-- create table with add publication.  mirror_columns limits the mirror to
+-- those columns and the primary key, row_filter to the rows it accepts;
+-- pgoutput leaves the rest out of the stream.  partition_by names a date
+-- or timestamp column to range-partition the mirror on, one partition per
+-- partition_interval, dropped once older than retention.
+
+CREATE OR REPLACE PROCEDURE htap_create(
+    tbl_name           TEXT,
+    columns_definition TEXT,
+    mirror_columns     TEXT[]   DEFAULT NULL,
+    row_filter         TEXT     DEFAULT NULL,
+    partition_by       TEXT     DEFAULT NULL,
+    partition_interval INTERVAL DEFAULT '1 month',
+    retention          INTERVAL DEFAULT NULL
+)
 LANGUAGE plpgsql AS $$
+DECLARE
+    has_pk     BOOLEAN;
+    spec       TEXT := '';
+    mirror_sql TEXT;
 BEGIN
     -- 1. Create the Rowstore Table (Standard Heap)
     EXECUTE format('CREATE TABLE %I (%s)', tbl_name, columns_definition);
-    EXECUTE format('Alter publication htap_pub add table %I', tbl_name);
+
+    -- UPDATE and DELETE are only published with a replica identity; without
+    -- a primary key use the whole row
+    SELECT EXISTS (
+        SELECT 1 FROM pg_index
+        WHERE indrelid = quote_ident(tbl_name)::regclass
+          AND indisprimary
+    ) INTO has_pk;
+    IF NOT has_pk THEN
+        EXECUTE format('ALTER TABLE %I REPLICA IDENTITY FULL', tbl_name);
+    END IF;
+
+    -- a column list must cover the replica identity, and deletes are
+    -- keyed on it
+    IF mirror_columns IS NOT NULL THEN
+        IF NOT has_pk THEN
+            RAISE EXCEPTION 'Table "%" needs a primary key to mirror a column list.', tbl_name;
+        END IF;
+
+        SELECT ' (' || string_agg(quote_ident(col), ', ') || ')'
+        INTO spec
+        FROM (SELECT attname::TEXT AS col
+              FROM htap_identity_columns(tbl_name)
+              WHERE attname::TEXT <> ALL (mirror_columns)
+              UNION ALL
+              SELECT unnest(mirror_columns)) c;
+    END IF;
+
+    IF row_filter IS NOT NULL THEN
+        spec := spec || format(' WHERE (%s)', row_filter);
+    END IF;
+
+    EXECUTE format('Alter publication %I add table %I%s', htap_publication(), tbl_name, spec);
+
+    -- UPDATE and DELETE check the row filter against the replica identity
+    -- when they run; fail here rather than on the first write
+    IF row_filter IS NOT NULL THEN
+        EXECUTE format('DELETE FROM %I WHERE false', tbl_name);
+    END IF;
+
+    IF partition_by IS NOT NULL THEN
+        IF NOT EXISTS (
+            SELECT 1 FROM htap_mirror_columns(tbl_name)
+            WHERE attname = partition_by
+              AND split_part(atttype, ' COLLATE ', 1) IN
+                  ('date', 'timestamp without time zone', 'timestamp with time zone')
+        ) THEN
+            RAISE EXCEPTION 'Mirror of table "%" cannot be partitioned on "%": it needs a mirrored date or timestamp column.',
+                            tbl_name, partition_by;
+        END IF;
+        IF partition_interval <= INTERVAL '0' THEN
+            RAISE EXCEPTION 'partition_interval must be positive.';
+        END IF;
+        -- date bounds a part of a day apart round to the same day
+        IF date_trunc('day', partition_interval) <> partition_interval AND EXISTS (
+            SELECT 1 FROM htap_mirror_columns(tbl_name)
+            WHERE attname = partition_by
+              AND split_part(atttype, ' COLLATE ', 1) = 'date'
+        ) THEN
+            RAISE EXCEPTION 'partition_interval of date column "%" must be whole days.',
+                            partition_by;
+        END IF;
+
+        INSERT INTO htap_partitions (relid, part_column, part_interval, retention)
+        VALUES (quote_ident(tbl_name)::regclass, partition_by, partition_interval, retention);
+    END IF;
+
     -- 2. Create the Columnar Mirror
     -- Note: We append 'USING columnar' (or your specific engine syntax)
-    EXECUTE format(
-        'CREATE TABLE %I_col (%s) USING columnar', 
-        tbl_name, 
-        columns_definition
-    );
+    mirror_sql := htap_mirror_sql(tbl_name);
+    EXECUTE mirror_sql;
+    PERFORM htap_partition_maintain(tbl_name);
 
     -- 3. Log to the DDL Queue
     -- We store the 'columnar' version so the BGWorker knows exactly what to run
-    INSERT INTO ddl_queue (ddl_sql, ddl_type)
-    VALUES (
-        format('CREATE TABLE IF NOT EXISTS %I_col (%s) USING columnar;', tbl_name, columns_definition),
-        'CREATE'
-    );
+    INSERT INTO ddl_queue (ddl_sql, ddl_type, relid)
+    VALUES (mirror_sql, 'CREATE', quote_ident(tbl_name)::regclass);
 
     RAISE NOTICE 'Table % and its columnar mirror %_col created.', tbl_name, tbl_name;
 END;
-$$;
\ No newline at end of file
+$$;
+
+-- convert an existing table: mirror it and copy its rows with
+-- parallel_workers background workers.  Call it outside a transaction
+-- block, it commits between steps; after a failure, call it again.
+
+CREATE OR REPLACE FUNCTION htap_copy_begin(tbl REGCLASS, nworkers INT)
+RETURNS PG_LSN
+AS 'MODULE_PATHNAME', 'htap_copy_begin'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE OR REPLACE FUNCTION htap_copy_finish()
+RETURNS BIGINT
+AS 'MODULE_PATHNAME', 'htap_copy_finish'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE OR REPLACE PROCEDURE htap_convert(tbl_name TEXT, parallel_workers INT DEFAULT 4)
+LANGUAGE plpgsql AS $$
+DECLARE
+    tbl        REGCLASS;
+    has_pk     BOOLEAN;
+    mirror_sql TEXT;
+    state      htap_sync%ROWTYPE;
+    sync_lsn   PG_LSN;
+    copied     BIGINT;
+BEGIN
+    tbl := to_regclass(quote_ident(tbl_name));
+    IF tbl IS NULL THEN
+        RAISE EXCEPTION 'Table "%" does not exist.', tbl_name;
+    END IF;
+
+    SELECT * INTO state FROM htap_sync WHERE relid = tbl;
+
+    IF NOT FOUND THEN
+        IF EXISTS (SELECT 1 FROM pg_publication_rel
+                   WHERE prpubid = (SELECT oid FROM pg_publication
+                                    WHERE pubname = htap_publication())
+                     AND prrelid = tbl) THEN
+            RAISE EXCEPTION 'Table "%" is already mirrored.', tbl_name;
+        END IF;
+
+        SELECT EXISTS (
+            SELECT 1 FROM pg_index WHERE indrelid = tbl AND indisprimary
+        ) INTO has_pk;
+        IF NOT has_pk THEN
+            EXECUTE format('ALTER TABLE %I REPLICA IDENTITY FULL', tbl_name);
+        END IF;
+
+        mirror_sql := htap_mirror_sql(tbl_name);
+        EXECUTE mirror_sql;
+        INSERT INTO ddl_queue (ddl_sql, ddl_type, relid)
+        VALUES (mirror_sql, 'CREATE', tbl);
+
+        -- Published from here on, but held back by the worker until the
+        -- copy has taken its snapshot
+        INSERT INTO htap_sync (relid) VALUES (tbl);
+        EXECUTE format('ALTER PUBLICATION %I ADD TABLE %I', htap_publication(), tbl_name);
+        COMMIT;
+    ELSIF state.copied_at IS NOT NULL THEN
+        RAISE EXCEPTION 'Table "%" was already converted at %.', tbl_name, state.copied_at;
+    ELSE
+        -- An earlier attempt failed: hold the changes back again, let the
+        -- worker apply what it let through, and start from empty mirrors
+        UPDATE htap_sync SET lsn = NULL WHERE relid = tbl;
+        COMMIT;
+        PERFORM htap_wait_for_current();
+        EXECUTE format('TRUNCATE %1$I_col, %1$I_col_dv', tbl_name);
+        DELETE FROM htap_truncations WHERE mirror = to_regclass(quote_ident(tbl_name || '_col'));
+        COMMIT;
+    END IF;
+
+    -- Writers wait until the copy holds its snapshot, so every transaction
+    -- committed before sync_lsn is in it and none after
+    EXECUTE format('LOCK TABLE %I IN SHARE MODE', tbl_name);
+    sync_lsn := htap_copy_begin(tbl, parallel_workers);
+    UPDATE htap_sync SET lsn = sync_lsn WHERE relid = tbl;
+    COMMIT;
+
+    copied := htap_copy_finish();
+    UPDATE htap_sync SET copied_at = clock_timestamp() WHERE relid = tbl;
+    COMMIT;
+
+    RAISE NOTICE 'Table % converted: % rows copied to %_col.', tbl_name, copied, tbl_name;
+END;
+$$;
+
+-- rewrite a mirror made of small stripes into full ones, dropping the rows
+-- hidden by the last TRUNCATE; run by the compactor, returns rows kept
+
+CREATE OR REPLACE FUNCTION htap_compact(tbl_name TEXT)
+RETURNS BIGINT
+LANGUAGE plpgsql AS $$
+DECLARE
+    mirror_rel REGCLASS;
+    opts       columnar.options%ROWTYPE;
+    keep_from  PG_LSN;
+    kept       BIGINT;
+BEGIN
+    mirror_rel := to_regclass(quote_ident(tbl_name || '_col'));
+    IF mirror_rel IS NULL THEN
+        RAISE EXCEPTION 'Table "%" has no mirror.', tbl_name;
+    END IF;
+
+    -- Readers carry on against the old stripes; the worker waits or holds
+    EXECUTE format('LOCK TABLE %I_col IN EXCLUSIVE MODE', tbl_name);
+
+    SELECT * INTO opts FROM columnar.options WHERE relation = mirror_rel;
+    SELECT COALESCE((SELECT lsn FROM htap_truncations WHERE mirror = mirror_rel), '0/0')
+    INTO keep_from;
+
+    EXECUTE format('CREATE TABLE %1$I_col_compact (LIKE %1$I_col INCLUDING ALL) USING columnar',
+                   tbl_name);
+    EXECUTE format('ALTER TABLE %I_col_compact SET (columnar.stripe_row_limit = %s, '
+                   'columnar.chunk_group_row_limit = %s, columnar.compression = %I, '
+                   'columnar.compression_level = %s)',
+                   tbl_name, opts.stripe_row_limit, opts.chunk_group_row_limit,
+                   opts.compression, opts.compression_level);
+
+    EXECUTE format('INSERT INTO %1$I_col_compact SELECT * FROM %1$I_col '
+                   'WHERE _htap_lsn >= %2$L ORDER BY _htap_lsn',
+                   tbl_name, keep_from);
+    GET DIAGNOSTICS kept = ROW_COUNT;
+
+    EXECUTE format('ALTER TABLE %1$I_col RENAME TO %2$I', tbl_name, tbl_name || '_col_old');
+    EXECUTE format('ALTER TABLE %1$I_col_compact RENAME TO %2$I', tbl_name, tbl_name || '_col');
+
+    -- The view and the watermark name the old mirror by oid
+    DELETE FROM htap_truncations WHERE mirror = mirror_rel;
+    EXECUTE htap_live_view_sql(tbl_name);
+    EXECUTE format('DROP TABLE %I_col_old', tbl_name);
+
+    RETURN kept;
+END;
+$$;
+
+-- rollup of a table: per bucket of time_column and group_by values, the
+-- aggregates (sum, count, min or max of a column, or count(*)) of the rows
+-- inserted from now on.  The worker merges each batch into the rollup
+-- table in the transaction that applies it to the mirror.  Updates,
+-- deletes and truncations are not reflected.
+-- Example: CALL htap_create_rollup('orders_hourly', 'orders', 'created_at',
+--          '1 hour', '{region}', '{count(*), sum(amount), max(amount)}');
+
+CREATE OR REPLACE PROCEDURE htap_create_rollup(
+    rollup_name TEXT,
+    tbl_name    TEXT,
+    time_column TEXT,
+    bucket      INTERVAL,
+    group_by    TEXT[] DEFAULT '{}',
+    aggregates  TEXT[] DEFAULT '{count(*)}'
+)
+LANGUAGE plpgsql AS $$
+DECLARE
+    columns     NAME[] := ARRAY[time_column]::NAME[];
+    bucket_type TEXT;
+    bucket_expr TEXT;
+    group_cols  TEXT := '';
+    group_keys  TEXT := 'bucket';
+    agg_exprs   TEXT := '';
+    merge_sets  TEXT := '';
+    col         TEXT;
+    agg         TEXT;
+    m           TEXT[];
+    agg_col     TEXT;
+    select_sql  TEXT;
+BEGIN
+    -- the worker aggregates rows as the mirror gets them
+    SELECT CASE WHEN split_part(atttype, ' COLLATE ', 1) = 'timestamp with time zone'
+                THEN 'timestamptz' ELSE 'timestamp' END
+    INTO bucket_type
+    FROM htap_mirror_columns(tbl_name)
+    WHERE attname = time_column
+      AND split_part(atttype, ' COLLATE ', 1) IN
+          ('date', 'timestamp without time zone', 'timestamp with time zone');
+
+    IF NOT FOUND THEN
+        RAISE EXCEPTION 'Column "%" of table "%" is not a mirrored date or timestamp column.',
+                        time_column, tbl_name;
+    END IF;
+
+    -- date_bin() takes no months
+    IF bucket <= INTERVAL '0' THEN
+        RAISE EXCEPTION 'bucket must be positive.';
+    ELSIF date_part('year', bucket) = 0 AND date_part('month', bucket) = 0 THEN
+        bucket_expr := format('date_bin(%L, u.%I::%s, %L)',
+                              bucket, time_column, bucket_type, '2000-01-01');
+    ELSIF bucket IN (INTERVAL '1 month', INTERVAL '1 year') THEN
+        bucket_expr := format('date_trunc(%L, u.%I::%s)',
+                              CASE WHEN bucket = INTERVAL '1 year' THEN 'year' ELSE 'month' END,
+                              time_column, bucket_type);
+    ELSE
+        RAISE EXCEPTION 'bucket must be shorter than a month, or one month or year.';
+    END IF;
+
+    FOREACH col IN ARRAY group_by LOOP
+        IF NOT EXISTS (SELECT 1 FROM htap_mirror_columns(tbl_name) WHERE attname = col) THEN
+            RAISE EXCEPTION 'Column "%" of table "%" is not mirrored.', col, tbl_name;
+        END IF;
+        IF NOT col = ANY (columns) THEN
+            columns := columns || col::NAME;
+        END IF;
+        group_cols := group_cols || format(', u.%I', col);
+        group_keys := group_keys || format(', %I', col);
+    END LOOP;
+
+    FOREACH agg IN ARRAY aggregates LOOP
+        m := regexp_match(agg, '^\s*(sum|count|min|max)\s*\(\s*(\*|\w+)\s*\)\s*$', 'i');
+        IF m IS NULL OR (m[2] = '*' AND lower(m[1]) <> 'count') THEN
+            RAISE EXCEPTION 'Aggregate "%" is not sum, count, min or max of a column, or count(*).', agg;
+        END IF;
+
+        IF m[2] = '*' THEN
+            agg_col := 'count';
+            agg_exprs := agg_exprs || ', count(*) AS count';
+        ELSE
+            IF NOT EXISTS (SELECT 1 FROM htap_mirror_columns(tbl_name) WHERE attname = m[2]) THEN
+                RAISE EXCEPTION 'Column "%" of table "%" is not mirrored.', m[2], tbl_name;
+            END IF;
+            IF NOT m[2] = ANY (columns) THEN
+                columns := columns || m[2]::NAME;
+            END IF;
+            agg_col := lower(m[1]) || '_' || m[2];
+            agg_exprs := agg_exprs || format(', %s(u.%I) AS %I', lower(m[1]), m[2], agg_col);
+        END IF;
+
+        -- counts and sums add up, a NULL sum is one of no values
+        merge_sets := merge_sets || CASE WHEN merge_sets = '' THEN '' ELSE ', ' END ||
+                      format(CASE lower(m[1])
+                                 WHEN 'min' THEN '%1$I = LEAST(r.%1$I, EXCLUDED.%1$I)'
+                                 WHEN 'max' THEN '%1$I = GREATEST(r.%1$I, EXCLUDED.%1$I)'
+                                 ELSE '%1$I = COALESCE(r.%1$I + EXCLUDED.%1$I, r.%1$I, EXCLUDED.%1$I)'
+                             END, agg_col);
+    END LOOP;
+
+    -- one array parameter per column; typed NULLs give the table its types
+    select_sql := format(
+        'SELECT %s AS bucket%s%s FROM unnest(%%s) AS u(%s) GROUP BY %s',
+        bucket_expr, group_cols, agg_exprs,
+        (SELECT string_agg(quote_ident(c), ', ' ORDER BY o) FROM unnest(columns) WITH ORDINALITY AS x(c, o)),
+        (SELECT string_agg(g::TEXT, ', ') FROM generate_series(1, 1 + cardinality(group_by)) g));
+
+    EXECUTE format('CREATE TABLE %I AS %s WITH NO DATA', rollup_name,
+                   replace(select_sql, 'unnest(%s)',
+                           (SELECT 'unnest(' || string_agg(format('NULL::%s[]',
+                                                                  split_part(mc.atttype, ' COLLATE ', 1)),
+                                                           ', ' ORDER BY x.o) || ')'
+                            FROM unnest(columns) WITH ORDINALITY AS x(c, o)
+                            JOIN htap_mirror_columns(tbl_name) mc ON mc.attname = x.c)));
+    EXECUTE format('ALTER TABLE %I ADD UNIQUE NULLS NOT DISTINCT (%s)', rollup_name, group_keys);
+
+    INSERT INTO htap_rollups (relid, rollup, columns, merge_sql)
+    VALUES (quote_ident(tbl_name)::regclass,
+            quote_ident(rollup_name)::regclass,
+            columns,
+            format('INSERT INTO %I AS r %s ON CONFLICT (%s) DO %s',
+                   rollup_name,
+                   replace(select_sql, 'unnest(%s)',
+                           (SELECT 'unnest(' || string_agg('$' || g, ', ') || ')'
+                            FROM generate_series(1, cardinality(columns)) g)),
+                   group_keys,
+                   CASE WHEN merge_sets = '' THEN 'NOTHING'
+                        ELSE 'UPDATE SET ' || merge_sets END));
+
+    RAISE NOTICE 'Rollup % of table % created.', rollup_name, tbl_name;
+END;
+$$;
+
+CREATE OR REPLACE PROCEDURE htap_drop_rollup(rollup_name TEXT)
+LANGUAGE plpgsql AS $$
+BEGIN
+    DELETE FROM htap_rollups WHERE rollup = to_regclass(quote_ident(rollup_name));
+    EXECUTE format('DROP TABLE IF EXISTS %I', rollup_name);
+END;
+$$;
+
+-- pipeline statistics, kept in shared memory by the worker; times in ms
+
+CREATE OR REPLACE FUNCTION htap_stat(
+    OUT pid              INT,
+    OUT received_lsn     PG_LSN,
+    OUT applied_lsn      PG_LSN,
+    OUT last_commit_time TIMESTAMPTZ,
+    OUT last_apply_time  TIMESTAMPTZ,
+    OUT transactions     BIGINT,
+    OUT rows_applied     BIGINT,
+    OUT bytes_applied    BIGINT,
+    OUT batches          BIGINT,
+    OUT fetch_time       FLOAT8,
+    OUT decode_time      FLOAT8,
+    OUT apply_time       FLOAT8,
+    OUT commit_time      FLOAT8,
+    OUT errors           BIGINT,
+    OUT slot_name        TEXT,
+    OUT publication      TEXT
+)
+RETURNS record
+AS 'MODULE_PATHNAME', 'htap_stat'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE OR REPLACE FUNCTION htap_stat_tables(
+    OUT relid           OID,
+    OUT rows_inserted   BIGINT,
+    OUT rows_deleted    BIGINT,
+    OUT batches         BIGINT,
+    OUT apply_time      FLOAT8,
+    OUT last_apply_time TIMESTAMPTZ
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'htap_stat_tables'
+LANGUAGE C STRICT VOLATILE;
+
+-- lag_time is the age of the last applied commit while received changes
+-- are still waiting to be applied
+
+CREATE OR REPLACE VIEW pg_stat_htap AS
+SELECT s.pid,
+       s.received_lsn,
+       s.applied_lsn,
+       pg_wal_lsn_diff(pg_current_wal_lsn(), s.applied_lsn) AS lag_bytes,
+       CASE WHEN s.received_lsn > s.applied_lsn
+            THEN now() - s.last_commit_time
+            ELSE interval '0'
+       END AS lag_time,
+       s.last_commit_time,
+       s.last_apply_time,
+       s.transactions,
+       s.rows_applied,
+       s.bytes_applied,
+       s.batches,
+       s.fetch_time,
+       s.decode_time,
+       s.apply_time,
+       s.commit_time,
+       s.errors,
+       s.slot_name,
+       s.publication
+FROM htap_stat() s;
+
+CREATE OR REPLACE VIEW pg_stat_htap_tables AS
+SELECT t.relid,
+       t.relid::regclass AS relname,
+       t.rows_inserted,
+       t.rows_deleted,
+       t.batches,
+       t.apply_time,
+       t.last_apply_time
+FROM htap_stat_tables() t;
+
+-- block until the worker has applied everything up to an LSN, for
+-- read-your-writes queries on the mirrors; false on timeout (0: none)
+
+CREATE OR REPLACE FUNCTION htap_wait_for_lsn(target_lsn PG_LSN, timeout_ms BIGINT DEFAULT 0)
+RETURNS BOOLEAN
+AS 'MODULE_PATHNAME', 'htap_wait_for_lsn'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE OR REPLACE FUNCTION htap_wait_for_current(timeout_ms BIGINT DEFAULT 0)
+RETURNS BOOLEAN
+AS 'MODULE_PATHNAME', 'htap_wait_for_current'
+LANGUAGE C STRICT VOLATILE;
+
+-- fresh reads: the mirror plus the heap rows not applied to it yet.
+-- Needs row_to_column.fresh_reads; only heap pages not all-visible are
+-- scanned.  Example: SELECT count(*) FROM htap_fresh(NULL::orders);
+
+CREATE OR REPLACE FUNCTION htap_delta(tbl ANYELEMENT, OUT is_new BOOLEAN, OUT r ANYELEMENT)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'htap_delta'
+LANGUAGE C VOLATILE;
+
+CREATE OR REPLACE FUNCTION htap_fresh(tbl ANYELEMENT)
+RETURNS SETOF ANYELEMENT
+LANGUAGE plpgsql AS $$
+DECLARE
+    tbl_name TEXT;
+    has_pk   BOOLEAN;
+    columns  TEXT;
+    key_cmp  TEXT;
+BEGIN
+    SELECT c.relname INTO tbl_name
+    FROM pg_class c
+    WHERE c.reltype = pg_typeof(tbl)::oid;
+
+    IF tbl_name IS NULL THEN
+        RAISE EXCEPTION 'htap_fresh() needs a row of a table, not %', pg_typeof(tbl);
+    END IF;
+
+    -- the heap rows of the delta are whole and unfiltered
+    IF htap_pub_spec(tbl_name) <> '' THEN
+        RAISE EXCEPTION 'htap_fresh() needs a mirror of every column and row of "%"', tbl_name;
+    END IF;
+
+    SELECT EXISTS (
+        SELECT 1 FROM pg_index
+        WHERE indrelid = quote_ident(tbl_name)::regclass
+          AND indisprimary
+    ) INTO has_pk;
+
+    SELECT string_agg(format('c.%I', attname), ', ' ORDER BY attnum)
+    INTO columns
+    FROM pg_attribute
+    WHERE attrelid = quote_ident(tbl_name)::regclass
+      AND attnum > 0
+      AND NOT attisdropped;
+
+    SELECT string_agg(
+               format(CASE WHEN has_pk THEN '(d.r).%1$I = c.%1$I'
+                           ELSE '(d.r).%1$I IS NOT DISTINCT FROM c.%1$I' END,
+                      attname),
+               ' AND ')
+    INTO key_cmp
+    FROM htap_identity_columns(tbl_name);
+
+    -- a mirror row gives way to any version of it in the delta: new ones
+    -- replace it, retired ones remove it
+    RETURN QUERY EXECUTE format(
+        'WITH d AS MATERIALIZED (SELECT x.is_new, x.r FROM htap_delta($1) x) '
+        'SELECT (d.r).* FROM d WHERE d.is_new '
+        'UNION ALL '
+        'SELECT %2$s FROM %1$I_col_live c '
+        'WHERE NOT EXISTS (SELECT 1 FROM d WHERE d.is_new IS NULL) '
+        'AND NOT EXISTS (SELECT 1 FROM d WHERE d.is_new IS NOT NULL AND %3$s)',
+        tbl_name, columns, key_cmp
+    ) USING tbl;
+END;
+$$;
@@ -3,31 +3,258 @@
 #include "miscadmin.h"
 
 #include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
 #include "storage/latch.h"
 #include "storage/proc.h"
 #include "storage/ipc.h"
+#include "storage/dsm.h"
+#include "storage/shm_mq.h"
+#include "storage/shm_toc.h"
+#include "storage/spin.h"
+#include "storage/shmem.h"
+#include "storage/lwlock.h"
+#include "storage/condition_variable.h"
+#include "storage/bufmgr.h"
+#include "storage/buffile.h"
+#include "storage/procarray.h"
+#include "access/twophase.h"
+#include "access/xact.h"
+#include "access/xlog.h"
+#include "access/transam.h"
+#include "access/visibilitymap.h"
+#include "replication/slot.h"
 
 #include "executor/spi.h"
+#include "funcapi.h"
+#include "access/htup_details.h"
+#include "utils/timestamp.h"
 #include "utils/snapmgr.h"
 #include "utils/memutils.h"
 
+#include "access/genam.h"
+#include "access/heapam.h"
+#include "access/relation.h"
+#include "access/table.h"
+#include "access/tableam.h"
+#include "executor/executor.h"
+#include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
+#include "optimizer/planner.h"
+#include "parser/parsetree.h"
+#include "rewrite/rewriteHandler.h"
+#include "partitioning/partbounds.h"
+#include "partitioning/partdesc.h"
+#include "utils/partcache.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/pg_lsn.h"
+#include "utils/rel.h"
+
+#include "catalog/pg_am.h"
+#include "catalog/pg_inherits.h"
+#include "catalog/pg_class.h"
 #include "catalog/pg_type.h"
+#include "commands/dbcommands.h"
+#include "common/pg_lzcompress.h"
 #include "lib/stringinfo.h"
 #include "libpq/pqformat.h"
 #include "replication/logicalproto.h"
+#include "replication/origin.h"
+#include "replication/walreceiver.h"
+#include "utils/guc.h"
+#include "utils/json.h"
+#include "utils/wait_event.h"
+#include "portability/instr_time.h"
+
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef ENABLE_DTRACE
+#include <sys/sdt.h>
+#endif
 
 #include "utils/hsearch.h"
 #include "nodes/pg_list.h"
 
-#include <stdio.h>
-#include <sys/stat.h>
-#include <unistd.h>
-#include <errno.h>
 
-#define R2C_TMP_DIR "/tmp/row_to_column"
+PG_MODULE_MAGIC;
 
+#define R2C_MAX_WORKERS 16              /* entries of row_to_column.workers */
+#define R2C_PUBLICATION "htap_pub"     /* of an entry that names none */
 
-PG_MODULE_MAGIC;
+/* ---------- GUCS ---------- */
+typedef enum R2CMode
+{
+    R2C_MODE_POLL,   /* pg_logical_slot_get_binary_changes() every cycle */
+    R2C_MODE_STREAM  /* START_REPLICATION ... LOGICAL over a walsender */
+} R2CMode;
+
+static const struct config_enum_entry r2c_mode_options[] = {
+    {"poll", R2C_MODE_POLL, false},
+    {"stream", R2C_MODE_STREAM, false},
+    {NULL, 0, false}
+};
+
+static int r2c_mode = R2C_MODE_POLL;
+static char *r2c_conninfo = NULL;
+static int r2c_max_changes_per_cycle = 100000;
+static int r2c_max_bytes_per_cycle = 65536; /* kB */
+static int r2c_max_buffer_memory = 262144; /* kB */
+static int r2c_apply_workers = 0;
+static int r2c_flush_rows = 100000;
+static int r2c_flush_bytes = 16384;       /* kB */
+static int r2c_flush_interval_ms = 1000;
+static double r2c_stripe_fill = 1.0;
+static int r2c_max_hold_ms = 30000;
+static int r2c_codec_sample_rows = 0;
+static int r2c_codec_min_mbps = 50;
+static bool r2c_compaction = false;
+static int r2c_compaction_naptime = 60;     /* s */
+static char *r2c_compaction_window = NULL;
+static int r2c_compaction_min_stripes = 16;
+static double r2c_compaction_fill = 0.5;
+static int r2c_proto_version = 1;
+static bool r2c_binary = false;
+static bool r2c_fresh_reads = false;
+static bool r2c_streaming = false;
+static bool r2c_route_to_mirror = false;
+static int r2c_route_max_lag = 16384;      /* kB */
+static int r2c_route_min_rows = 100000;
+static char *r2c_workers = NULL;
+
+/* HH:MM-HH:MM, may wrap past midnight; empty for any time */
+static bool
+r2c_compaction_window_check(char **newval, void **extra, GucSource source)
+{
+    int sh, sm, eh, em;
+    char extra_char;
+
+    if (*newval == NULL || (*newval)[0] == '\0')
+        return true;
+
+    if (sscanf(*newval, "%d:%d-%d:%d%c", &sh, &sm, &eh, &em, &extra_char) != 4 ||
+        sh < 0 || sh > 23 || eh < 0 || eh > 23 ||
+        sm < 0 || sm > 59 || em < 0 || em > 59)
+    {
+        GUC_check_errdetail("Expected a range of times like \"01:00-05:30\".");
+        return false;
+    }
+    return true;
+}
+
+/* One entry of row_to_column.workers, see LAUNCHER */
+typedef struct R2CWorkerConf
+{
+    char database[NAMEDATALEN];
+    char slot_name[NAMEDATALEN];
+    char publication[NAMEDATALEN];
+} R2CWorkerConf;
+
+/*
+ * Split a list of database:slot[:publication] entries into confs, which
+ * has room for R2C_MAX_WORKERS.  Returns the number of entries, or -1 with
+ * *detail set.  A database takes one entry: its mirrors and ddl_queue can
+ * only be fed by one worker.
+ */
+static int
+r2c_workers_parse(const char *value, R2CWorkerConf *confs, const char **detail)
+{
+    char *copy = pstrdup(value ? value : "");
+    char *save = NULL;
+    int n = 0;
+
+    for (char *entry = strtok_r(copy, ",", &save); entry;
+         entry = strtok_r(NULL, ",", &save))
+    {
+        char *fields[3] = {NULL, NULL, NULL};
+        int nfields = 0;
+        char *field;
+
+        while (nfields < 3 && (field = entry) != NULL)
+        {
+            char *end;
+
+            entry = strchr(entry, ':');
+            if (entry)
+                *entry++ = '\0';
+
+            while (*field == ' ' || *field == '\t')
+                field++;
+            end = field + strlen(field);
+            while (end > field && (end[-1] == ' ' || end[-1] == '\t'))
+                *--end = '\0';
+            fields[nfields++] = field;
+        }
+
+        if (nfields == 1 && fields[0][0] == '\0')
+            continue;
+        if (entry != NULL || nfields < 2 || fields[0][0] == '\0' || fields[1][0] == '\0')
+        {
+            *detail = "Entries look like database:slot or database:slot:publication.";
+            return -1;
+        }
+        if (n == R2C_MAX_WORKERS)
+        {
+            *detail = "At most " CppAsString2(R2C_MAX_WORKERS) " entries are supported.";
+            return -1;
+        }
+        for (int f = 0; f < nfields; f++)
+            if (strlen(fields[f]) >= NAMEDATALEN)
+            {
+                *detail = "Names must be shorter than NAMEDATALEN.";
+                return -1;
+            }
+
+        MemSet(&confs[n], 0, sizeof(R2CWorkerConf));
+        strlcpy(confs[n].database, fields[0], NAMEDATALEN);
+        strlcpy(confs[n].slot_name, fields[1], NAMEDATALEN);
+        strlcpy(confs[n].publication,
+                nfields == 3 && fields[2][0] != '\0' ? fields[2] : R2C_PUBLICATION,
+                NAMEDATALEN);
+
+        for (int i = 0; i < n; i++)
+            if (strcmp(confs[i].database, confs[n].database) == 0 ||
+                strcmp(confs[i].slot_name, confs[n].slot_name) == 0)
+            {
+                *detail = "Each database and each slot may appear only once.";
+                return -1;
+            }
+        n++;
+    }
+
+    pfree(copy);
+    return n;
+}
+
+static bool
+r2c_workers_check(char **newval, void **extra, GucSource source)
+{
+    R2CWorkerConf confs[R2C_MAX_WORKERS];
+    const char *detail = NULL;
+
+    if (r2c_workers_parse(*newval, confs, &detail) < 0)
+    {
+        GUC_check_errdetail("%s", detail);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Protocol version to ask pgoutput for; binary values and streaming need
+ * version 2.  Only stream mode asks for streaming, see STREAMED TRANSACTIONS.
+ */
+static int r2c_requested_proto_version(void)
+{
+    return (r2c_binary || (r2c_streaming && r2c_mode == R2C_MODE_STREAM))
+               ? Max(r2c_proto_version, 2)
+               : r2c_proto_version;
+}
 
 /* ---------- SIGNAL HANDLING ---------- */
 static volatile sig_atomic_t got_sigterm = false;
@@ -41,42 +268,155 @@ static void handle_sigterm(SIGNAL_ARGS)
 }
 
 /* ---------- RELATION CACHE ---------- */
-#define MAX_COLS 128
-
 typedef struct RelInfo
 {
     Oid relid;
     char relname[NAMEDATALEN];
     int ncols;
-    Oid coltypes[MAX_COLS];
+    int generation;                      /* bumped by each RELATION message */
+    int64 stripe_rows;                   /* of its mirror, 0: not columnar, -1: unknown */
+    int64 chunk_group_rows;
+    Oid *coltypes;                       /* ncols each, in relmap_cxt */
+    char **colnames;
 } RelInfo;
 
 static HTAB *relmap = NULL;
+static MemoryContext relmap_cxt = NULL;
+
+typedef struct RelLsn
+{
+    Oid relid;
+    XLogRecPtr lsn;
+} RelLsn;
+
+/*
+ * Tables being converted by htap_convert(), from the htap_sync rows.  They
+ * join the publication before the initial copy takes its snapshot, so
+ * their changes are dropped until the row gets the copy's LSN (invalid
+ * before), and then those of transactions committed before it: the copy
+ * has them already.
+ */
+static HTAB *sync_states = NULL;
+
+/*
+ * How far each relation had been applied, from htap_progress when the
+ * worker started.  Transactions committed before that are in its mirror
+ * already, see HELD ROWS.
+ */
+static HTAB *rel_progress = NULL;
+
+/*
+ * Relations with rollups, from the htap_rollups rows seen, see ROLLUPS.
+ * Entries stay until the worker restarts: a dropped rollup only has its
+ * rows copied for nothing.
+ */
+static HTAB *rollup_relids = NULL;
 
 /* ---------- TXN BUFFER ---------- */
 typedef struct TxnBuf
 {
-    List *sqls;
-    List *batches; /* list of BatchEntry* */
+    MemoryContext cxt;   /* holds the buffer and everything it refers to */
+    List *batches; /* list of BatchEntry*, DDL barriers among them */
+    int nddls;           /* of those, DDL barriers */
+    bool committed;      /* COMMIT seen; only then may it be applied */
+    XLogRecPtr end_lsn;  /* end of the commit record */
+    XLogRecPtr final_lsn; /* start of the commit record, from BEGIN */
+    Size bytes;          /* decoded data held by this buffer */
+    uint64 nrows;        /* rows held in its batches */
+    int ntxns;           /* transactions merged into it */
+    BufFile *spill;      /* older rows of its batches, see SPILL FILES */
+    Size spilled_bytes;  /* of bytes, those in spill */
+    TimestampTz first_change; /* when its oldest change was received */
+    TimestampTz commit_time;  /* of its (last) transaction on the source */
     struct TxnBuf *next;
 } TxnBuf;
 
+/*
+ * The mirror is append-only.  INSERTs and the new side of UPDATEs add row
+ * versions to <rel>_col; DELETEs and the old side of UPDATEs add the
+ * replica identity to the delete vector <rel>_col_dv.  Every row carries
+ * the LSN of its change, <rel>_col_live keeps the versions not superseded.
+ * Rows INSERTed into a relation with rollups are also copied to a rollup
+ * batch, which is decoded with the metadata of <rel>_col.
+ *
+ * A ddl_queue statement is a barrier in the list of batches: it runs after
+ * the batches of its relation before it and before those after it, which
+ * start new batches.  Those of other relations are not ordered by it.
+ */
+#define BATCH_INSERT 'I' /* row versions, into <rel>_col */
+#define BATCH_DELETE 'D' /* replica identities, into <rel>_col_dv */
+#define BATCH_ROLLUP 'R' /* inserted rows, folded into the rollups of <rel> */
+#define BATCH_DDL    'Q' /* ddl_queue statement in data, see DDL BARRIERS */
+#define BATCH_RETYPE 'T' /* one that changes column types, may run in the background */
+
+#define batch_is_ddl(be) ((be)->kind == BATCH_DDL || (be)->kind == BATCH_RETYPE)
+
 typedef struct BatchEntry
 {
-    char *table; /* target table name, e.g., relname_col */
-    char *path;  /* filesystem path to CSV file */
-    int nrows;
+    Oid relid;           /* source relation, InvalidOid for DDL of all */
+    char kind;           /* BATCH_INSERT, BATCH_DELETE, BATCH_ROLLUP, or DDL */
+    int generation;      /* RelInfo generation the rows were decoded with */
+    char *table;         /* target table name, e.g., relname_col */
+    int ncols;           /* source column names, targets map by name */
+    char **colnames;
+    Oid *coltypes;       /* source column types, for binary values */
+    StringInfoData data; /* rows as LSN + raw pgoutput TupleData, back to back */
+    int nrows;           /* of those in data */
+    XLogRecPtr first_lsn; /* lowest and highest LSN of the rows in data */
+    XLogRecPtr last_lsn;
+    List *spilled;       /* SpillSegment *, rows before data in the spill file */
 } BatchEntry;
 
 static TxnBuf *txn_head = NULL;
 static TxnBuf *txn_tail = NULL;
 
+/*
+ * Every transaction buffer allocates from a generation context of its own,
+ * made for data that is appended to and then freed all at once: releasing
+ * a buffer is a single MemoryContextDelete.  They all hang off txn_cxt, so
+ * buffers do not depend on the transaction, if any, the worker is in.
+ */
+static MemoryContext txn_cxt = NULL;
+
+/* End LSN of the last transaction applied locally */
+static XLogRecPtr applied_lsn = InvalidXLogRecPtr;
+
+/*
+ * Progress of the worker's replication origin when it started: every
+ * transaction committed before it is in the mirrors.  Set up by
+ * origin_setup(), see BGWORKER MAIN.
+ */
+static bool origin_active = false;
+static XLogRecPtr origin_start_lsn = InvalidXLogRecPtr;
+
+/* Decoded data held in memory by all buffers, checked against the caps */
+static Size buffered_bytes = 0;
+
+#define buffer_limit_reached() \
+    (buffered_bytes >= (Size) r2c_max_bytes_per_cycle * 1024)
+
+/* What a buffer holds in memory */
+#define txn_memory(txn) ((txn)->bytes - (txn)->spilled_bytes)
+
 /* Create a new transaction buffer */
 static TxnBuf *txn_create(void)
 {
-    TxnBuf *txn = palloc0(sizeof(TxnBuf));
-    txn->sqls = NIL;
+    MemoryContext cxt;
+    TxnBuf *txn;
+
+    if (!txn_cxt)
+        txn_cxt = AllocSetContextCreate(TopMemoryContext,
+                                        "row_to_column transactions",
+                                        ALLOCSET_SMALL_SIZES);
+    cxt = GenerationContextCreate(txn_cxt, "row_to_column transaction",
+                                  ALLOCSET_DEFAULT_SIZES);
+
+    txn = MemoryContextAllocZero(cxt, sizeof(TxnBuf));
+    txn->cxt = cxt;
     txn->batches = NIL;
+    txn->nddls = 0;
+    txn->ntxns = 1;
+    txn->first_change = GetCurrentTimestamp();
     txn->next = NULL;
     return txn;
 }
@@ -96,369 +436,7476 @@ static void txn_push(TxnBuf *txn)
     }
 }
 
-/* Append SQL to a transaction buffer */
-static void txn_append_sql(TxnBuf *txn, const char *sql)
+/* Append a DDL barrier for relid, InvalidOid for all, to a transaction buffer */
+static void txn_append_ddl(TxnBuf *txn, Oid relid, char kind, const char *sql, int len)
 {
+    MemoryContext oldcxt;
+    BatchEntry *be;
+
     if (!txn || !sql)
         return;
-    txn->sqls = lappend(txn->sqls, pstrdup(sql));
+    oldcxt = MemoryContextSwitchTo(txn->cxt);
+    be = palloc0(sizeof(BatchEntry));
+    be->relid = relid;
+    be->kind = kind;
+    be->table = pstrdup("ddl_queue");
+    initStringInfo(&be->data);
+    appendBinaryStringInfo(&be->data, sql, len);
+    txn->batches = lappend(txn->batches, be);
+    txn->nddls++;
+    MemoryContextSwitchTo(oldcxt);
+    txn->bytes += len;
+    buffered_bytes += len;
 }
 
-/* Ensure temporary directory exists (ignore errors if it already exists) */
-static void
-ensure_tmp_dir(void)
+/* The open transaction buffer, started if changes arrive without BEGIN */
+static TxnBuf *txn_current(void)
 {
-    struct stat st;
-    if (stat(R2C_TMP_DIR, &st) == 0)
-    {
-        if ((st.st_mode & S_IFDIR) != S_IFDIR)
-            elog(WARNING, "%s exists and is not a directory", R2C_TMP_DIR);
-        return;
-    }
-
-    if (mkdir(R2C_TMP_DIR, 0700) != 0 && errno != EEXIST)
-        elog(WARNING, "could not create tmp dir %s: %m", R2C_TMP_DIR);
+    if (!txn_tail)
+        txn_push(txn_create());
+    return txn_tail;
 }
 
-/* Append a single value-tuple to a per-relation CSV file and register the batch */
-static void
-txn_append_values(TxnBuf *txn, Oid relid, const char *relname, const char *target_table, const char *tuple)
+/*
+ * The batch in batches that rows of relid of the given kind and generation
+ * go on in: one after the last DDL barrier for relid, or NULL.
+ */
+static BatchEntry *
+batch_find(List *batches, Oid relid, char kind, int generation)
 {
     ListCell *lc;
-    BatchEntry *be = NULL;
-    char path[PATH_MAX];
-
-    if (!txn || !relname || !target_table || !tuple)
-        return;
+    BatchEntry *found = NULL;
 
-    ensure_tmp_dir();
-
-    snprintf(path, sizeof(path), "%s/%u_%s.csv", R2C_TMP_DIR, (unsigned)relid, relname);
-
-    /* find existing batch entry */
-    foreach (lc, txn->batches)
+    foreach (lc, batches)
     {
-        BatchEntry *curr = (BatchEntry *) lfirst(lc);
-        if (strcmp(curr->path, path) == 0)
+        BatchEntry *be = (BatchEntry *) lfirst(lc);
+
+        if (batch_is_ddl(be))
         {
-            be = curr;
-            break;
+            if (!OidIsValid(be->relid) || be->relid == relid)
+                found = NULL;
         }
+        else if (be->relid == relid && be->kind == kind &&
+                 be->generation == generation)
+            found = be;
     }
+    return found;
+}
 
-    if (!be)
-    {
-        be = palloc0(sizeof(BatchEntry));
-        be->table = pstrdup(target_table);
-        be->path = pstrdup(path);
-        be->nrows = 0;
-        txn->batches = lappend(txn->batches, be);
-    }
+/*
+ * Find (or start) the batch of the given kind for a source relation in this
+ * transaction.  A RELATION message in between starts a new batch, as the
+ * column list the rows were decoded with may have changed; so does DDL.
+ */
+static BatchEntry *
+txn_get_batch(TxnBuf *txn, RelInfo *r, char kind)
+{
+    BatchEntry *be;
+    MemoryContext oldcxt;
 
-    /* append tuple as one CSV line */
-    FILE *f = fopen(path, "a");
-    if (!f)
-    {
-        elog(WARNING, "could not open CSV file %s for append: %m", path);
+    be = batch_find(txn->batches, r->relid, kind, r->generation);
+    if (be)
+        return be;
+
+    oldcxt = MemoryContextSwitchTo(txn->cxt);
+    be = palloc0(sizeof(BatchEntry));
+    be->relid = r->relid;
+    be->kind = kind;
+    be->generation = r->generation;
+    be->table = psprintf(kind == BATCH_DELETE ? "%s_col_dv" : "%s_col",
+                         r->relname);
+    be->ncols = r->ncols;
+    be->colnames = palloc(r->ncols * sizeof(char *));
+    for (int i = 0; i < r->ncols; i++)
+        be->colnames[i] = pstrdup(r->colnames[i]);
+    be->coltypes = palloc(r->ncols * sizeof(Oid));
+    memcpy(be->coltypes, r->coltypes, r->ncols * sizeof(Oid));
+    initStringInfo(&be->data);
+    be->nrows = 0;
+    txn->batches = lappend(txn->batches, be);
+    MemoryContextSwitchTo(oldcxt);
+    return be;
+}
+
+/* Widen the LSN range of be's rows to take in first..last */
+static void
+batch_lsn_add(BatchEntry *be, XLogRecPtr first, XLogRecPtr last)
+{
+    if (XLogRecPtrIsInvalid(first))
         return;
-    }
-    /* tuple is already formatted, write and newline */
-    if (fputs(tuple, f) == EOF || fputc('\n', f) == EOF)
-        elog(WARNING, "failed to write to CSV file %s: %m", path);
-    fclose(f);
+    if (XLogRecPtrIsInvalid(be->first_lsn) || first < be->first_lsn)
+        be->first_lsn = first;
+    if (last > be->last_lsn)
+        be->last_lsn = last;
+}
 
+/* Append one row, stamped with the LSN of its change, to a batch */
+static void
+txn_append_row(TxnBuf *txn, BatchEntry *be, XLogRecPtr lsn,
+               const char *tuple, int len)
+{
+    pq_sendint64(&be->data, lsn);
+    batch_lsn_add(be, lsn, lsn);
+    appendBinaryStringInfo(&be->data, tuple, len);
+    txn->bytes += len + sizeof(int64);
+    buffered_bytes += len + sizeof(int64);
+    txn->nrows++;
     be->nrows++;
 }
 
-/* Execute a single transaction buffer */
-static int
-txn_process_buffer(TxnBuf *txn)
+/* ---------- STATISTICS ---------- */
+#define HTAP_STAT_MAX_TABLES 1024
+#define R2C_MAX_FAULTS 8
+
+/* A batch whose rows failed with a data error, by the LSNs of its rows */
+typedef struct BatchFault
 {
-    ListCell *lc;
-    int rows = 0;
+    Oid relid;
+    char kind;
+    XLogRecPtr first_lsn;
+    XLogRecPtr last_lsn;
+} BatchFault;
 
-    if (!txn)
-        return 0;
+/*
+ * Shared counters behind the pg_stat_htap and pg_stat_htap_tables views,
+ * one HtapStats per entry of row_to_column.workers.  The main worker
+ * collects timings locally and publishes them with stat_report() once per
+ * cycle or flush; per-table counters are bumped by whichever process
+ * applied the batch.
+ */
+typedef struct HtapStats
+{
+    slock_t mutex;
+    LWLock *lock;                  /* protects the per-table hash */
+    ConditionVariable applied_cv;  /* broadcast when applied_lsn moves */
+    bool in_use;                   /* the launcher cleared all below for conf */
+    Oid database_id;
+    R2CWorkerConf conf;
+    int pid;                       /* main worker, 0 while none runs */
+    int compactor_pid;
+    Latch *compactor_latch;        /* set to have it look for retypes at once */
+    Latch *worker_latch;           /* set to make it apply without delay */
+    XLogRecPtr flush_request_lsn;  /* highest LSN a backend is waiting for */
+    Oid compact_relid;             /* source relation whose mirror is being rewritten */
+    XLogRecPtr received_lsn;
+    XLogRecPtr applied_lsn;
+    TimestampTz last_commit_time;  /* of the last applied transaction */
+    TimestampTz last_apply_time;
+    uint64 transactions;
+    uint64 rows;
+    uint64 bytes;
+    uint64 batches;
+    uint64 errors;
+    int64 fetch_us;
+    int64 decode_us;
+    int64 apply_us;
+    int64 commit_us;
+    BatchFault faults[R2C_MAX_FAULTS]; /* batches that failed, see batch_apply() */
+    int next_fault;
+} HtapStats;
 
-    /* First, perform COPY for each batch (per-relation CSV file) */
-    foreach (lc, txn->batches)
-    {
-        BatchEntry *be = (BatchEntry *) lfirst(lc);
-        StringInfoData sql;
-        initStringInfo(&sql);
+typedef struct HtapTableKey
+{
+    Oid database_id;
+    Oid relid;                     /* source relation */
+} HtapTableKey;
 
-        appendStringInfo(&sql, "COPY %s FROM '%s' WITH (FORMAT csv)", be->table, be->path);
+typedef struct HtapTableStats
+{
+    HtapTableKey key;
+    uint64 rows_inserted;          /* row versions written to the mirror */
+    uint64 rows_deleted;           /* identities written to the delete vector */
+    uint64 batches;
+    int64 apply_us;
+    TimestampTz last_apply_time;
+} HtapTableStats;
 
-        int rc = SPI_execute(sql.data, false, 0);
-        if (rc < 0)
-            elog(LOG, "SPI_execute COPY failed: %s", sql.data);
-        else
-            rows += SPI_processed;
+/*
+ * Applied snapshot for htap_fresh(), see FRESH READS.  xids holds xip
+ * followed by subxip, sized for the largest snapshot this server can take:
+ * what GetMaxSnapshotXidCount() and GetMaxSnapshotSubxidCount() would say,
+ * worked out from the settings as the procarray does not exist yet when
+ * shared memory is requested.
+ */
+typedef struct HtapAppliedSnapshot
+{
+    uint64 generation;             /* bumped whenever it changes */
+    bool valid;
+    TransactionId applied_xid;     /* committed after everything it covers */
+    TransactionId xmin;
+    TransactionId xmax;
+    uint32 xcnt;
+    int32 subxcnt;
+    TransactionId xids[FLEXIBLE_ARRAY_MEMBER];
+} HtapAppliedSnapshot;
 
-        /* truncate the CSV file after successful COPY (best-effort) */
-        FILE *f = fopen(be->path, "w");
-        if (f)
-            fclose(f);
+static HtapStats *htap_workers = NULL;       /* R2C_MAX_WORKERS of them */
+static char *applied_snapshots = NULL;      /* as many, applied_snapshot_size() apart */
+static HTAB *htap_table_stats = NULL;
+static LWLock *applied_snapshot_lock = NULL;
 
-        pfree(sql.data);
-    }
+/* Those of the worker this process belongs to, or the backend's database */
+static HtapStats *htap_stats = NULL;
+static HtapAppliedSnapshot *applied_snapshot = NULL;
 
-    /* Then execute any DDL/other SQLs (ddl_queue entries), one by one */
-    foreach (lc, txn->sqls)
-    {
-        char *sql = lfirst(lc);
-        int rc = SPI_execute(sql, false, 0);
-        if (rc < 0)
-            elog(LOG, "SPI_execute failed: %s", sql);
-        rows += SPI_processed;
-    }
+/* What the main worker and its compactor replicate, copied at start */
+static R2CWorkerConf worker_conf;
 
-    /* cleanup batches */
-    foreach (lc, txn->batches)
-    {
-        BatchEntry *be = (BatchEntry *) lfirst(lc);
-        pfree(be->table);
-        pfree(be->path);
-        pfree(be);
-    }
-    list_free(txn->batches);
+/* Not yet published by this process */
+static HtapStats local_stats;
 
-    list_free_deep(txn->sqls);
-    pfree(txn);
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static emit_log_hook_type prev_emit_log_hook = NULL;
 
-    return rows;
-}
+/* Set in the main and apply workers, whose errors are counted */
+static bool am_htap_worker = false;
 
-/* Execute all ready transactions in the list and remove them */
-static void txn_process_all(void)
+static Size
+applied_snapshot_size(void)
 {
-    TimestampTz start_time = GetCurrentTimestamp();
-    int total_rows = 0;
+    Size procs = add_size(MaxBackends, max_prepared_xacts);
 
-    while (txn_head)
-    {
-        TxnBuf *next = txn_head->next;
-        total_rows += txn_process_buffer(txn_head);
-        txn_head = next;
-    }
-    txn_tail = NULL;
+    return add_size(offsetof(HtapAppliedSnapshot, xids),
+                    mul_size(add_size(procs, mul_size(PGPROC_MAX_CACHED_SUBXIDS + 1, procs)),
+                             sizeof(TransactionId)));
+}
 
-    TimestampTz end_time = GetCurrentTimestamp();
-    double elapsed_ms = TimestampDifferenceMilliseconds(start_time, end_time);
-    double elapsed_sec = elapsed_ms / 1000.0;
+static Size
+stat_shmem_size(void)
+{
+    Size size = mul_size(R2C_MAX_WORKERS, MAXALIGN(sizeof(HtapStats)));
 
-    if (elapsed_sec > 0)
-        elog(LOG, "BGWorker throughput: %.2f rows/sec (total %d rows in %.3f ms)",
-             total_rows / elapsed_sec, total_rows, elapsed_ms);
+    size = add_size(size, mul_size(R2C_MAX_WORKERS, MAXALIGN(applied_snapshot_size())));
+    return add_size(size,
+                    hash_estimate_size(HTAP_STAT_MAX_TABLES, sizeof(HtapTableStats)));
 }
 
-/* ---------- HELPERS ---------- */
-static bool needs_quotes(Oid typid)
+static void
+stat_shmem_request(void)
 {
-    switch (typid)
-    {
-    case INT2OID:
-    case INT4OID:
-    case INT8OID:
-    case FLOAT4OID:
-    case FLOAT8OID:
-    case NUMERICOID:
-        return false;
-    }
-    return true;
+    if (prev_shmem_request_hook)
+        prev_shmem_request_hook();
+
+    RequestAddinShmemSpace(stat_shmem_size());
+    RequestNamedLWLockTranche("row_to_column", 2);
 }
 
-/* ---------- PGOUTPUT DECODER ---------- */
-static void decode_pgoutput(bytea *data)
+static void
+stat_shmem_startup(void)
 {
-    if (!data)
-        return;
-
-    StringInfoData msg;
-    msg.data = VARDATA_ANY(data);
-    msg.len = VARSIZE_ANY_EXHDR(data);
-    msg.maxlen = msg.len;
-    msg.cursor = 0;
+    HASHCTL ctl;
+    bool found;
 
-    if (msg.len <= 0)
-        return;
+    if (prev_shmem_startup_hook)
+        prev_shmem_startup_hook();
 
-    char tag = pq_getmsgbyte(&msg);
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
 
-    switch (tag)
-    {
-    case 'B': // BEGIN
+    htap_workers = ShmemInitStruct("row_to_column stats",
+                                   mul_size(R2C_MAX_WORKERS, sizeof(HtapStats)), &found);
+    if (!found)
     {
-        TxnBuf *new_txn = txn_create();
-        txn_push(new_txn);
-        break;
+        MemSet(htap_workers, 0, mul_size(R2C_MAX_WORKERS, sizeof(HtapStats)));
+        for (int i = 0; i < R2C_MAX_WORKERS; i++)
+        {
+            SpinLockInit(&htap_workers[i].mutex);
+            ConditionVariableInit(&htap_workers[i].applied_cv);
+            htap_workers[i].lock = &(GetNamedLWLockTranche("row_to_column"))->lock;
+        }
     }
 
-    case 'C': // COMMIT
-        // Do nothing here; we process all committed transactions after decoding batch
-        break;
+    applied_snapshots = ShmemInitStruct("row_to_column applied snapshot",
+                                        mul_size(R2C_MAX_WORKERS,
+                                                 MAXALIGN(applied_snapshot_size())),
+                                        &found);
+    if (!found)
+        for (int i = 0; i < R2C_MAX_WORKERS; i++)
+            MemSet(applied_snapshots + i * MAXALIGN(applied_snapshot_size()), 0,
+                   offsetof(HtapAppliedSnapshot, xids));
+    applied_snapshot_lock = &(GetNamedLWLockTranche("row_to_column"))[1].lock;
 
-    case 'R': // RELATION
-    {
-        bool found;
-        RelInfo *r;
-        Oid relid = pq_getmsgint(&msg, 4);
-        pq_getmsgstring(&msg); // schema
-        r = hash_search(relmap, &relid, HASH_ENTER, &found);
-        r->relid = relid;
-        strlcpy(r->relname, pq_getmsgstring(&msg), NAMEDATALEN);
+    MemSet(&ctl, 0, sizeof(ctl));
+    ctl.keysize = sizeof(HtapTableKey);
+    ctl.entrysize = sizeof(HtapTableStats);
+    htap_table_stats = ShmemInitHash("row_to_column table stats",
+                                     HTAP_STAT_MAX_TABLES, HTAP_STAT_MAX_TABLES,
+                                     &ctl, HASH_ELEM | HASH_BLOBS);
 
-        pq_getmsgbyte(&msg); // replica identity
-        r->ncols = pq_getmsgint(&msg, 2);
+    LWLockRelease(AddinShmemInitLock);
+}
 
-        for (int i = 0; i < r->ncols; i++)
-        {
-            pq_getmsgbyte(&msg);
-            pq_getmsgstring(&msg);
-            r->coltypes[i] = pq_getmsgint(&msg, 4);
-            pq_getmsgint(&msg, 4); // typmod
-        }
+/* Make entry index of row_to_column.workers this process's */
+static void
+stat_attach(int index)
+{
+    if (!htap_workers)
+        return;
 
-        elog(LOG, "RELATION: %s (%d cols)", r->relname, r->ncols);
-        break;
-    }
+    htap_stats = &htap_workers[index];
+    applied_snapshot = (HtapAppliedSnapshot *)
+        (applied_snapshots + index * MAXALIGN(applied_snapshot_size()));
+}
 
-    case 'I': // INSERT
+/* Count the errors that end a worker; they restart and would go unseen */
+static void
+stat_emit_log(ErrorData *edata)
+{
+    if (am_htap_worker && htap_stats && edata->elevel >= ERROR)
     {
-        if (!txn_tail)
-        {
-            TxnBuf *new_txn = txn_create();
-            txn_push(new_txn);
-        }
+        SpinLockAcquire(&htap_stats->mutex);
+        htap_stats->errors++;
+        SpinLockRelease(&htap_stats->mutex);
+    }
 
-        TxnBuf *current_txn = txn_tail;
-        Oid relid = pq_getmsgint(&msg, 4);
-        char kind = pq_getmsgbyte(&msg); // N for new row
-        int ncols = pq_getmsgint(&msg, 2);
+    if (prev_emit_log_hook)
+        prev_emit_log_hook(edata);
+}
 
-        RelInfo *r = hash_search(relmap, &relid, HASH_FIND, NULL);
-        if (!r)
-        {
-            for (int i = 0; i < ncols; i++)
-            {
-                char ck = pq_getmsgbyte(&msg);
-                if (ck != 'n')
-                {
-                    int len = pq_getmsgint(&msg, 4);
-                    pq_getmsgbytes(&msg, len);
-                }
-            }
-            return;
-        }
+/* Publish what this process has collected since the last call */
+static void
+stat_report(void)
+{
+    bool advanced = false;
 
-        if (strcmp(r->relname, "ddl_queue") == 0)
-        {
-            for (int i = 0; i < ncols; i++)
-            {
-                char ck = pq_getmsgbyte(&msg);
-                if (ck == 'n' || ck == 'u')
-                    continue;
-                int len = pq_getmsgint(&msg, 4);
-                const char *val = pq_getmsgbytes(&msg, len);
-                if (i == 1) // second column = DDL SQL
-                {
-                    char *ddl_copy = palloc(len + 1);
-                    memcpy(ddl_copy, val, len);
-                    ddl_copy[len] = '\0';
-                    txn_append_sql(current_txn, ddl_copy);
-                }
-            }
-            return;
-        }
+    if (!htap_stats)
+        return;
 
-        // Regular table INSERT
-        StringInfoData sql;
-        initStringInfo(&sql);
-        appendStringInfo(&sql, "INSERT INTO %s_col VALUES (", r->relname);
+    SpinLockAcquire(&htap_stats->mutex);
+    htap_stats->pid = MyProcPid;
+    if (local_stats.received_lsn > htap_stats->received_lsn)
+        htap_stats->received_lsn = local_stats.received_lsn;
+    if (local_stats.applied_lsn > htap_stats->applied_lsn)
+    {
+        htap_stats->applied_lsn = local_stats.applied_lsn;
+        advanced = true;
 
-        for (int i = 0; i < ncols; i++)
-        {
-            char ck = pq_getmsgbyte(&msg);
-            if (ck == 'n')
-                appendStringInfoString(&sql, "NULL");
-            else
-            {
-                int len = pq_getmsgint(&msg, 4);
-                const char *val = pq_getmsgbytes(&msg, len);
-                const char *q = needs_quotes(r->coltypes[i]) ? "'" : "";
-                appendStringInfo(&sql, "%s%.*s%s", q, len, val, q);
-            }
-            if (i < ncols - 1)
-                appendStringInfoString(&sql, ", ");
-        }
-        appendStringInfoString(&sql, ");");
-        txn_append_sql(current_txn, sql.data);
-        pfree(sql.data);
-        break;
+        /* Rows applied past will not be sent again, nor their faults matter */
+        for (int i = 0; i < Min(htap_stats->next_fault, R2C_MAX_FAULTS); i++)
+            if (htap_stats->faults[i].last_lsn < htap_stats->applied_lsn)
+                htap_stats->faults[i].relid = InvalidOid;
     }
+    if (local_stats.last_commit_time != 0)
+        htap_stats->last_commit_time = local_stats.last_commit_time;
+    if (local_stats.last_apply_time != 0)
+        htap_stats->last_apply_time = local_stats.last_apply_time;
+    htap_stats->transactions += local_stats.transactions;
+    htap_stats->rows += local_stats.rows;
+    htap_stats->bytes += local_stats.bytes;
+    htap_stats->batches += local_stats.batches;
+    htap_stats->errors += local_stats.errors;
+    htap_stats->fetch_us += local_stats.fetch_us;
+    htap_stats->decode_us += local_stats.decode_us;
+    htap_stats->apply_us += local_stats.apply_us;
+    htap_stats->commit_us += local_stats.commit_us;
+    SpinLockRelease(&htap_stats->mutex);
 
+    /* Wake up htap_wait_for_lsn() callers */
+    if (advanced)
+        ConditionVariableBroadcast(&htap_stats->applied_cv);
 
-    default:
-        elog(LOG, "Unknown WAL tag: %c", tag);
-        break;
-    }
+    MemSet(&local_stats, 0, sizeof(local_stats));
 }
 
-/* ---------- BGWORKER MAIN ---------- */
-PGDLLEXPORT void row_to_column_main(Datum arg)
+/*
+ * Move the applied position forward.  Besides commits, the worker calls
+ * this when it knows nothing up to lsn is left to apply, so that waiters
+ * for positions past the last published change get their answer.
+ */
+static void
+applied_advance(XLogRecPtr lsn)
 {
-    pqsignal(SIGTERM, handle_sigterm);
-    BackgroundWorkerUnblockSignals();
-    BackgroundWorkerInitializeConnection("postgres", NULL, 0);
+    if (lsn <= applied_lsn)
+        return;
+    applied_lsn = lsn;
+    local_stats.applied_lsn = applied_lsn;
 
-    elog(LOG, "row_to_column BGWorker started");
+    /* Made durable by the commit of the transaction that applied it */
+    if (origin_active && IsTransactionState())
+        replorigin_session_origin_lsn = lsn;
+}
 
-    while (!got_sigterm)
-    {
-        StartTransactionCommand();
-        PushActiveSnapshot(GetTransactionSnapshot());
-        SPI_connect();
+/* Is a backend in htap_wait_for_lsn() waiting for more than is applied? */
+static bool
+stat_flush_requested(void)
+{
+    XLogRecPtr request;
 
-        int ret = SPI_execute(
-            "SELECT data FROM pg_logical_slot_get_binary_changes("
-            "'sample_slot2', NULL, NULL, "
-            "'proto_version','1', "
-            "'publication_names','htap_pub')",
-            true, 0);
+    if (!htap_stats)
+        return false;
 
-        if (SPI_processed == 0)
+    SpinLockAcquire(&htap_stats->mutex);
+    request = htap_stats->flush_request_lsn;
+    SpinLockRelease(&htap_stats->mutex);
+
+    return request > applied_lsn;
+}
+
+/* Source relation whose mirror the compactor is rewriting, if any */
+static Oid
+stat_compact_relid(void)
+{
+    Oid relid;
+
+    if (!htap_stats)
+        return InvalidOid;
+
+    SpinLockAcquire(&htap_stats->mutex);
+    relid = htap_stats->compact_relid;
+    SpinLockRelease(&htap_stats->mutex);
+
+    return relid;
+}
+
+static void
+stat_table(BatchEntry *be, uint64 rows, int64 elapsed_us)
+{
+    HtapTableStats *ts;
+    HtapTableKey key;
+    bool found;
+
+    if (!htap_stats || !htap_table_stats || !OidIsValid(be->relid))
+        return;
+
+    key.database_id = MyDatabaseId;
+    key.relid = be->relid;
+
+    LWLockAcquire(htap_stats->lock, LW_EXCLUSIVE);
+    ts = hash_search(htap_table_stats, &key, HASH_ENTER_NULL, &found);
+    if (ts)
+    {
+        if (!found)
+            MemSet((char *) ts + sizeof(HtapTableKey), 0,
+                   sizeof(HtapTableStats) - sizeof(HtapTableKey));
+        if (be->kind == BATCH_DELETE)
+            ts->rows_deleted += rows;
+        else
+            ts->rows_inserted += rows;
+        ts->batches++;
+        ts->apply_us += elapsed_us;
+        ts->last_apply_time = GetCurrentTimestamp();
+    }
+    LWLockRelease(htap_stats->lock);
+}
+
+/* Failures that are only logged and do not stop the worker */
+static void
+stat_count_error(void)
+{
+    if (!htap_stats)
+        return;
+
+    SpinLockAcquire(&htap_stats->mutex);
+    htap_stats->errors++;
+    SpinLockRelease(&htap_stats->mutex);
+}
+
+#define stat_elapsed_us(start) (GetCurrentTimestamp() - (start))
+
+/* ---------- INSTRUMENTATION ---------- */
+/*
+ * pg_stat_activity shows what the worker is at as a wait event of type
+ * Extension: HtapIdle while it waits for WAL, HtapFetch while it reads it,
+ * HtapApply while it writes the mirrors and HtapCommit while it commits.
+ * Waits inside a phase, for I/O or a lock, show instead while they last,
+ * and clear it.  PG 17 names the events; before, they all show as
+ * Extension.
+ *
+ * On a server configured with --enable-dtrace the worker has USDT probes
+ * in provider row_to_column too, for perf or bpftrace:
+ *   fetch__start()                            fetch__done(messages)
+ *   decode__done(messages, bytes)
+ *   flush__start(rows, bytes)                 flush__done(rows)
+ *   relation__start(relid, kind, rows, bytes) relation__done(relid, kind, rows, us)
+ *   commit__start(rows, bytes)                commit__done(rows, bytes, us)
+ *   spill(bytes, total)
+ * A flush applies one pending buffer, a relation is one batch of it.  A
+ * flush is done with the rows it applied, held ones it let go included,
+ * and a commit carries the rows and bytes of the transaction.  spill
+ * fires when a buffer is written out, see SPILL FILES.
+ */
+#ifdef ENABLE_DTRACE
+#define R2C_PROBE0(name) DTRACE_PROBE(row_to_column, name)
+#define R2C_PROBE1(name, a) DTRACE_PROBE1(row_to_column, name, a)
+#define R2C_PROBE2(name, a, b) DTRACE_PROBE2(row_to_column, name, a, b)
+#define R2C_PROBE3(name, a, b, c) DTRACE_PROBE3(row_to_column, name, a, b, c)
+#define R2C_PROBE4(name, a, b, c, d) DTRACE_PROBE4(row_to_column, name, a, b, c, d)
+#else
+#define R2C_PROBE0(name) ((void) 0)
+#define R2C_PROBE1(name, a) ((void) 0)
+#define R2C_PROBE2(name, a, b) ((void) 0)
+#define R2C_PROBE3(name, a, b, c) ((void) 0)
+#define R2C_PROBE4(name, a, b, c, d) ((void) 0)
+#endif
+
+typedef enum HtapWaitEvent
+{
+    HTAP_WAIT_IDLE,           /* worker waiting for WAL */
+    HTAP_WAIT_FETCH,          /* reading it from the slot or walsender */
+    HTAP_WAIT_APPLY,          /* writing the mirrors */
+    HTAP_WAIT_COMMIT,
+    HTAP_WAIT_APPLY_POOL,     /* for the apply workers to catch up */
+    HTAP_WAIT_COMPACTOR_IDLE,
+    HTAP_WAIT_LAUNCHER_IDLE,
+    HTAP_WAIT_APPLIED_LSN,    /* htap_wait_for_lsn() */
+    HTAP_WAIT_COPY,           /* htap_convert() for its copy workers */
+    HTAP_NUM_WAIT_EVENTS
+} HtapWaitEvent;
+
+static const char *const htap_wait_event_names[HTAP_NUM_WAIT_EVENTS] = {
+    "HtapIdle",
+    "HtapFetch",
+    "HtapApply",
+    "HtapCommit",
+    "HtapApplyPool",
+    "HtapCompactorIdle",
+    "HtapLauncherIdle",
+    "HtapAppliedLsn",
+    "HtapCopy",
+};
+
+static uint32
+htap_wait_event(HtapWaitEvent ev)
+{
+#if PG_VERSION_NUM >= 170000
+    static uint32 ids[HTAP_NUM_WAIT_EVENTS];
+
+    /* Looked up by name in shared memory, the same in every process */
+    if (ids[ev] == 0)
+        ids[ev] = WaitEventExtensionNew(htap_wait_event_names[ev]);
+    return ids[ev];
+#else
+    return PG_WAIT_EXTENSION;
+#endif
+}
+
+/*
+ * Commit the worker's transaction, timed.  It reports its statistics right
+ * after, so what they count is this transaction's.
+ */
+static void
+stat_commit(void)
+{
+    TimestampTz start = GetCurrentTimestamp();
+
+    R2C_PROBE2(commit__start, local_stats.rows, local_stats.bytes);
+    pgstat_report_wait_start(htap_wait_event(HTAP_WAIT_COMMIT));
+    CommitTransactionCommand();
+    pgstat_report_wait_end();
+    local_stats.commit_us += stat_elapsed_us(start);
+    R2C_PROBE3(commit__done, local_stats.rows, local_stats.bytes, stat_elapsed_us(start));
+}
+
+/* ---------- FRESH READS ---------- */
+#define R2C_HORIZON_SLOT "htap_horizon"
+
+/*
+ * htap_fresh() answers from a mirror plus the heap rows the worker has not
+ * applied yet.  To tell those apart the worker publishes an applied
+ * snapshot: an MVCC snapshot every transaction visible to which is in the
+ * mirrors.  A heap tuple the reader sees but the applied snapshot does not
+ * is a new row version; one it sees but the reader does not was deleted or
+ * updated since.  The worker takes a snapshot, then makes sure it decodes
+ * and applies WAL up to the insert position at that moment: everything the
+ * snapshot sees committed before that.
+ *
+ * Neither kind of tuple can be on a page the visibility map calls
+ * all-visible, so the reader only has to scan the others, provided no page
+ * is marked all-visible with tuples the applied snapshot does not see.  The
+ * worker ensures that by holding the xmin of a physical slot at the
+ * applied snapshot's xmin; a reader that sees the applied snapshot change
+ * during its scan rescans without skipping pages.
+ */
+
+/* Snapshot taken by the worker, published once applied_lsn reaches its lsn */
+static HtapAppliedSnapshot *fresh_candidate = NULL;
+static XLogRecPtr fresh_candidate_lsn = InvalidXLogRecPtr;
+
+/* Last transaction that wrote to the mirrors, visible once they are */
+static TransactionId fresh_apply_xid = InvalidTransactionId;
+
+/* Horizon slot set by this process yet; one per database, R2C_HORIZON_SLOT_<oid> */
+static bool fresh_horizon_held = false;
+static char fresh_horizon_slot[NAMEDATALEN];
+
+static void
+fresh_hold_xmin(TransactionId xmin)
+{
+#if PG_VERSION_NUM >= 180000
+    ReplicationSlotAcquire(fresh_horizon_slot, true, true);
+#else
+    ReplicationSlotAcquire(fresh_horizon_slot, true);
+#endif
+    SpinLockAcquire(&MyReplicationSlot->mutex);
+    MyReplicationSlot->data.xmin = xmin;
+    MyReplicationSlot->effective_xmin = xmin;
+    SpinLockRelease(&MyReplicationSlot->mutex);
+    ReplicationSlotMarkDirty();
+    ReplicationSlotsComputeRequiredXmin(false);
+    ReplicationSlotRelease();
+
+    fresh_horizon_held = true;
+}
+
+/*
+ * Create or drop the horizon slot to match row_to_column.fresh_reads, and
+ * withdraw what a previous worker published: its horizon is not ours.
+ */
+static void
+fresh_init(void)
+{
+    if (!applied_snapshot)
+        return;
+
+    LWLockAcquire(applied_snapshot_lock, LW_EXCLUSIVE);
+    applied_snapshot->generation++;
+    applied_snapshot->valid = false;
+    LWLockRelease(applied_snapshot_lock);
+
+    snprintf(fresh_horizon_slot, NAMEDATALEN, R2C_HORIZON_SLOT "_%u", MyDatabaseId);
+
+    StartTransactionCommand();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    SPI_connect();
+
+    if (r2c_fresh_reads)
+        SPI_execute(psprintf("SELECT pg_create_physical_replication_slot('%1$s') "
+                             "WHERE NOT EXISTS (SELECT 1 FROM pg_replication_slots "
+                             "WHERE slot_name = '%1$s')",
+                             fresh_horizon_slot),
+                    false, 0);
+    else
+        SPI_execute(psprintf("SELECT pg_drop_replication_slot(slot_name) "
+                             "FROM pg_replication_slots "
+                             "WHERE slot_name = '%s' AND NOT active",
+                             fresh_horizon_slot),
+                    false, 0);
+
+    SPI_finish();
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+}
+
+/*
+ * Take snap as the next candidate.  Call it in a transaction that still
+ * holds snap, so that its xmin is held until the horizon slot takes over.
+ */
+static void
+fresh_capture(Snapshot snap)
+{
+    XLogRecPtr lsn;
+
+    /* Subtransactions could only be resolved through pg_subtrans */
+    if (snap->suboverflowed)
+        return;
+
+    if (!fresh_candidate)
+        fresh_candidate = MemoryContextAlloc(TopMemoryContext, applied_snapshot_size());
+
+    fresh_candidate->xmin = snap->xmin;
+    fresh_candidate->xmax = snap->xmax;
+    fresh_candidate->xcnt = snap->xcnt;
+    fresh_candidate->subxcnt = snap->subxcnt;
+    memcpy(fresh_candidate->xids, snap->xip, snap->xcnt * sizeof(TransactionId));
+    memcpy(fresh_candidate->xids + snap->xcnt, snap->subxip,
+           snap->subxcnt * sizeof(TransactionId));
+
+    /* Transactions snap sees committed before this, make it decodable */
+    lsn = GetXLogInsertRecPtr();
+    XLogFlush(lsn);
+    fresh_candidate_lsn = lsn;
+
+    if (!fresh_horizon_held)
+        fresh_hold_xmin(snap->xmin);
+}
+
+/* Publish the candidate if everything it sees has been applied */
+static void
+fresh_publish(void)
+{
+    HtapAppliedSnapshot *s = applied_snapshot;
+
+    if (!s || XLogRecPtrIsInvalid(fresh_candidate_lsn) ||
+        applied_lsn < fresh_candidate_lsn)
+        return;
+
+    LWLockAcquire(applied_snapshot_lock, LW_EXCLUSIVE);
+    s->generation++;
+    s->valid = true;
+    s->applied_xid = fresh_apply_xid;
+    s->xmin = fresh_candidate->xmin;
+    s->xmax = fresh_candidate->xmax;
+    s->xcnt = fresh_candidate->xcnt;
+    s->subxcnt = fresh_candidate->subxcnt;
+    memcpy(s->xids, fresh_candidate->xids,
+           (s->xcnt + s->subxcnt) * sizeof(TransactionId));
+    LWLockRelease(applied_snapshot_lock);
+
+    /* Only after the generation moved, so readers notice */
+    fresh_hold_xmin(fresh_candidate->xmin);
+    fresh_candidate_lsn = InvalidXLogRecPtr;
+}
+
+/* ---------- APPLY ENGINE ---------- */
+#define APPLY_BATCH_SLOTS 1000 /* rows per table_multi_insert call */
+#define APPLY_PLAN_ROWS   100  /* rows per execution of a prepared INSERT */
+#define APPLY_MAX_PARAMS  65535
+
+/*
+ * Targets the table AM path cannot write to directly (partitioned mirrors,
+ * or ones with triggers or rules) go through SPI instead: a saved multi-row
+ * INSERT plan per target table, executed with the parsed Datums as binary
+ * parameters.  A plan lasts until the relcache entry of its target is
+ * invalidated, by DDL in any process, or the columns or their types it
+ * was built for change.
+ */
+typedef struct ApplyPlan
+{
+    char table[NAMEDATALEN + 8]; /* hash key: target table name */
+    bool valid;                  /* cleared by target_info_relcache_cb() */
+    Oid target;
+    char *columns;               /* target column list the plans insert */
+    int nparams;                 /* parameters per row */
+    AttrNumber *atts;            /* target attribute of each parameter */
+    Oid *types;                  /* and its type */
+    int nrows;                   /* rows per execution of multi */
+    SPIPlanPtr multi;
+    SPIPlanPtr single;           /* for the rows left over */
+} ApplyPlan;
+
+static HTAB *apply_plans = NULL;
+
+static void
+apply_plan_release(ApplyPlan *plan)
+{
+    if (plan->multi != plan->single)
+        SPI_freeplan(plan->multi);
+    SPI_freeplan(plan->single);
+    pfree(plan->columns);
+    pfree(plan->atts);
+    pfree(plan->types);
+}
+
+static SPIPlanPtr
+apply_plan_prepare(const char *table, const char *columns,
+                   const Oid *types, int nparams, int nrows)
+{
+    StringInfoData sql;
+    Oid *argtypes = palloc(nparams * nrows * sizeof(Oid));
+    SPIPlanPtr plan;
+
+    initStringInfo(&sql);
+    appendStringInfo(&sql, "INSERT INTO %s (%s) VALUES ",
+                     quote_identifier(table), columns);
+    for (int r = 0; r < nrows; r++)
+    {
+        appendStringInfoString(&sql, r ? ", (" : "(");
+        for (int c = 0; c < nparams; c++)
+        {
+            appendStringInfo(&sql, "%s$%d", c ? ", " : "", r * nparams + c + 1);
+            argtypes[r * nparams + c] = types[c];
+        }
+        appendStringInfoChar(&sql, ')');
+    }
+
+    plan = SPI_prepare(sql.data, nparams * nrows, argtypes);
+    if (!plan)
+        elog(ERROR, "SPI_prepare failed for INSERT into %s: %s",
+             table, SPI_result_code_string(SPI_result));
+    SPI_keepplan(plan);
+
+    pfree(sql.data);
+    pfree(argtypes);
+    return plan;
+}
+
+/*
+ * What applying to a target needs to know about it, kept across batches in
+ * target_infos by target table name.  Source columns map onto target
+ * attributes by name; the ones the target lacks (non-identity columns of a
+ * delete vector) are skipped, and the change LSN goes into _htap_lsn.  An
+ * entry is built for one source column list and goes stale when relcache
+ * invalidation hits its target or a RELATION message describes its source
+ * again.  Stale entries are only rebuilt by target_info_get(), never while
+ * a batch uses them.  A target range-partitioned on one source column has
+ * its rows routed to the partitions by apply_target_route().
+ */
+typedef struct TargetInfo
+{
+    char table[NAMEDATALEN + 8]; /* hash key: target table name */
+    bool valid;
+    MemoryContext cxt;           /* everything below */
+    Oid relid;                   /* the target */
+    Oid srcrelid;
+    bool use_plan;               /* needs the executor, see ApplyPlan */
+    TupleDesc desc;              /* of the target */
+
+    int natts;            /* number of source columns */
+    char **colnames;      /* source columns it was built for */
+    Oid *srctypes;        /* binary values are in the source type's format */
+    AttrNumber *attmap;   /* source column i -> target attribute, or 0 */
+    AttrNumber lsn_attno; /* _htap_lsn, or 0 if the target has none */
+    Oid *atttypes;        /* per source column, of its target attribute */
+    FmgrInfo *infuncs;
+    Oid *typioparams;
+    int32 *typmods;
+    FmgrInfo *recvfuncs;  /* looked up on first use */
+    Oid *recvioparams;
+    FmgrInfo *outfuncs;   /* source type output, if the target type differs */
+
+    int part_col;         /* source column of the range partition key, or -1 */
+    FmgrInfo part_cmp;    /* its btree comparison function */
+    Oid part_collation;
+} TargetInfo;
+
+static HTAB *target_infos = NULL;
+static MemoryContext target_infos_cxt = NULL;
+
+static void
+target_info_invalidate(Oid srcrelid)
+{
+    HASH_SEQ_STATUS status;
+    TargetInfo *ti;
+
+    if (!target_infos)
+        return;
+
+    hash_seq_init(&status, target_infos);
+    while ((ti = hash_seq_search(&status)) != NULL)
+        if (!OidIsValid(srcrelid) || ti->srcrelid == srcrelid)
+            ti->valid = false;
+}
+
+/* Also marks the apply plans of the target, freed once no plan can be running */
+static void
+target_info_relcache_cb(Datum arg, Oid relid)
+{
+    HASH_SEQ_STATUS status;
+    TargetInfo *ti;
+    ApplyPlan *plan;
+
+    hash_seq_init(&status, target_infos);
+    while ((ti = hash_seq_search(&status)) != NULL)
+        if (!OidIsValid(relid) || ti->relid == relid)
+            ti->valid = false;
+
+    if (!apply_plans)
+        return;
+    hash_seq_init(&status, apply_plans);
+    while ((plan = hash_seq_search(&status)) != NULL)
+        if (!OidIsValid(relid) || plan->target == relid)
+            plan->valid = false;
+}
+
+/* Was the entry built for the column list the batch was decoded with? */
+static bool
+target_info_matches(TargetInfo *ti, BatchEntry *be)
+{
+    if (ti->srcrelid != be->relid || ti->natts != be->ncols)
+        return false;
+
+    for (int i = 0; i < be->ncols; i++)
+        if (ti->srctypes[i] != be->coltypes[i] ||
+            strcmp(ti->colnames[i], be->colnames[i]) != 0)
+            return false;
+    return true;
+}
+
+static void
+target_info_build(TargetInfo *ti, Relation rel, BatchEntry *be)
+{
+    TupleDesc desc = RelationGetDescr(rel);
+    MemoryContext oldcxt;
+
+    if (ti->cxt)
+        MemoryContextDelete(ti->cxt);
+    ti->cxt = AllocSetContextCreate(target_infos_cxt, "row_to_column target",
+                                    ALLOCSET_SMALL_SIZES);
+    oldcxt = MemoryContextSwitchTo(ti->cxt);
+
+    ti->relid = RelationGetRelid(rel);
+    ti->srcrelid = be->relid;
+    ti->desc = CreateTupleDescCopy(desc);
+
+    ti->natts = be->ncols;
+    ti->colnames = palloc(be->ncols * sizeof(char *));
+    for (int i = 0; i < be->ncols; i++)
+        ti->colnames[i] = pstrdup(be->colnames[i]);
+    ti->srctypes = palloc(be->ncols * sizeof(Oid));
+    memcpy(ti->srctypes, be->coltypes, be->ncols * sizeof(Oid));
+    ti->attmap = palloc0(be->ncols * sizeof(AttrNumber));
+    ti->lsn_attno = InvalidAttrNumber;
+    ti->atttypes = palloc0(be->ncols * sizeof(Oid));
+    ti->infuncs = palloc(be->ncols * sizeof(FmgrInfo));
+    ti->typioparams = palloc(be->ncols * sizeof(Oid));
+    ti->typmods = palloc(be->ncols * sizeof(int32));
+    ti->recvfuncs = palloc0(be->ncols * sizeof(FmgrInfo));
+    ti->recvioparams = palloc(be->ncols * sizeof(Oid));
+    ti->outfuncs = palloc0(be->ncols * sizeof(FmgrInfo));
+
+    for (int j = 0; j < desc->natts; j++)
+    {
+        Form_pg_attribute att = TupleDescAttr(desc, j);
+        Oid infunc;
+
+        if (att->attisdropped)
+            continue;
+
+        if (strcmp(NameStr(att->attname), "_htap_lsn") == 0 &&
+            att->atttypid == PG_LSNOID)
+        {
+            ti->lsn_attno = att->attnum;
+            continue;
+        }
+
+        for (int i = 0; i < be->ncols; i++)
+        {
+            if (ti->attmap[i] != InvalidAttrNumber ||
+                strcmp(NameStr(att->attname), be->colnames[i]) != 0)
+                continue;
+
+            getTypeInputInfo(att->atttypid, &infunc, &ti->typioparams[i]);
+            fmgr_info_cxt(infunc, &ti->infuncs[i], ti->cxt);
+            ti->typmods[i] = att->atttypmod;
+            ti->atttypes[i] = att->atttypid;
+            ti->attmap[i] = att->attnum;
+            break;
+        }
+    }
+
+    ti->part_col = -1;
+    if (rel->rd_rel->relkind == RELKIND_PARTITIONED_TABLE)
+    {
+        PartitionKey key = RelationGetPartitionKey(rel);
+
+        /* Expressions (partattrs 0) and multi-column keys go by the executor */
+        if (key->strategy == PARTITION_STRATEGY_RANGE && key->partnatts == 1 &&
+            key->partattrs[0] != InvalidAttrNumber)
+        {
+            for (int i = 0; i < be->ncols; i++)
+            {
+                if (ti->attmap[i] != key->partattrs[0])
+                    continue;
+                ti->part_col = i;
+                fmgr_info_copy(&ti->part_cmp, &key->partsupfunc[0], ti->cxt);
+                ti->part_collation = key->partcollation[0];
+                break;
+            }
+        }
+    }
+
+    ti->use_plan = (rel->rd_rel->relkind != RELKIND_RELATION && ti->part_col < 0) ||
+                   rel->rd_rel->relhastriggers || rel->rd_rel->relhasrules;
+
+    MemoryContextSwitchTo(oldcxt);
+    ti->valid = true;
+}
+
+/*
+ * Open the batch's target, locked for writing, with its up-to-date entry.
+ * NULL if the target does not exist.
+ */
+static TargetInfo *
+target_info_get(BatchEntry *be, Relation *relp)
+{
+    char key[NAMEDATALEN + 8];
+    TargetInfo *ti;
+    Relation rel;
+    bool found;
+
+    if (!target_infos)
+    {
+        HASHCTL ctl;
+
+        target_infos_cxt = AllocSetContextCreate(CacheMemoryContext,
+                                                 "row_to_column targets",
+                                                 ALLOCSET_SMALL_SIZES);
+        MemSet(&ctl, 0, sizeof(ctl));
+        ctl.keysize = NAMEDATALEN + 8;
+        ctl.entrysize = sizeof(TargetInfo);
+        ctl.hcxt = target_infos_cxt;
+        target_infos = hash_create("row_to_column target infos", 16, &ctl,
+                                   HASH_ELEM | HASH_STRINGS | HASH_CONTEXT);
+        CacheRegisterRelcacheCallback(target_info_relcache_cb, (Datum) 0);
+    }
+
+    MemSet(key, 0, sizeof(key));
+    strlcpy(key, be->table, sizeof(key));
+    ti = hash_search(target_infos, key, HASH_ENTER, &found);
+    if (!found)
+    {
+        ti->valid = false;
+        ti->cxt = NULL;
+    }
+
+    /* Taking the lock processes invalidations, so check again after it */
+    if (ti->valid && target_info_matches(ti, be))
+    {
+        rel = try_relation_open(ti->relid, RowExclusiveLock);
+        if (rel && ti->valid)
+        {
+            *relp = rel;
+            return ti;
+        }
+        if (rel)
+            table_close(rel, RowExclusiveLock);
+    }
+
+    rel = table_openrv_extended(makeRangeVar(NULL, be->table, -1),
+                                RowExclusiveLock, true);
+    if (!rel)
+        return NULL;
+
+    target_info_build(ti, rel, be);
+    *relp = rel;
+    return ti;
+}
+
+/*
+ * Direct apply state for one target relation, set up once per flush.  Rows
+ * go from their pgoutput form straight into slots and on to the table AM
+ * with table_multi_insert, with no SQL text, parsing or planning involved.
+ * Targets that need the executor keep the same slots but hand them to an
+ * ApplyPlan.  A partitioned target buffers nothing: each row goes on to
+ * the ApplyTarget of its partition.
+ */
+typedef struct ApplyTarget
+{
+    MemoryContext cxt;    /* everything below, freed with the target */
+    BatchEntry *be;
+    Relation rel;
+    TargetInfo *ti;
+    EState *estate;
+    ResultRelInfo *rri;
+    CommandId cid;
+    BulkInsertState bistate;
+    MemoryContext rowcxt; /* datums of the slots currently buffered */
+
+    ApplyPlan *plan;      /* SPI fallback, or NULL for table_multi_insert */
+    Datum *values;        /* its parameters */
+    char *nulls;
+
+    TupleTableSlot *slots[APPLY_BATCH_SLOTS];
+    int nslots;
+
+    PartitionDesc partdesc;   /* of a routed target, or NULL */
+    List *leaves;             /* ApplyTargets of the partitions rows went to */
+    struct ApplyTarget *leaf; /* the last row's, in partition leaf_part */
+    int leaf_part;
+    int leaf_bound;           /* its lower bound in partdesc->boundinfo */
+} ApplyTarget;
+
+/* Find or build the INSERT plans for a target that cannot be bulk-loaded */
+static ApplyPlan *
+apply_plan_get(ApplyTarget *at, BatchEntry *be)
+{
+    TargetInfo *ti = at->ti;
+    TupleDesc desc = ti->desc;
+    StringInfoData columns;
+    char key[NAMEDATALEN + 8];
+    AttrNumber *atts = palloc((be->ncols + 1) * sizeof(AttrNumber));
+    Oid *types = palloc((be->ncols + 1) * sizeof(Oid));
+    int nparams = 0;
+    ApplyPlan *plan;
+    bool found;
+    MemoryContext oldcxt;
+
+    if (!apply_plans)
+    {
+        HASHCTL ctl;
+
+        MemSet(&ctl, 0, sizeof(ctl));
+        ctl.keysize = NAMEDATALEN + 8;
+        ctl.entrysize = sizeof(ApplyPlan);
+        apply_plans = hash_create("row_to_column apply plans", 16,
+                                  &ctl, HASH_ELEM | HASH_STRINGS);
+    }
+
+    initStringInfo(&columns);
+    for (int i = 0; i < be->ncols; i++)
+    {
+        if (ti->attmap[i] == InvalidAttrNumber)
+            continue;
+        atts[nparams++] = ti->attmap[i];
+    }
+    if (ti->lsn_attno != InvalidAttrNumber)
+        atts[nparams++] = ti->lsn_attno;
+    if (nparams == 0)
+        elog(ERROR, "apply target %s has no columns in common with its source",
+             be->table);
+
+    for (int c = 0; c < nparams; c++)
+    {
+        Form_pg_attribute att = TupleDescAttr(desc, atts[c] - 1);
+
+        appendStringInfo(&columns, "%s%s", c ? ", " : "",
+                         quote_identifier(NameStr(att->attname)));
+        types[c] = att->atttypid;
+    }
+
+    MemSet(key, 0, sizeof(key));
+    strlcpy(key, be->table, sizeof(key));
+    plan = hash_search(apply_plans, key, HASH_ENTER, &found);
+    if (found && plan->valid && plan->target == ti->relid &&
+        plan->nparams == nparams && strcmp(plan->columns, columns.data) == 0 &&
+        memcmp(plan->types, types, nparams * sizeof(Oid)) == 0)
+    {
+        pfree(columns.data);
+        pfree(atts);
+        pfree(types);
+        return plan;
+    }
+    if (found)
+        apply_plan_release(plan);
+
+    oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+    plan->valid = true;
+    plan->target = ti->relid;
+    plan->columns = pstrdup(columns.data);
+    plan->nparams = nparams;
+    plan->atts = palloc(nparams * sizeof(AttrNumber));
+    memcpy(plan->atts, atts, nparams * sizeof(AttrNumber));
+    plan->types = palloc(nparams * sizeof(Oid));
+    memcpy(plan->types, types, nparams * sizeof(Oid));
+    MemoryContextSwitchTo(oldcxt);
+
+    plan->nrows = Max(1, Min(APPLY_PLAN_ROWS, APPLY_MAX_PARAMS / nparams));
+    plan->single = apply_plan_prepare(be->table, plan->columns, types, nparams, 1);
+    plan->multi = plan->nrows > 1
+        ? apply_plan_prepare(be->table, plan->columns, types, nparams, plan->nrows)
+        : plan->single;
+
+    pfree(columns.data);
+    pfree(atts);
+    pfree(types);
+    return plan;
+}
+
+/* Run the buffered slots through the target's prepared INSERTs */
+static void
+apply_plan_execute(ApplyTarget *at)
+{
+    ApplyPlan *plan = at->plan;
+    int done = 0;
+
+    while (done < at->nslots)
+    {
+        int nrows = at->nslots - done >= plan->nrows ? plan->nrows : 1;
+        int rc;
+
+        for (int r = 0; r < nrows; r++)
+        {
+            TupleTableSlot *slot = at->slots[done + r];
+
+            for (int c = 0; c < plan->nparams; c++)
+            {
+                int attidx = plan->atts[c] - 1;
+                int p = r * plan->nparams + c;
+
+                at->values[p] = slot->tts_values[attidx];
+                at->nulls[p] = slot->tts_isnull[attidx] ? 'n' : ' ';
+            }
+        }
+
+        rc = SPI_execute_plan(nrows > 1 ? plan->multi : plan->single,
+                              at->values, at->nulls, false, 0);
+        if (rc < 0)
+            elog(ERROR, "INSERT into %s failed: %s",
+                 RelationGetRelationName(at->rel), SPI_result_code_string(rc));
+        done += nrows;
+    }
+}
+
+/* Open the batch's target with its cached metadata */
+static ApplyTarget *
+apply_target_open(BatchEntry *be)
+{
+    ApplyTarget *at;
+    Relation rel;
+    TargetInfo *ti;
+    MemoryContext cxt;
+    MemoryContext oldcxt;
+
+    ti = target_info_get(be, &rel);
+    if (!ti)
+        return NULL;
+
+    /* Set up once and dropped whole when the batch is done */
+    cxt = GenerationContextCreate(CurrentMemoryContext,
+                                  "row_to_column apply batch",
+                                  ALLOCSET_SMALL_SIZES);
+    oldcxt = MemoryContextSwitchTo(cxt);
+
+    at = palloc0(sizeof(ApplyTarget));
+    at->cxt = cxt;
+    at->be = be;
+    at->rel = rel;
+    at->ti = ti;
+    at->cid = GetCurrentCommandId(true);
+    at->rowcxt = AllocSetContextCreate(cxt,
+                                       "row_to_column apply rows",
+                                       ALLOCSET_DEFAULT_SIZES);
+
+    if (ti->part_col >= 0)
+    {
+        at->partdesc = RelationGetPartitionDesc(rel, true);
+        at->leaf_part = -1;
+        MemoryContextSwitchTo(oldcxt);
+        return at;
+    }
+
+    if (ti->use_plan)
+    {
+        at->plan = apply_plan_get(at, be);
+        at->values = palloc(at->plan->nparams * at->plan->nrows * sizeof(Datum));
+        at->nulls = palloc(at->plan->nparams * at->plan->nrows);
+        MemoryContextSwitchTo(oldcxt);
+        return at;
+    }
+
+    at->bistate = GetBulkInsertState();
+
+    /* Indexes on the mirror are maintained like COPY would */
+    if (rel->rd_rel->relhasindex)
+    {
+        at->estate = CreateExecutorState();
+        at->estate->es_output_cid = at->cid;
+        at->rri = makeNode(ResultRelInfo);
+        InitResultRelInfo(at->rri, rel, 1, NULL, 0);
+        ExecOpenIndices(at->rri, false);
+    }
+
+    MemoryContextSwitchTo(oldcxt);
+    return at;
+}
+
+/* Hand the buffered slots to the table AM in one call */
+static void
+apply_target_flush_slots(ApplyTarget *at)
+{
+    if (at->nslots == 0)
+        return;
+
+    if (at->plan)
+        apply_plan_execute(at);
+    else
+        table_multi_insert(at->rel, at->slots, at->nslots, at->cid, 0, at->bistate);
+
+    if (at->rri && at->rri->ri_NumIndices > 0)
+    {
+        for (int i = 0; i < at->nslots; i++)
+        {
+            List *recheck;
+#if PG_VERSION_NUM >= 160000
+            recheck = ExecInsertIndexTuples(at->rri, at->slots[i], at->estate,
+                                            false, false, NULL, NIL, false);
+#else
+            recheck = ExecInsertIndexTuples(at->rri, at->slots[i], at->estate,
+                                            false, false, NULL, NIL);
+#endif
+            list_free(recheck);
+        }
+    }
+
+    for (int i = 0; i < at->nslots; i++)
+        ExecClearTuple(at->slots[i]);
+    at->nslots = 0;
+    MemoryContextReset(at->rowcxt);
+}
+
+/*
+ * Convert a binary ('b') value of source column i.  When the mirror column
+ * has another type (its ALTER TYPE is still queued) go through text.
+ */
+static Datum
+apply_target_recv(TargetInfo *ti, int i, StringInfo val)
+{
+    Oid atttype = ti->atttypes[i];
+    Datum d;
+
+    if (!OidIsValid(ti->recvfuncs[i].fn_oid))
+    {
+        Oid recvfunc;
+
+        /* Not in rowcxt, which the functions' caches would not survive */
+        getTypeBinaryInputInfo(ti->srctypes[i], &recvfunc, &ti->recvioparams[i]);
+        fmgr_info_cxt(recvfunc, &ti->recvfuncs[i], ti->cxt);
+
+        if (ti->srctypes[i] != atttype)
+        {
+            Oid outfunc;
+            bool isvarlena;
+
+            getTypeOutputInfo(ti->srctypes[i], &outfunc, &isvarlena);
+            fmgr_info_cxt(outfunc, &ti->outfuncs[i], ti->cxt);
+        }
+    }
+
+    if (ti->srctypes[i] == atttype)
+        return ReceiveFunctionCall(&ti->recvfuncs[i], val,
+                                   ti->recvioparams[i], ti->typmods[i]);
+
+    d = ReceiveFunctionCall(&ti->recvfuncs[i], val, ti->recvioparams[i], -1);
+    return InputFunctionCall(&ti->infuncs[i],
+                             OutputFunctionCall(&ti->outfuncs[i], d),
+                             ti->typioparams[i], ti->typmods[i]);
+}
+
+/*
+ * The datum of source column i, whose value of kind ck is the len bytes at
+ * val.  Input functions want a C string, and receive functions a buffer
+ * terminated like one.  The byte after the value is the next column's kind
+ * byte, the next row's LSN or the buffer's trailing NUL, so terminate in
+ * place instead of copying and put it back afterwards.
+ */
+static Datum
+apply_target_value(TargetInfo *ti, int i, char ck, char *val, int len)
+{
+    char save = val[len];
+    Datum d;
+
+    val[len] = '\0';
+    if (ck == 'b')
+    {
+        StringInfoData bin;
+
+        bin.data = val;
+        bin.len = bin.maxlen = len;
+        bin.cursor = 0;
+        d = apply_target_recv(ti, i, &bin);
+    }
+    else
+        d = InputFunctionCall(&ti->infuncs[i], val, ti->typioparams[i], ti->typmods[i]);
+    val[len] = save;
+    return d;
+}
+
+/* Does the range partition above boundinfo's datum bound hold key? */
+static bool
+apply_target_in_bound(ApplyTarget *at, int bound, Datum key)
+{
+    TargetInfo *ti = at->ti;
+    PartitionBoundInfo bi = at->partdesc->boundinfo;
+
+    if (bound >= 0 &&
+        partition_rbound_datum_cmp(&ti->part_cmp, &ti->part_collation,
+                                   bi->datums[bound], bi->kind[bound], &key, 1) > 0)
+        return false;
+    if (bound + 1 < bi->ndatums &&
+        partition_rbound_datum_cmp(&ti->part_cmp, &ti->part_collation,
+                                   bi->datums[bound + 1], bi->kind[bound + 1], &key, 1) <= 0)
+        return false;
+    return true;
+}
+
+/*
+ * The ApplyTarget of the partition the row at buf's cursor belongs in,
+ * opened on first use.  Only its key column is decoded here.  Rows mostly
+ * come in key order, so the last row's partition is tried before a binary
+ * search of the bounds; either way the executor's tuple routing, with its
+ * per-row slot conversion, is not involved.
+ */
+static ApplyTarget *
+apply_target_route(ApplyTarget *at, StringInfo buf)
+{
+    TargetInfo *ti = at->ti;
+    PartitionBoundInfo bi = at->partdesc->boundinfo;
+    StringInfoData row = *buf;
+    Datum key = (Datum) 0;
+    bool isnull = true;
+    XLogRecPtr lsn;
+    int ncols;
+    int part;
+    ListCell *lc;
+    BatchEntry *leaf_be;
+    MemoryContext oldcxt;
+
+    MemoryContextReset(at->rowcxt);
+    oldcxt = MemoryContextSwitchTo(at->rowcxt);
+
+    lsn = pq_getmsgint64(&row);
+    ncols = pq_getmsgint(&row, 2);
+    for (int i = 0; i < ncols && i <= ti->part_col; i++)
+    {
+        char ck = pq_getmsgbyte(&row);
+        int len;
+        char *val;
+
+        if (ck == 'n' || ck == 'u')
+            continue;
+
+        len = pq_getmsgint(&row, 4);
+        val = (char *) pq_getmsgbytes(&row, len);
+        if (i == ti->part_col)
+        {
+            key = apply_target_value(ti, i, ck, val, len);
+            isnull = false;
+        }
+    }
+
+    MemoryContextSwitchTo(oldcxt);
+
+    /* Range partitioning sends NULL keys to the default partition */
+    if (bi == NULL)
+        part = -1; /* no partitions */
+    else if (isnull)
+        part = bi->default_index;
+    else
+    {
+        if (at->leaf_part < 0 || !apply_target_in_bound(at, at->leaf_bound, key))
+        {
+            bool is_equal;
+
+            at->leaf_bound = partition_range_datum_bsearch(&ti->part_cmp,
+                                                           &ti->part_collation,
+                                                           bi, 1, &key, &is_equal);
+        }
+        part = bi->indexes[at->leaf_bound + 1];
+        if (part < 0)
+            part = bi->default_index;
+    }
+
+    if (part < 0)
+        ereport(ERROR,
+                (errcode(ERRCODE_CHECK_VIOLATION),
+                 errmsg("no partition of %s holds the row at %X/%X",
+                        at->be->table, LSN_FORMAT_ARGS(lsn)),
+                 errhint("Add one with htap_partition_maintain() or ALTER TABLE ... ATTACH PARTITION.")));
+
+    if (part == at->leaf_part)
+        return at->leaf;
+
+    at->leaf = NULL;
+    foreach (lc, at->leaves)
+    {
+        ApplyTarget *leaf = (ApplyTarget *) lfirst(lc);
+
+        if (leaf->ti->relid == at->partdesc->oids[part])
+            at->leaf = leaf;
+    }
+
+    if (!at->leaf)
+    {
+        oldcxt = MemoryContextSwitchTo(at->cxt);
+        leaf_be = palloc(sizeof(BatchEntry));
+        *leaf_be = *at->be;
+        leaf_be->table = get_rel_name(at->partdesc->oids[part]);
+        at->leaf = apply_target_open(leaf_be);
+        if (!at->leaf)
+            elog(ERROR, "could not open partition %u of %s",
+                 at->partdesc->oids[part], at->be->table);
+        at->leaves = lappend(at->leaves, at->leaf);
+        MemoryContextSwitchTo(oldcxt);
+    }
+    at->leaf_part = part;
+    return at->leaf;
+}
+
+/* Turn one LSN + pgoutput TupleData at buf's cursor into the next slot */
+static void
+apply_target_add_row(ApplyTarget *at, StringInfo buf)
+{
+    TargetInfo *ti;
+    TupleTableSlot *slot;
+    MemoryContext oldcxt;
+    XLogRecPtr lsn;
+    int ncols;
+
+    if (at->partdesc)
+        at = apply_target_route(at, buf);
+    ti = at->ti;
+
+    if (at->slots[at->nslots] == NULL)
+    {
+        oldcxt = MemoryContextSwitchTo(at->cxt);
+        at->slots[at->nslots] = table_slot_create(at->rel, NULL);
+        MemoryContextSwitchTo(oldcxt);
+    }
+    slot = at->slots[at->nslots];
+
+    ExecClearTuple(slot);
+    memset(slot->tts_isnull, true, slot->tts_tupleDescriptor->natts * sizeof(bool));
+
+    oldcxt = MemoryContextSwitchTo(at->rowcxt);
+
+    lsn = pq_getmsgint64(buf);
+    if (ti->lsn_attno != InvalidAttrNumber)
+    {
+        slot->tts_values[ti->lsn_attno - 1] = LSNGetDatum(lsn);
+        slot->tts_isnull[ti->lsn_attno - 1] = false;
+    }
+
+    ncols = pq_getmsgint(buf, 2);
+    for (int i = 0; i < ncols; i++)
+    {
+        char ck = pq_getmsgbyte(buf);
+        int len;
+        char *val;
+        int attidx;
+
+        if (ck == 'n' || ck == 'u')
+            continue;
+
+        len = pq_getmsgint(buf, 4);
+        val = (char *) pq_getmsgbytes(buf, len);
+        if (i >= ti->natts || ti->attmap[i] == InvalidAttrNumber)
+            continue; /* not a column of this target */
+
+        attidx = ti->attmap[i] - 1;
+        slot->tts_values[attidx] = apply_target_value(ti, i, ck, val, len);
+        slot->tts_isnull[attidx] = false;
+    }
+
+    MemoryContextSwitchTo(oldcxt);
+
+    ExecStoreVirtualTuple(slot);
+    if (++at->nslots == APPLY_BATCH_SLOTS)
+        apply_target_flush_slots(at);
+}
+
+static void
+apply_target_close(ApplyTarget *at)
+{
+    ListCell *lc;
+
+    foreach (lc, at->leaves)
+        apply_target_close((ApplyTarget *) lfirst(lc));
+    if (at->partdesc)
+    {
+        table_close(at->rel, NoLock);
+        MemoryContextDelete(at->cxt);
+        return;
+    }
+
+    apply_target_flush_slots(at);
+
+    for (int i = 0; i < APPLY_BATCH_SLOTS && at->slots[i]; i++)
+        ExecDropSingleTupleTableSlot(at->slots[i]);
+
+    if (at->rri)
+    {
+        ExecCloseIndices(at->rri);
+        FreeExecutorState(at->estate);
+    }
+
+    if (!at->plan)
+    {
+        FreeBulkInsertState(at->bistate);
+        table_finish_bulk_insert(at->rel, 0);
+    }
+    table_close(at->rel, NoLock);
+    MemoryContextDelete(at->cxt);
+
+    CommandCounterIncrement();
+}
+
+/*
+ * Batches are applied without subtransactions, so one bad row fails the
+ * worker's whole transaction.  When the error is about the data (classes 22
+ * and 23), batch_apply() records the batch's relation and LSN range in the
+ * worker's HtapStats before letting it go.  The worker restarts where its
+ * replication origin says, and when the same rows come back their batch is
+ * bisected in subtransactions: parts that apply are kept, rows that fail
+ * alone go to htap_dead_letter with the error.  The LSNs of inserted rows
+ * that went there are kept until the transaction ends, for rollup_apply()
+ * to leave them out of the rollups too.  Other errors, like a full disk,
+ * stop the worker as before.
+ */
+
+/* RelLsn *s of the BATCH_INSERT rows dead-lettered in this transaction */
+static List *batch_rejected = NIL;
+static bool batch_rejected_cb_registered = false;
+
+static void
+batch_rejected_xact_cb(XactEvent event, void *arg)
+{
+    if (event != XACT_EVENT_COMMIT && event != XACT_EVENT_ABORT)
+        return;
+    list_free_deep(batch_rejected);
+    batch_rejected = NIL;
+}
+
+static void
+batch_rejected_add(Oid relid, XLogRecPtr lsn)
+{
+    MemoryContext oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+    RelLsn *rl = palloc(sizeof(RelLsn));
+
+    if (!batch_rejected_cb_registered)
+    {
+        RegisterXactCallback(batch_rejected_xact_cb, NULL);
+        batch_rejected_cb_registered = true;
+    }
+    rl->relid = relid;
+    rl->lsn = lsn;
+    batch_rejected = lappend(batch_rejected, rl);
+    MemoryContextSwitchTo(oldcxt);
+}
+
+/* Was the row of relid at lsn dead-lettered? */
+static bool
+batch_rejected_has(Oid relid, XLogRecPtr lsn)
+{
+    ListCell *lc;
+
+    foreach (lc, batch_rejected)
+    {
+        RelLsn *rl = (RelLsn *) lfirst(lc);
+
+        if (rl->relid == relid && rl->lsn == lsn)
+            return true;
+    }
+    return false;
+}
+
+static bool
+batch_error_is_data(int sqlerrcode)
+{
+    return ERRCODE_TO_CATEGORY(sqlerrcode) == ERRCODE_DATA_EXCEPTION ||
+           ERRCODE_TO_CATEGORY(sqlerrcode) == ERRCODE_INTEGRITY_CONSTRAINT_VIOLATION;
+}
+
+/* Where the row after the one starting at off begins; *lsn is the row's */
+static int
+batch_row_next(BatchEntry *be, int off, XLogRecPtr *lsn)
+{
+    StringInfoData buf = be->data;
+    int ncols;
+
+    buf.cursor = off;
+    *lsn = pq_getmsgint64(&buf);
+    ncols = pq_getmsgint(&buf, 2);
+    for (int i = 0; i < ncols; i++)
+    {
+        char ck = pq_getmsgbyte(&buf);
+
+        if (ck == 'n' || ck == 'u')
+            continue;
+        buf.cursor += pq_getmsgint(&buf, 4);
+    }
+    return buf.cursor;
+}
+
+/* Remember be as failed if the error being thrown is about its data */
+static void
+batch_fault_record(BatchEntry *be, MemoryContext cxt)
+{
+    MemoryContext oldcxt = MemoryContextSwitchTo(cxt);
+    ErrorData *edata = CopyErrorData();
+    bool is_data = batch_error_is_data(edata->sqlerrcode);
+    BatchFault *f;
+
+    MemoryContextSwitchTo(oldcxt);
+    FreeErrorData(edata);
+
+    if (!htap_stats || !is_data)
+        return;
+
+    SpinLockAcquire(&htap_stats->mutex);
+    f = &htap_stats->faults[htap_stats->next_fault++ % R2C_MAX_FAULTS];
+    f->relid = be->relid;
+    f->kind = be->kind;
+    f->first_lsn = be->first_lsn;
+    f->last_lsn = be->last_lsn;
+    SpinLockRelease(&htap_stats->mutex);
+}
+
+/* Does be hold rows of a batch that failed before? */
+static bool
+batch_fault_match(BatchEntry *be)
+{
+    bool match = false;
+
+    if (!htap_stats)
+        return false;
+
+    SpinLockAcquire(&htap_stats->mutex);
+    for (int i = 0; i < Min(htap_stats->next_fault, R2C_MAX_FAULTS); i++)
+    {
+        BatchFault *f = &htap_stats->faults[i];
+
+        if (f->relid == be->relid && f->kind == be->kind &&
+            f->first_lsn <= be->last_lsn && be->first_lsn <= f->last_lsn)
+        {
+            match = true;
+            break;
+        }
+    }
+    SpinLockRelease(&htap_stats->mutex);
+    return match;
+}
+
+/* Applies the rows of be between two offsets; false if its target is missing */
+typedef bool (*BatchApplyFn) (BatchEntry *be, int start, int end);
+
+/* Apply the rows of be between the offsets start and end */
+static bool
+batch_apply_range(BatchEntry *be, int start, int end)
+{
+    ApplyTarget *at = apply_target_open(be);
+
+    if (!at)
+        return false;
+
+    be->data.cursor = start;
+    while (be->data.cursor < end)
+        apply_target_add_row(at, &be->data);
+
+    apply_target_close(at);
+    return true;
+}
+
+static void
+batch_dead_letter(BatchEntry *be, int start, int end, XLogRecPtr lsn, ErrorData *edata)
+{
+    Oid argtypes[6] = {OIDOID, TEXTOID, CHAROID, PG_LSNOID, TEXTOID, BYTEAOID};
+    Datum args[6];
+    bytea *row = palloc(VARHDRSZ + end - start);
+
+    SET_VARSIZE(row, VARHDRSZ + end - start);
+    memcpy(VARDATA(row), be->data.data + start, end - start);
+
+    args[0] = ObjectIdGetDatum(be->relid);
+    args[1] = CStringGetTextDatum(be->table);
+    args[2] = CharGetDatum(be->kind);
+    args[3] = LSNGetDatum(lsn);
+    args[4] = CStringGetTextDatum(edata->message);
+    args[5] = PointerGetDatum(row);
+
+    if (SPI_execute_with_args("INSERT INTO htap_dead_letter "
+                              "(relid, mirror, kind, lsn, error, row_data) "
+                              "VALUES ($1, $2, $3, $4, $5, $6)",
+                              6, argtypes, args, NULL, false, 0) != SPI_OK_INSERT)
+        elog(ERROR, "could not add a row of %s to htap_dead_letter", be->table);
+
+    ereport(WARNING,
+            (errmsg("row_to_column moved the row of %s at %X/%X to htap_dead_letter",
+                    be->table, LSN_FORMAT_ARGS(lsn)),
+             errdetail("%s", edata->message)));
+    stat_count_error();
+}
+
+/*
+ * Apply rows lo to hi of be, offsets[] apart, in a subtransaction; halve
+ * what fails until single rows are left.  Returns the rows applied.
+ */
+static uint64
+batch_bisect(BatchEntry *be, int *offsets, XLogRecPtr *lsns, int lo, int hi,
+             BatchApplyFn apply)
+{
+    MemoryContext oldcxt = CurrentMemoryContext;
+    ResourceOwner oldowner = CurrentResourceOwner;
+    ErrorData *edata = NULL;
+    int mid;
+
+    BeginInternalSubTransaction(NULL);
+    PG_TRY();
+    {
+        apply(be, offsets[lo], offsets[hi]);
+        ReleaseCurrentSubTransaction();
+    }
+    PG_CATCH();
+    {
+        MemoryContextSwitchTo(oldcxt);
+        edata = CopyErrorData();
+        FlushErrorState();
+        RollbackAndReleaseCurrentSubTransaction();
+    }
+    PG_END_TRY();
+    MemoryContextSwitchTo(oldcxt);
+    CurrentResourceOwner = oldowner;
+
+    if (!edata)
+        return hi - lo;
+
+    if (!batch_error_is_data(edata->sqlerrcode))
+        ReThrowError(edata);
+
+    if (hi - lo == 1)
+    {
+        batch_dead_letter(be, offsets[lo], offsets[hi], lsns[lo], edata);
+        if (be->kind == BATCH_INSERT)
+            batch_rejected_add(be->relid, lsns[lo]);
+        FreeErrorData(edata);
+        return 0;
+    }
+
+    FreeErrorData(edata);
+    mid = lo + (hi - lo) / 2;
+    return batch_bisect(be, offsets, lsns, lo, mid, apply) +
+           batch_bisect(be, offsets, lsns, mid, hi, apply);
+}
+
+static uint64
+batch_isolate(BatchEntry *be, BatchApplyFn apply)
+{
+    int *offsets = palloc((be->nrows + 1) * sizeof(int));
+    XLogRecPtr *lsns = palloc(be->nrows * sizeof(XLogRecPtr));
+    int n = 0;
+    uint64 rows;
+
+    offsets[0] = 0;
+    while (offsets[n] < be->data.len && n < be->nrows)
+    {
+        offsets[n + 1] = batch_row_next(be, offsets[n], &lsns[n]);
+        n++;
+    }
+
+    elog(LOG, "row_to_column isolating the bad rows of a batch of %d for %s",
+         n, be->table);
+    rows = n > 0 ? batch_bisect(be, offsets, lsns, 0, n, apply) : 0;
+
+    pfree(offsets);
+    pfree(lsns);
+    return rows;
+}
+
+/* ---------- UNCHANGED VALUES ---------- */
+/*
+ * An UPDATE sends the TOASTed values it did not change as 'u'.  Under
+ * REPLICA IDENTITY FULL the decoder takes them from the old tuple, see
+ * tupledata_merge(); otherwise the table has a primary key, and before a
+ * BATCH_INSERT batch is applied its rows with such values get them from
+ * the previous version of the row: the last row of the batch with the same
+ * key, or else the newest version in the mirror.  Values with no previous
+ * version to come from are left NULL and counted as an error.
+ */
+typedef struct UnchangedKey
+{
+    uint32 hash; /* hash key: of the key columns' TupleData */
+    List *rows;  /* offsets of those rows in the rewritten batch, newest first */
+} UnchangedKey;
+
+/* Offsets of the columns of the row at off, cols[ncols] its end; returns ncols */
+static int
+tupledata_columns(StringInfo data, int off, int *cols, int maxcols)
+{
+    StringInfoData buf = *data;
+    int ncols;
+
+    buf.cursor = off + sizeof(int64);
+    ncols = pq_getmsgint(&buf, 2);
+    if (ncols > maxcols)
+        elog(ERROR, "row_to_column batch row has %d columns, expected at most %d",
+             ncols, maxcols);
+    for (int i = 0; i < ncols; i++)
+    {
+        char ck;
+
+        cols[i] = buf.cursor;
+        ck = pq_getmsgbyte(&buf);
+        if (ck != 'n' && ck != 'u')
+            buf.cursor += pq_getmsgint(&buf, 4);
+    }
+    cols[ncols] = buf.cursor;
+    return ncols;
+}
+
+#define tupledata_kind(buf, cols, i) ((buf)->data[(cols)[i]])
+#define tupledata_span(cols, i) ((cols)[(i) + 1] - (cols)[i])
+
+/* Source columns of be that are in its relation's primary key */
+static int
+unchanged_key_columns(BatchEntry *be, int *keycols)
+{
+    Oid argtypes[1] = {OIDOID};
+    Datum args[1];
+    int nkeys = 0;
+
+    args[0] = ObjectIdGetDatum(be->relid);
+    if (SPI_execute_with_args("SELECT a.attname::text FROM pg_index i "
+                              "JOIN pg_attribute a ON a.attrelid = i.indrelid "
+                              "AND a.attnum = ANY (i.indkey) "
+                              "WHERE i.indrelid = $1 AND i.indisprimary",
+                              1, argtypes, args, NULL, true, 0) != SPI_OK_SELECT)
+        return 0;
+
+    for (uint64 r = 0; r < SPI_processed; r++)
+    {
+        char *name = SPI_getvalue(SPI_tuptable->vals[r], SPI_tuptable->tupdesc, 1);
+
+        for (int c = 0; c < be->ncols; c++)
+            if (strcmp(be->colnames[c], name) == 0)
+                keycols[nkeys++] = c;
+    }
+    /* A key column the batch does not have matches nothing */
+    if ((uint64) nkeys != SPI_processed)
+        nkeys = 0;
+    SPI_freetuptable(SPI_tuptable);
+    return nkeys;
+}
+
+/* The newest version of the row with the key of row cols before lsn, in the mirror */
+static bool
+unchanged_from_mirror(BatchEntry *be, TargetInfo *ti, SPIPlanPtr plan,
+                      int *keycols, int nkeys, int *cols, XLogRecPtr lsn)
+{
+    Datum *values = palloc((nkeys + 1) * sizeof(Datum));
+    char *nulls = palloc0(nkeys + 2);
+
+    memset(nulls, ' ', nkeys + 1);
+    for (int k = 0; k < nkeys; k++)
+    {
+        int c = keycols[k];
+        StringInfoData buf = be->data;
+        char ck;
+        int len;
+
+        buf.cursor = cols[c];
+        ck = pq_getmsgbyte(&buf);
+        if (ck == 'n')
+        {
+            nulls[k] = 'n';
+            continue;
+        }
+        len = pq_getmsgint(&buf, 4);
+        values[k] = apply_target_value(ti, c, ck, buf.data + buf.cursor, len);
+    }
+    values[nkeys] = LSNGetDatum(lsn);
+
+    return SPI_execute_plan(plan, values, nulls, true, 1) == SPI_OK_SELECT &&
+           SPI_processed > 0;
+}
+
+/* Give the 'u' values of be's rows those of their previous versions */
+static void
+batch_fill_unchanged(BatchEntry *be)
+{
+    MemoryContext cxt, oldcxt;
+    int *cols, *prevcols, *keycols, *mirrorcols;
+    int nkeys, nmirror = 0, off = 0, missing = 0;
+    bool unchanged = false;
+    StringInfoData out, sql;
+    TargetInfo *ti;
+    Relation rel;
+    HTAB *keys;
+    HASHCTL ctl;
+    SPIPlanPtr plan;
+    Oid *argtypes;
+
+    cols = palloc((be->ncols + 1) * sizeof(int));
+    while (off < be->data.len && !unchanged)
+    {
+        int ncols = tupledata_columns(&be->data, off, cols, be->ncols);
+
+        for (int i = 0; i < ncols && !unchanged; i++)
+            unchanged = tupledata_kind(&be->data, cols, i) == 'u';
+        off = cols[ncols];
+    }
+    pfree(cols);
+    if (!unchanged)
+        return;
+
+    ti = target_info_get(be, &rel);
+    if (!ti)
+        return;
+    table_close(rel, NoLock);
+
+    cxt = AllocSetContextCreate(CurrentMemoryContext, "row_to_column unchanged values",
+                                ALLOCSET_DEFAULT_SIZES);
+    oldcxt = MemoryContextSwitchTo(cxt);
+
+    cols = palloc((be->ncols + 1) * sizeof(int));
+    prevcols = palloc((be->ncols + 1) * sizeof(int));
+    keycols = palloc(be->ncols * sizeof(int));
+    mirrorcols = palloc(be->ncols * sizeof(int));
+    nkeys = unchanged_key_columns(be, keycols);
+
+    /* SELECT the mirror's columns as text, the newest version of a key first */
+    initStringInfo(&sql);
+    appendStringInfoString(&sql, "SELECT ");
+    for (int c = 0; c < be->ncols; c++)
+    {
+        if (ti->attmap[c] == InvalidAttrNumber)
+            continue;
+        appendStringInfo(&sql, "%s%s::text", nmirror > 0 ? ", " : "",
+                         quote_identifier(be->colnames[c]));
+        mirrorcols[nmirror++] = c;
+    }
+    appendStringInfo(&sql, " FROM %s WHERE ", quote_identifier(be->table));
+    argtypes = palloc((nkeys + 1) * sizeof(Oid));
+    for (int k = 0; k < nkeys; k++)
+    {
+        appendStringInfo(&sql, "%s = $%d AND ", quote_identifier(be->colnames[keycols[k]]),
+                         k + 1);
+        argtypes[k] = ti->atttypes[keycols[k]];
+    }
+    appendStringInfo(&sql, "_htap_lsn < $%d ORDER BY _htap_lsn DESC LIMIT 1", nkeys + 1);
+    argtypes[nkeys] = PG_LSNOID;
+    plan = nkeys > 0 && nmirror > 0 && ti->lsn_attno != InvalidAttrNumber ?
+        SPI_prepare(sql.data, nkeys + 1, argtypes) : NULL;
+
+    MemSet(&ctl, 0, sizeof(ctl));
+    ctl.keysize = sizeof(uint32);
+    ctl.entrysize = sizeof(UnchangedKey);
+    ctl.hcxt = cxt;
+    keys = hash_create("row_to_column unchanged keys", 256, &ctl,
+                       HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+    initStringInfo(&out);
+    off = 0;
+    while (off < be->data.len)
+    {
+        int ncols = tupledata_columns(&be->data, off, cols, be->ncols);
+        int start = out.len;
+        XLogRecPtr lsn;
+        uint32 hash = 0;
+        bool keyed = nkeys > 0;
+        bool looked = false;
+        bool fetched = false;
+        int prev = -1;
+        UnchangedKey *uk = NULL;
+        StringInfoData buf = be->data;
+        ListCell *lc;
+
+        buf.cursor = off;
+        lsn = pq_getmsgint64(&buf);
+
+        for (int k = 0; k < nkeys && keyed; k++)
+        {
+            int c = keycols[k];
+
+            keyed = c < ncols && tupledata_kind(&be->data, cols, c) != 'u';
+            if (keyed)
+                hash = hash_combine(hash, hash_bytes((unsigned char *) be->data.data + cols[c],
+                                                     tupledata_span(cols, c)));
+        }
+        if (keyed)
+        {
+            bool found;
+
+            uk = hash_search(keys, &hash, HASH_ENTER, &found);
+            if (!found)
+                uk->rows = NIL;
+
+            /* The newest earlier row of the batch with the same key */
+            foreach (lc, uk->rows)
+            {
+                int cand = lfirst_int(lc);
+                bool same = true;
+
+                tupledata_columns(&out, cand, prevcols, be->ncols);
+                for (int k = 0; k < nkeys && same; k++)
+                {
+                    int c = keycols[k];
+
+                    same = tupledata_span(prevcols, c) == tupledata_span(cols, c) &&
+                           memcmp(out.data + prevcols[c], be->data.data + cols[c],
+                                  tupledata_span(cols, c)) == 0;
+                }
+                if (same)
+                {
+                    prev = cand;
+                    break;
+                }
+            }
+        }
+
+        appendBinaryStringInfo(&out, be->data.data + off, cols[0] - off);
+        for (int i = 0; i < ncols; i++)
+        {
+            if (tupledata_kind(&be->data, cols, i) != 'u')
+            {
+                appendBinaryStringInfo(&out, be->data.data + cols[i], tupledata_span(cols, i));
+                continue;
+            }
+
+            if (prev < 0 && keyed && plan && !looked)
+            {
+                looked = true;
+                fetched = unchanged_from_mirror(be, ti, plan, keycols, nkeys, cols, lsn);
+            }
+
+            if (prev >= 0)
+            {
+                /* Now that out may have moved, look its columns up again */
+                tupledata_columns(&out, prev, prevcols, be->ncols);
+                appendBinaryStringInfo(&out, out.data + prevcols[i], tupledata_span(prevcols, i));
+            }
+            else if (fetched)
+            {
+                char *val = NULL;
+
+                for (int j = 0; j < nmirror; j++)
+                    if (mirrorcols[j] == i)
+                        val = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, j + 1);
+                if (val)
+                {
+                    pq_sendbyte(&out, 't');
+                    pq_sendint32(&out, strlen(val));
+                    appendBinaryStringInfo(&out, val, strlen(val));
+                }
+                else
+                    pq_sendbyte(&out, 'n');
+            }
+            else
+            {
+                pq_sendbyte(&out, 'u');
+                missing++;
+            }
+        }
+
+        if (looked)
+            SPI_freetuptable(SPI_tuptable);
+        if (uk)
+            uk->rows = lcons_int(start, uk->rows);
+        off = cols[ncols];
+    }
+
+    if (missing > 0)
+    {
+        ereport(WARNING,
+                (errmsg("row_to_column left %d unchanged TOASTed values of %s NULL",
+                        missing, be->table),
+                 errdetail("No earlier version of their rows was found.")));
+        stat_count_error();
+    }
+
+    MemoryContextSwitchTo(oldcxt);
+    be->data.data = MemoryContextAlloc(GetMemoryChunkContext(be->data.data), out.len + 1);
+    memcpy(be->data.data, out.data, out.len + 1);
+    be->data.len = out.len;
+    be->data.maxlen = out.len + 1;
+    be->data.cursor = 0;
+    MemoryContextDelete(cxt);
+}
+
+/* ---------- ROLLUPS ---------- */
+/*
+ * htap_create_rollup() registers a rollup of a table in htap_rollups.  The
+ * table is published, so the decoder learns of a rollup in change order
+ * and from then on copies the rows INSERTed into the table to a
+ * BATCH_ROLLUP batch too.  That batch is applied with the rows of the
+ * mirror, in the same transaction: its rows are decoded once, into an
+ * array per column, and each rollup's merge_sql groups them by time bucket
+ * and key in memory and merges the groups into the rollup table with
+ * INSERT ... ON CONFLICT.  Rows from before a rollup's lsn are left out,
+ * and so are rows the mirror's batch moved to htap_dead_letter.  A batch
+ * that fails on its data is bisected like the mirror's, its bad rows going
+ * to htap_dead_letter as kind BATCH_ROLLUP.  htap_rename_column() and
+ * htap_change_type() leave the columns of a rollup alone.
+ */
+#define ROLLUPS_SQL \
+    "SELECT h.lsn, h.columns::text[], h.merge_sql FROM htap_rollups h " \
+    "WHERE h.relid = $1 AND EXISTS (SELECT 1 FROM pg_class c WHERE c.oid = h.rollup)"
+
+typedef struct RollupDef
+{
+    XLogRecPtr lsn;
+    char *merge_sql;
+    int nparams;
+    int *srccols; /* source column of each parameter of merge_sql */
+} RollupDef;
+
+/* The rollups of be's relation whose columns its mirror has */
+static List *
+rollup_defs(BatchEntry *be, TargetInfo *ti)
+{
+    Oid argtypes[1] = {OIDOID};
+    Datum args[1];
+    List *defs = NIL;
+
+    args[0] = ObjectIdGetDatum(be->relid);
+    if (SPI_execute_with_args(ROLLUPS_SQL, 1, argtypes, args, NULL, true, 0) != SPI_OK_SELECT)
+        return NIL;
+
+    for (uint64 i = 0; i < SPI_processed; i++)
+    {
+        HeapTuple tup = SPI_tuptable->vals[i];
+        TupleDesc desc = SPI_tuptable->tupdesc;
+        RollupDef *def = palloc(sizeof(RollupDef));
+        Datum *names;
+        bool isnull;
+
+        def->lsn = DatumGetLSN(SPI_getbinval(tup, desc, 1, &isnull));
+        deconstruct_array(DatumGetArrayTypeP(SPI_getbinval(tup, desc, 2, &isnull)),
+                          TEXTOID, -1, false, TYPALIGN_INT,
+                          &names, NULL, &def->nparams);
+        def->merge_sql = SPI_getvalue(tup, desc, 3);
+        def->srccols = palloc(def->nparams * sizeof(int));
+
+        for (int p = 0; p < def->nparams; p++)
+        {
+            char *name = TextDatumGetCString(names[p]);
+
+            def->srccols[p] = -1;
+            for (int c = 0; c < be->ncols; c++)
+                if (strcmp(be->colnames[c], name) == 0 &&
+                    ti->attmap[c] != InvalidAttrNumber)
+                    def->srccols[p] = c;
+
+            if (def->srccols[p] < 0)
+            {
+                ereport(WARNING,
+                        (errmsg("row_to_column skips a rollup of %s: column \"%s\" is not mirrored",
+                                be->table, name)));
+                stat_count_error();
+                def = NULL;
+                break;
+            }
+        }
+
+        if (def)
+            defs = lappend(defs, def);
+    }
+    SPI_freetuptable(SPI_tuptable);
+    return defs;
+}
+
+/*
+ * Fold the rows of a BATCH_ROLLUP batch between the offsets start and end
+ * into the rollups of its relation
+ */
+static bool
+rollup_apply(BatchEntry *be, int start, int end)
+{
+    MemoryContext cxt = AllocSetContextCreate(CurrentMemoryContext,
+                                              "row_to_column rollup",
+                                              ALLOCSET_DEFAULT_SIZES);
+    MemoryContext oldcxt = MemoryContextSwitchTo(cxt);
+    TargetInfo *ti;
+    Relation rel;
+    List *defs;
+    ListCell *lc;
+    Datum **values;
+    bool **nulls;
+    XLogRecPtr *lsns;
+    int nrows = 0;
+
+    ti = target_info_get(be, &rel);
+    if (!ti)
+    {
+        MemoryContextSwitchTo(oldcxt);
+        MemoryContextDelete(cxt);
+        return true;
+    }
+    table_close(rel, NoLock);
+
+    defs = rollup_defs(be, ti);
+
+    /* Decode the columns some rollup needs, once for all of them */
+    values = palloc0(be->ncols * sizeof(Datum *));
+    nulls = palloc0(be->ncols * sizeof(bool *));
+    foreach (lc, defs)
+    {
+        RollupDef *def = (RollupDef *) lfirst(lc);
+
+        for (int p = 0; p < def->nparams; p++)
+        {
+            int c = def->srccols[p];
+
+            if (!values[c])
+            {
+                values[c] = palloc(be->nrows * sizeof(Datum));
+                nulls[c] = palloc(be->nrows * sizeof(bool));
+            }
+        }
+    }
+
+    lsns = palloc(be->nrows * sizeof(XLogRecPtr));
+    be->data.cursor = start;
+    while (defs != NIL && be->data.cursor < end && nrows < be->nrows)
+    {
+        int row = be->data.cursor;
+        int ncols;
+
+        lsns[nrows] = pq_getmsgint64(&be->data);
+        /* Not even decoded: its values may be what the mirror refused */
+        if (batch_rejected_has(be->relid, lsns[nrows]))
+        {
+            be->data.cursor = batch_row_next(be, row, &lsns[nrows]);
+            continue;
+        }
+        ncols = pq_getmsgint(&be->data, 2);
+        for (int i = 0; i < ncols; i++)
+        {
+            char ck = pq_getmsgbyte(&be->data);
+            int len;
+            char *val;
+            bool needed = i < be->ncols && values[i];
+
+            if (needed)
+                nulls[i][nrows] = true;
+            if (ck == 'n' || ck == 'u')
+                continue;
+
+            len = pq_getmsgint(&be->data, 4);
+            val = (char *) pq_getmsgbytes(&be->data, len);
+            if (!needed)
+                continue;
+            values[i][nrows] = apply_target_value(ti, i, ck, val, len);
+            nulls[i][nrows] = false;
+        }
+        nrows++;
+    }
+
+    foreach (lc, defs)
+    {
+        RollupDef *def = (RollupDef *) lfirst(lc);
+        Datum *params = palloc(def->nparams * sizeof(Datum));
+        Oid *types = palloc(def->nparams * sizeof(Oid));
+        Datum *elems = palloc(nrows * sizeof(Datum));
+        bool *elemnulls = palloc(nrows * sizeof(bool));
+        int lb = 1;
+
+        for (int p = 0; p < def->nparams; p++)
+        {
+            int c = def->srccols[p];
+            Oid elemtype = ti->atttypes[c];
+            int16 typlen;
+            bool typbyval;
+            char typalign;
+            int n = 0;
+
+            for (int r = 0; r < nrows; r++)
+            {
+                if (lsns[r] < def->lsn)
+                    continue;
+                elems[n] = values[c][r];
+                elemnulls[n] = nulls[c][r];
+                n++;
+            }
+
+            get_typlenbyvalalign(elemtype, &typlen, &typbyval, &typalign);
+            params[p] = PointerGetDatum(construct_md_array(elems, elemnulls, 1, &n, &lb,
+                                                           elemtype, typlen, typbyval,
+                                                           typalign));
+            types[p] = get_array_type(elemtype);
+        }
+
+        SPI_execute_with_args(def->merge_sql, def->nparams, types, params,
+                              NULL, false, 0);
+    }
+
+    MemoryContextSwitchTo(oldcxt);
+    MemoryContextDelete(cxt);
+    return true;
+}
+
+/* Apply one batch through the table AM, returns rows written */
+static uint64
+batch_apply(BatchEntry *be)
+{
+    TimestampTz start = GetCurrentTimestamp();
+    MemoryContext oldcxt = CurrentMemoryContext;
+    uint64 rows = be->nrows;
+    bool exists = true;
+    BatchApplyFn apply = be->kind == BATCH_ROLLUP ? rollup_apply : batch_apply_range;
+
+    R2C_PROBE4(relation__start, be->relid, be->kind, be->nrows, be->data.len);
+
+    if (be->kind == BATCH_INSERT)
+        batch_fill_unchanged(be);
+
+    if (batch_fault_match(be))
+    {
+        /* Opening the target with no rows tells whether it exists */
+        exists = apply(be, 0, 0);
+        if (exists)
+            rows = batch_isolate(be, apply);
+    }
+    else
+    {
+        PG_TRY();
+        {
+            exists = apply(be, 0, be->data.len);
+        }
+        PG_CATCH();
+        {
+            batch_fault_record(be, oldcxt);
+            PG_RE_THROW();
+        }
+        PG_END_TRY();
+    }
+
+    if (!exists)
+    {
+        elog(WARNING, "apply target %s does not exist, skipping %d rows",
+             be->table, be->nrows);
+        stat_count_error();
+        R2C_PROBE4(relation__done, be->relid, be->kind, 0, stat_elapsed_us(start));
+        return 0;
+    }
+
+    /* Not rows of the mirror, they were counted with their BATCH_INSERT */
+    if (be->kind == BATCH_ROLLUP)
+    {
+        R2C_PROBE4(relation__done, be->relid, be->kind, 0, stat_elapsed_us(start));
+        return 0;
+    }
+
+    stat_table(be, rows, stat_elapsed_us(start));
+    R2C_PROBE4(relation__done, be->relid, be->kind, rows, stat_elapsed_us(start));
+    return rows;
+}
+
+/* ---------- PARALLEL APPLY ---------- */
+/*
+ * With row_to_column.apply_workers > 0 the main worker only decodes.  Each
+ * relation's batches are sent over shm_mq to the apply worker picked by
+ * hashing its relid, so one relation is always applied by the same worker,
+ * in order.  Workers commit when they get a sync message; the leader sends
+ * one to everybody at the end of each apply round.  It carries how far
+ * each relation the worker wrote is applied, recorded in htap_progress in
+ * the transaction the worker commits, so that a restart skips those rows
+ * even if the leader's commit of its origin did not make it.  Syncs in the
+ * middle of a round carry none.  DDL of a relation goes
+ * to that relation's worker, in line with its batches; DDL of no relation
+ * runs on worker 0 between syncs, after all earlier batches are committed.
+ */
+#define R2C_SHM_MAGIC     0x52324331
+#define R2C_KEY_SHARED    0
+#define R2C_KEY_QUEUE(i)  (1 + (i))
+#define APPLY_QUEUE_SIZE  (4 * 1024 * 1024)
+
+#define apply_pool_worker(relid) (hash_bytes_uint32(relid) % apply_pool->nworkers)
+
+#define APPLY_MSG_BATCH 'B' /* relid, kind, nrows, LSN range, table, column names and types, rows */
+#define APPLY_MSG_SQL   'Q' /* relid, statement to run through SPI */
+#define APPLY_MSG_SYNC  'S' /* sync id, (relid, LSN) pairs: record, commit, report the id */
+
+typedef struct ApplyShared
+{
+    Oid database_id;
+    int stats_index;     /* the leader's entry of row_to_column.workers */
+    PGPROC *leader;
+    int nworkers;
+    slock_t mutex;
+    uint64 synced[FLEXIBLE_ARRAY_MEMBER]; /* last sync id done, per worker */
+} ApplyShared;
+
+typedef struct ApplyPool
+{
+    dsm_segment *seg;
+    ApplyShared *shared;
+    int nworkers;
+    uint64 sync_id;
+    shm_mq_handle **mqh;
+    BackgroundWorkerHandle **handles;
+} ApplyPool;
+
+static ApplyPool *apply_pool = NULL;
+
+/* Start the apply workers and the queues feeding them */
+static void
+apply_pool_start(int nworkers)
+{
+    shm_toc_estimator e;
+    shm_toc *toc;
+    Size shared_size = offsetof(ApplyShared, synced) + nworkers * sizeof(uint64);
+    ApplyPool *pool;
+    MemoryContext oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+
+    shm_toc_initialize_estimator(&e);
+    shm_toc_estimate_chunk(&e, shared_size);
+    for (int i = 0; i < nworkers; i++)
+        shm_toc_estimate_chunk(&e, APPLY_QUEUE_SIZE);
+    shm_toc_estimate_keys(&e, 1 + nworkers);
+
+    pool = palloc0(sizeof(ApplyPool));
+    pool->nworkers = nworkers;
+    pool->mqh = palloc0(nworkers * sizeof(shm_mq_handle *));
+    pool->handles = palloc0(nworkers * sizeof(BackgroundWorkerHandle *));
+
+    pool->seg = dsm_create(shm_toc_estimate(&e), 0);
+    dsm_pin_mapping(pool->seg);
+    toc = shm_toc_create(R2C_SHM_MAGIC, dsm_segment_address(pool->seg),
+                         shm_toc_estimate(&e));
+
+    pool->shared = shm_toc_allocate(toc, shared_size);
+    pool->shared->database_id = MyDatabaseId;
+    pool->shared->stats_index = htap_stats ? htap_stats - htap_workers : 0;
+    pool->shared->leader = MyProc;
+    pool->shared->nworkers = nworkers;
+    SpinLockInit(&pool->shared->mutex);
+    memset(pool->shared->synced, 0, nworkers * sizeof(uint64));
+    shm_toc_insert(toc, R2C_KEY_SHARED, pool->shared);
+
+    for (int i = 0; i < nworkers; i++)
+    {
+        BackgroundWorker worker;
+        shm_mq *mq;
+        pid_t pid;
+
+        mq = shm_mq_create(shm_toc_allocate(toc, APPLY_QUEUE_SIZE),
+                           APPLY_QUEUE_SIZE);
+        shm_toc_insert(toc, R2C_KEY_QUEUE(i), mq);
+        shm_mq_set_sender(mq, MyProc);
+
+        MemSet(&worker, 0, sizeof(worker));
+        worker.bgw_flags =
+            BGWORKER_BACKEND_DATABASE_CONNECTION | BGWORKER_SHMEM_ACCESS;
+        worker.bgw_start_time = BgWorkerStart_ConsistentState;
+        worker.bgw_restart_time = BGW_NEVER_RESTART;
+        worker.bgw_notify_pid = MyProcPid;
+        worker.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(pool->seg));
+        memcpy(worker.bgw_extra, &i, sizeof(int));
+
+        snprintf(worker.bgw_name, BGW_MAXLEN, "row_to_column apply worker %d", i);
+        snprintf(worker.bgw_type, BGW_MAXLEN, "row_to_column apply");
+        snprintf(worker.bgw_library_name, BGW_MAXLEN, "row_to_column");
+        snprintf(worker.bgw_function_name, BGW_MAXLEN, "row_to_column_apply_main");
+
+        if (!RegisterDynamicBackgroundWorker(&worker, &pool->handles[i]))
+            ereport(ERROR,
+                    (errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+                     errmsg("could not register row_to_column apply worker %d", i),
+                     errhint("You may need to increase max_worker_processes.")));
+
+        pool->mqh[i] = shm_mq_attach(mq, pool->seg, pool->handles[i]);
+
+        if (WaitForBackgroundWorkerStartup(pool->handles[i], &pid) != BGWH_STARTED)
+            ereport(ERROR,
+                    (errmsg("row_to_column apply worker %d did not start", i)));
+    }
+
+    apply_pool = pool;
+    MemoryContextSwitchTo(oldcxt);
+
+    elog(LOG, "row_to_column started %d apply workers", nworkers);
+}
+
+static void
+apply_pool_send(int worker, shm_mq_iovec *iov, int iovcnt)
+{
+    if (shm_mq_sendv(apply_pool->mqh[worker], iov, iovcnt, false, true) != SHM_MQ_SUCCESS)
+        ereport(ERROR,
+                (errmsg("row_to_column apply worker %d has exited", worker)));
+}
+
+static void
+apply_pool_send_batch(BatchEntry *be)
+{
+    StringInfoData hdr;
+    shm_mq_iovec iov[2];
+    int worker = apply_pool_worker(be->relid);
+
+    initStringInfo(&hdr);
+    pq_sendbyte(&hdr, APPLY_MSG_BATCH);
+    pq_sendint32(&hdr, be->relid);
+    pq_sendbyte(&hdr, be->kind);
+    pq_sendint32(&hdr, be->nrows);
+    pq_sendint64(&hdr, be->first_lsn);
+    pq_sendint64(&hdr, be->last_lsn);
+    appendBinaryStringInfo(&hdr, be->table, strlen(be->table) + 1);
+    pq_sendint16(&hdr, be->ncols);
+    for (int i = 0; i < be->ncols; i++)
+    {
+        appendBinaryStringInfo(&hdr, be->colnames[i], strlen(be->colnames[i]) + 1);
+        pq_sendint32(&hdr, be->coltypes[i]);
+    }
+
+    iov[0].data = hdr.data;
+    iov[0].len = hdr.len;
+    iov[1].data = be->data.data;
+    iov[1].len = be->data.len;
+    apply_pool_send(worker, iov, 2);
+
+    pfree(hdr.data);
+}
+
+static void
+apply_pool_send_sql(int worker, Oid relid, const char *sql)
+{
+    StringInfoData hdr;
+    shm_mq_iovec iov[2];
+
+    initStringInfo(&hdr);
+    pq_sendbyte(&hdr, APPLY_MSG_SQL);
+    pq_sendint32(&hdr, relid);
+
+    iov[0].data = hdr.data;
+    iov[0].len = hdr.len;
+    iov[1].data = sql;
+    iov[1].len = strlen(sql) + 1;
+    apply_pool_send(worker, iov, 2);
+
+    pfree(hdr.data);
+}
+
+/* Have the workers record progress (RelLsn *) as they commit, and wait */
+static void
+apply_pool_sync(List *progress)
+{
+    uint64 id = ++apply_pool->sync_id;
+    StringInfoData msg;
+    shm_mq_iovec iov;
+    ListCell *lc;
+
+    initStringInfo(&msg);
+    for (int i = 0; i < apply_pool->nworkers; i++)
+    {
+        resetStringInfo(&msg);
+        pq_sendbyte(&msg, APPLY_MSG_SYNC);
+        pq_sendint64(&msg, id);
+        foreach (lc, progress)
+        {
+            RelLsn *rl = (RelLsn *) lfirst(lc);
+
+            if (apply_pool_worker(rl->relid) != i)
+                continue;
+            pq_sendint32(&msg, rl->relid);
+            pq_sendint64(&msg, rl->lsn);
+        }
+        iov.data = msg.data;
+        iov.len = msg.len;
+        apply_pool_send(i, &iov, 1);
+    }
+    pfree(msg.data);
+
+    for (;;)
+    {
+        bool done = true;
+
+        SpinLockAcquire(&apply_pool->shared->mutex);
+        for (int i = 0; i < apply_pool->nworkers; i++)
+            if (apply_pool->shared->synced[i] < id)
+                done = false;
+        SpinLockRelease(&apply_pool->shared->mutex);
+
+        if (done)
+            break;
+
+        for (int i = 0; i < apply_pool->nworkers; i++)
+        {
+            pid_t pid;
+
+            if (GetBackgroundWorkerPid(apply_pool->handles[i], &pid) == BGWH_STOPPED)
+                ereport(ERROR,
+                        (errmsg("row_to_column apply worker %d has exited", i)));
+        }
+
+        WaitLatch(MyLatch,
+                  WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                  1000L, htap_wait_event(HTAP_WAIT_APPLY_POOL));
+        ResetLatch(MyLatch);
+        CHECK_FOR_INTERRUPTS();
+    }
+}
+
+/* ---------- DDL BARRIERS ---------- */
+/*
+ * A ddl_queue statement runs where it stands among the batches of its
+ * relation, see BATCH_DDL: the relation's rows before it are applied first,
+ * held ones included, and the rows after it wait for it.  Other relations
+ * go on being applied or held as before.
+ *
+ * ALTER COLUMN TYPE rewrites the mirror, which takes a while on a big one.
+ * When rows can be held (stream mode) and the compactor runs, the worker
+ * queues the statement in htap_retypes instead and holds the relation's
+ * later rows; the compactor runs it and removes the row, and the rows go on
+ * to the rewritten mirror.  Should they have to be applied before that,
+ * for a waiter or the memory cap, the worker runs the statement itself.
+ */
+
+/* Relations with a statement in htap_retypes; their rows are held */
+static List *retype_relids = NIL;
+
+#define retype_pending(relid) list_member_oid(retype_relids, (relid))
+
+/*
+ * Run a DDL statement for relid, InvalidOid for all, in line with its rows.
+ * With apply workers, ddl_apply() sees to DDL of all relations.
+ */
+static void
+ddl_run(Oid relid, const char *sql)
+{
+    RelInfo *r = OidIsValid(relid) ? hash_search(relmap, &relid, HASH_FIND, NULL) : NULL;
+
+    /* The mirror's storage options may be new, see hold_target_rows() */
+    if (r)
+        r->stripe_rows = -1;
+
+    if (apply_pool && OidIsValid(relid))
+    {
+        apply_pool_send_sql(apply_pool_worker(relid), relid, sql);
+        return;
+    }
+
+    if (SPI_execute(sql, false, 0) < 0)
+    {
+        elog(LOG, "SPI_execute failed: %s", sql);
+        stat_count_error();
+    }
+}
+
+/* Leave the compactor to run sql for relid, committed with this transaction */
+static void
+retype_queue(Oid relid, const char *sql)
+{
+    Oid argtypes[2] = {OIDOID, TEXTOID};
+    Datum args[2];
+    MemoryContext oldcxt;
+
+    args[0] = ObjectIdGetDatum(relid);
+    args[1] = CStringGetTextDatum(sql);
+    if (SPI_execute_with_args("INSERT INTO htap_retypes (relid, ddl_sql) VALUES ($1, $2)",
+                              2, argtypes, args, NULL, false, 0) != SPI_OK_INSERT)
+    {
+        /* Then it has to be done here and now */
+        ddl_run(relid, sql);
+        return;
+    }
+
+    oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+    retype_relids = lappend_oid(retype_relids, relid);
+    MemoryContextSwitchTo(oldcxt);
+
+    elog(LOG, "row_to_column: holding the rows of relation %u while its mirror is rewritten",
+         relid);
+}
+
+/* Run the queued statement of relid now, unless the compactor has */
+static void
+retype_run(Oid relid)
+{
+    Oid argtypes[1] = {OIDOID};
+    Datum args[1];
+    char *sql = NULL;
+
+    /* Waits for the compactor if it is at it, and then finds nothing */
+    args[0] = ObjectIdGetDatum(relid);
+    if (SPI_execute_with_args("DELETE FROM htap_retypes WHERE relid = $1 RETURNING ddl_sql",
+                              1, argtypes, args, NULL, false, 0) == SPI_OK_DELETE_RETURNING &&
+        SPI_processed > 0)
+        sql = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1);
+
+    retype_relids = list_delete_oid(retype_relids, relid);
+    if (sql)
+    {
+        elog(LOG, "row_to_column: rewriting the mirror of relation %u before its rows",
+             relid);
+        ddl_run(relid, sql);
+        pfree(sql);
+    }
+}
+
+/* Let go of the relations whose statement the compactor has run */
+static void
+retypes_refresh(void)
+{
+    List *pending = NIL;
+    ListCell *lc;
+    Latch *latch = NULL;
+    MemoryContext oldcxt;
+    bool ok;
+
+    if (retype_relids == NIL)
+        return;
+
+    ok = SPI_execute("SELECT relid FROM htap_retypes", true, 0) == SPI_OK_SELECT;
+
+    oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+    if (!ok)
+        pending = list_copy(retype_relids);
+    for (uint64 i = 0; ok && i < SPI_processed; i++)
+    {
+        bool isnull;
+        Oid relid = DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[i],
+                                                   SPI_tuptable->tupdesc, 1, &isnull));
+
+        if (retype_pending(relid))
+            pending = lappend_oid(pending, relid);
+    }
+    MemoryContextSwitchTo(oldcxt);
+    SPI_freetuptable(SPI_tuptable);
+
+    foreach (lc, retype_relids)
+        if (!list_member_oid(pending, lfirst_oid(lc)))
+            elog(LOG, "row_to_column: the mirror of relation %u was rewritten",
+                 lfirst_oid(lc));
+    list_free(retype_relids);
+    retype_relids = pending;
+
+    /* The compactor only looks on its own every compaction_naptime */
+    if (retype_relids != NIL && htap_stats)
+    {
+        SpinLockAcquire(&htap_stats->mutex);
+        latch = htap_stats->compactor_latch;
+        SpinLockRelease(&htap_stats->mutex);
+        if (latch)
+            SetLatch(latch);
+    }
+}
+
+/* ---------- CODEC SAMPLING ---------- */
+/*
+ * Mirrors are created with columnar's default compression.  With
+ * row_to_column.codec_sample_rows, the worker keeps the values of the first
+ * that many rows it inserts into each mirror, column by column, and
+ * compresses every column with each codec this server was built with, the
+ * way columnar compresses a chunk.  Of the codecs that encode at least
+ * codec_min_mbps, it takes the fastest unless a slower one is smaller by
+ * CODEC_MIN_GAIN, and sets it with htap_set_compression() in line with the
+ * rows: stripes written from then on use it, and compaction keeps it.
+ *
+ * Columnar has one codec per table, so the columns' sizes are added up;
+ * each column's ratio goes to htap_codecs with the choice.  Values are
+ * sampled the way pgoutput sends them, as text unless row_to_column.binary.
+ * Tables already in htap_codecs, sampled before or set by hand, are left
+ * alone.
+ *
+ * The samples count towards max_buffer_memory, see buffer_spill().  Once
+ * they hold half of it, or a column reaches CODEC_MAX_COLUMN_BYTES, a
+ * sample is judged on the rows it has.
+ */
+#define CODEC_MIN_GAIN 0.9
+#define CODEC_MAX_COLUMN_BYTES (64 * 1024 * 1024)
+
+typedef struct CodecSample
+{
+    Oid relid;              /* hash key */
+    bool done;              /* chosen, or left alone */
+    int ncols;              /* source columns of the sample */
+    char **colnames;
+    StringInfoData *values; /* per column, back to back */
+    uint64 nrows;
+} CodecSample;
+
+typedef struct CodecTrial
+{
+    const char *name;       /* as columnar.alter_table_set() takes it */
+    int level;              /* zstd's, else 0 */
+    Size *sizes;            /* per column */
+    Size total;
+    double secs;
+} CodecTrial;
+
+static HTAB *codec_samples = NULL;
+static MemoryContext codec_cxt = NULL;
+
+/* Values held by all samples */
+static Size codec_sample_bytes = 0;
+
+static CodecSample *
+codec_sample_get(Oid relid)
+{
+    CodecSample *cs;
+    bool found;
+
+    if (!codec_samples)
+    {
+        HASHCTL ctl;
+
+        codec_cxt = AllocSetContextCreate(TopMemoryContext,
+                                          "row_to_column codec samples",
+                                          ALLOCSET_DEFAULT_SIZES);
+        MemSet(&ctl, 0, sizeof(ctl));
+        ctl.keysize = sizeof(Oid);
+        ctl.entrysize = sizeof(CodecSample);
+        ctl.hcxt = codec_cxt;
+        codec_samples = hash_create("row_to_column codec samples", 16, &ctl,
+                                    HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    }
+
+    cs = hash_search(codec_samples, &relid, HASH_ENTER, &found);
+    if (!found)
+    {
+        cs->done = false;
+        cs->ncols = 0;
+        cs->colnames = NULL;
+        cs->values = NULL;
+        cs->nrows = 0;
+    }
+    return cs;
+}
+
+static void
+codec_sample_free(CodecSample *cs)
+{
+    for (int i = 0; i < cs->ncols; i++)
+    {
+        codec_sample_bytes -= cs->values[i].len;
+        pfree(cs->colnames[i]);
+        pfree(cs->values[i].data);
+    }
+    if (cs->ncols > 0)
+    {
+        pfree(cs->colnames);
+        pfree(cs->values);
+    }
+    cs->ncols = 0;
+    cs->nrows = 0;
+}
+
+/* Start over for the columns be was decoded with, unless they are the same */
+static void
+codec_sample_columns(CodecSample *cs, BatchEntry *be)
+{
+    MemoryContext oldcxt;
+    bool same = cs->ncols == be->ncols;
+
+    for (int i = 0; same && i < be->ncols; i++)
+        same = strcmp(cs->colnames[i], be->colnames[i]) == 0;
+    if (same)
+        return;
+
+    codec_sample_free(cs);
+    oldcxt = MemoryContextSwitchTo(codec_cxt);
+    cs->ncols = be->ncols;
+    cs->colnames = palloc(be->ncols * sizeof(char *));
+    cs->values = palloc(be->ncols * sizeof(StringInfoData));
+    for (int i = 0; i < be->ncols; i++)
+    {
+        cs->colnames[i] = pstrdup(be->colnames[i]);
+        initStringInfo(&cs->values[i]);
+    }
+    MemoryContextSwitchTo(oldcxt);
+}
+
+/* Compressed size of src, as columnar would keep it */
+static Size
+codec_compress(const CodecTrial *t, const StringInfoData *src, char *dst, Size cap)
+{
+    int64 n = -1;
+
+    if (strcmp(t->name, "pglz") == 0)
+        n = pglz_compress(src->data, src->len, dst, PGLZ_strategy_always);
+#ifdef USE_LZ4
+    else if (strcmp(t->name, "lz4") == 0)
+        n = LZ4_compress_default(src->data, dst, src->len, cap);
+#endif
+#ifdef USE_ZSTD
+    else if (strcmp(t->name, "zstd") == 0)
+    {
+        size_t z = ZSTD_compress(dst, cap, src->data, src->len, t->level);
+
+        n = ZSTD_isError(z) ? -1 : (int64) z;
+    }
+#endif
+
+    /* A chunk that does not shrink is stored as it is */
+    return (n <= 0 || n >= src->len) ? src->len : (Size) n;
+}
+
+static int
+codec_trial_cmp(const void *a, const void *b)
+{
+    double sa = ((const CodecTrial *) a)->secs;
+    double sb = ((const CodecTrial *) b)->secs;
+
+    return sa < sb ? -1 : sa > sb ? 1 : 0;
+}
+
+/* Try the codecs on the sample and set the one that pays for itself */
+static void
+codec_choose(CodecSample *cs)
+{
+    CodecTrial trials[] = {
+        {"none", 0},
+        {"pglz", 0},
+#ifdef USE_LZ4
+        {"lz4", 0},
+#endif
+#ifdef USE_ZSTD
+        {"zstd", 1},
+        {"zstd", 3},
+        {"zstd", 9},
+#endif
+    };
+    int ntrials = lengthof(trials);
+    CodecTrial *best;
+    RelInfo *r = hash_search(relmap, &cs->relid, HASH_FIND, NULL);
+    Size raw = 0;
+    Size maxlen = 0;
+    char *dst;
+    StringInfoData sample;
+    char *sql;
+
+    cs->done = true;
+    if (!r)
+    {
+        codec_sample_free(cs);
+        return;
+    }
+
+    for (int c = 0; c < cs->ncols; c++)
+    {
+        raw += cs->values[c].len;
+        maxlen = Max(maxlen, (Size) cs->values[c].len);
+    }
+
+    /* Room for the worst case of each of them */
+    dst = palloc(maxlen + maxlen / 128 + 1024);
+    for (int t = 0; t < ntrials; t++)
+    {
+        instr_time start, duration;
+
+        trials[t].sizes = palloc(cs->ncols * sizeof(Size));
+        trials[t].total = 0;
+        INSTR_TIME_SET_CURRENT(start);
+        for (int c = 0; c < cs->ncols; c++)
+        {
+            trials[t].sizes[c] = codec_compress(&trials[t], &cs->values[c], dst,
+                                                maxlen + maxlen / 128 + 1024);
+            trials[t].total += trials[t].sizes[c];
+        }
+        INSTR_TIME_SET_CURRENT(duration);
+        INSTR_TIME_SUBTRACT(duration, start);
+        trials[t].secs = INSTR_TIME_GET_DOUBLE(duration);
+    }
+    pfree(dst);
+
+    /* Fastest first: each slower codec has to be worth its time */
+    qsort(trials, ntrials, sizeof(CodecTrial), codec_trial_cmp);
+    best = NULL;
+    for (int t = 0; t < ntrials; t++)
+    {
+        bool fast_enough = strcmp(trials[t].name, "none") == 0 ||
+                           trials[t].secs * r2c_codec_min_mbps * 1024.0 * 1024.0 <= raw;
+
+        if (fast_enough && (!best || trials[t].total < best->total * CODEC_MIN_GAIN))
+            best = &trials[t];
+    }
+
+    initStringInfo(&sample);
+    appendStringInfo(&sample, "{\"rows\": " UINT64_FORMAT ", \"bytes\": " UINT64_FORMAT
+                     ", \"codecs\": {", cs->nrows, (uint64) raw);
+    for (int t = 0; t < ntrials; t++)
+    {
+        appendStringInfo(&sample, "%s\"%s", t ? ", " : "", trials[t].name);
+        if (trials[t].level)
+            appendStringInfo(&sample, "-%d", trials[t].level);
+        appendStringInfo(&sample, "\": {\"ratio\": %.2f, \"ms\": %.1f}",
+                         trials[t].total ? (double) raw / trials[t].total : 1.0,
+                         trials[t].secs * 1000.0);
+    }
+    appendStringInfoString(&sample, "}, \"columns\": {");
+    for (int c = 0; c < cs->ncols; c++)
+    {
+        if (c)
+            appendStringInfoString(&sample, ", ");
+        escape_json(&sample, cs->colnames[c]);
+        appendStringInfo(&sample, ": %.2f",
+                         best->sizes[c] ? (double) cs->values[c].len / best->sizes[c] : 1.0);
+    }
+    appendStringInfoString(&sample, "}}");
+
+    /* By oid: the table may be renamed or gone by now, in the catalog */
+    sql = psprintf("SELECT htap_set_compression(%u::oid, %s, %s, %s)",
+                   cs->relid, quote_literal_cstr(best->name),
+                   best->level ? psprintf("%d", best->level) : "NULL",
+                   quote_literal_cstr(sample.data));
+    ddl_run(cs->relid, sql);
+
+    elog(LOG, "row_to_column: compressing the mirror of %s with %s, %.2fx on " UINT64_FORMAT " sampled rows",
+         r->relname, best->name, best->total ? (double) raw / best->total : 1.0, cs->nrows);
+
+    for (int t = 0; t < ntrials; t++)
+        pfree(trials[t].sizes);
+    pfree(sample.data);
+    pfree(sql);
+    codec_sample_free(cs);
+}
+
+/* Add the values of be's rows to its relation's sample, if it is still taking them */
+static void
+codec_sample(BatchEntry *be)
+{
+    CodecSample *cs = codec_sample_get(be->relid);
+    StringInfoData buf;
+    MemoryContext oldcxt;
+    bool full = false;
+
+    if (cs->done)
+        return;
+    codec_sample_columns(cs, be);
+
+    buf = be->data;
+    buf.cursor = 0;
+    oldcxt = MemoryContextSwitchTo(codec_cxt);
+    while (buf.cursor < buf.len && cs->nrows < (uint64) r2c_codec_sample_rows && !full)
+    {
+        int ncols;
+
+        pq_getmsgint64(&buf); // the row's LSN
+        ncols = pq_getmsgint(&buf, 2);
+        for (int i = 0; i < ncols; i++)
+        {
+            char ck = pq_getmsgbyte(&buf);
+            int len;
+            const char *val;
+
+            if (ck == 'n' || ck == 'u')
+                continue;
+            len = pq_getmsgint(&buf, 4);
+            val = pq_getmsgbytes(&buf, len);
+            if (i < cs->ncols)
+            {
+                appendBinaryStringInfo(&cs->values[i], val, len);
+                codec_sample_bytes += len;
+                full |= cs->values[i].len >= CODEC_MAX_COLUMN_BYTES;
+            }
+        }
+        cs->nrows++;
+        full |= codec_sample_bytes >= (Size) r2c_max_buffer_memory * 1024 / 2;
+    }
+    MemoryContextSwitchTo(oldcxt);
+
+    if (cs->nrows >= (uint64) r2c_codec_sample_rows || full)
+        codec_choose(cs);
+}
+
+/* ---------- SPILL FILES ---------- */
+/*
+ * Buffers are applied when max_bytes_per_cycle of committed data is
+ * buffered, but a transaction still in progress has to be kept until its
+ * COMMIT, however large.  Once the buffers hold row_to_column.
+ * max_buffer_memory, the largest transactions in the list have the rows
+ * of their batches written to a temporary file (in temp_tablespaces, else
+ * the data directory's pgsql_tmp), each in segments of up to flush_bytes;
+ * the batches take new rows in memory as before.  Such a buffer is not
+ * merged with others and is applied on its own, without holding rows: each
+ * batch reads its segments back one at a time, in order, then goes on with
+ * the rows in memory.  Streamed transactions use the same file routines.
+ */
+typedef struct SpillSegment
+{
+    int fileno;
+    off_t offset;
+    int len;
+    int nrows;
+    XLogRecPtr first_lsn;
+    XLogRecPtr last_lsn;
+} SpillSegment;
+
+static void
+spill_write(BufFile *file, const void *ptr, size_t size)
+{
+#if PG_VERSION_NUM >= 160000
+    BufFileWrite(file, ptr, size);
+#else
+    if (BufFileWrite(file, (void *) ptr, size) != size)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not write to row_to_column spill file: %m")));
+#endif
+}
+
+static void
+spill_read(BufFile *file, void *ptr, size_t size)
+{
+#if PG_VERSION_NUM >= 160000
+    BufFileReadExact(file, ptr, size);
+#else
+    if (BufFileRead(file, ptr, size) != size)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not read from row_to_column spill file: %m")));
+#endif
+}
+
+static void
+spill_seek(BufFile *file, int fileno, off_t offset)
+{
+    if (BufFileSeek(file, fileno, offset, SEEK_SET) != 0)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not seek in row_to_column spill file: %m")));
+}
+
+/* Close txn's spill file with its memory, however the buffer goes away */
+static void
+txn_spill_close(void *arg)
+{
+    TxnBuf *txn = (TxnBuf *) arg;
+
+    if (txn->spill)
+        BufFileClose(txn->spill);
+    txn->spill = NULL;
+}
+
+/* Write the rows of txn's batches to its spill file */
+static void
+txn_spill(TxnBuf *txn)
+{
+    MemoryContext oldcxt = MemoryContextSwitchTo(txn->cxt);
+    ListCell *lc;
+    Size freed = 0;
+
+    if (!txn->spill)
+    {
+        MemoryContextCallback *cb = palloc(sizeof(MemoryContextCallback));
+
+        txn->spill = BufFileCreateTemp(true);
+        cb->func = txn_spill_close;
+        cb->arg = txn;
+        MemoryContextRegisterResetCallback(txn->cxt, cb);
+    }
+
+    foreach (lc, txn->batches)
+    {
+        BatchEntry *be = (BatchEntry *) lfirst(lc);
+        int off = 0;
+
+        if (batch_is_ddl(be) || be->data.len == 0)
+            continue;
+
+        while (off < be->data.len)
+        {
+            SpillSegment *seg = palloc(sizeof(SpillSegment));
+            XLogRecPtr lsn;
+
+            /* Whole rows, at least one */
+            seg->len = 0;
+            seg->nrows = 0;
+            while (off + seg->len < be->data.len &&
+                   (seg->nrows == 0 || seg->len < r2c_flush_bytes * 1024))
+            {
+                seg->len = batch_row_next(be, off + seg->len, &lsn) - off;
+                if (seg->nrows++ == 0)
+                    seg->first_lsn = lsn;
+                seg->last_lsn = lsn;
+            }
+
+            BufFileTell(txn->spill, &seg->fileno, &seg->offset);
+            spill_write(txn->spill, be->data.data + off, seg->len);
+            be->spilled = lappend(be->spilled, seg);
+            off += seg->len;
+        }
+
+        freed += be->data.len;
+        pfree(be->data.data);
+        initStringInfo(&be->data);
+        be->nrows = 0;
+        be->first_lsn = be->last_lsn = InvalidXLogRecPtr;
+    }
+    MemoryContextSwitchTo(oldcxt);
+
+    txn->spilled_bytes += freed;
+    buffered_bytes -= freed;
+    R2C_PROBE2(spill, freed, txn->spilled_bytes);
+    elog(DEBUG1, "row_to_column spilled %zu bytes of a transaction buffer, %zu in all",
+         freed, txn->spilled_bytes);
+}
+
+/* Bytes of txn that txn_spill() would write out: rows, not DDL */
+static Size
+txn_spillable(TxnBuf *txn)
+{
+    ListCell *lc;
+    Size bytes = 0;
+
+    foreach (lc, txn->batches)
+    {
+        BatchEntry *be = (BatchEntry *) lfirst(lc);
+
+        if (!batch_is_ddl(be))
+            bytes += be->data.len;
+    }
+    return bytes;
+}
+
+/*
+ * Spill the largest buffers in the list until those in memory are within
+ * max_buffer_memory.  Held rows and the pending buffer are not spilled:
+ * they go as soon as the per-cycle cap is reached, so in memory there can
+ * be up to about max_bytes_per_cycle more.  Once nothing in the list is
+ * worth spilling it stops, over the cap or not.
+ */
+static void
+buffer_spill(void)
+{
+    while (buffered_bytes + codec_sample_bytes > (Size) r2c_max_buffer_memory * 1024)
+    {
+        TxnBuf *largest = NULL;
+        Size most = 0;
+
+        CHECK_FOR_INTERRUPTS();
+        for (TxnBuf *txn = txn_head; txn; txn = txn->next)
+        {
+            Size bytes = txn_spillable(txn);
+
+            if (bytes > most)
+            {
+                largest = txn;
+                most = bytes;
+            }
+        }
+        if (!largest || most < BLCKSZ)
+            break;
+        txn_spill(largest);
+    }
+}
+
+/* Put segment seg of be back in be->data, instead of what is there */
+static void
+spill_load(TxnBuf *txn, BatchEntry *be, SpillSegment *seg)
+{
+    be->data.data = MemoryContextAlloc(txn->cxt, seg->len + 1);
+    spill_seek(txn->spill, seg->fileno, seg->offset);
+    spill_read(txn->spill, be->data.data, seg->len);
+    /* Terminated like a StringInfo, see apply_target_value() */
+    be->data.data[seg->len] = '\0';
+    be->data.len = seg->len;
+    be->data.maxlen = seg->len + 1;
+    be->data.cursor = 0;
+    be->nrows = seg->nrows;
+    be->first_lsn = seg->first_lsn;
+    be->last_lsn = seg->last_lsn;
+}
+
+/* ---------- HELD ROWS ---------- */
+/*
+ * Citus columnar writes a stripe per relation and transaction, and stream
+ * mode commits every flush: applying each relation on each flush leaves
+ * mirrors made of tiny stripes.  So in stream mode a source relation's rows,
+ * its deletes with them, are held back across flushes until there are
+ * enough for row_to_column.stripe_fill of its mirror's stripe_row_limit
+ * (at least a chunk group), or the oldest has waited
+ * row_to_column.max_hold_ms, or for as long as the compactor rewrites its
+ * mirror or runs a retype on it.  DDL of the relation, waiters and the
+ * memory cap let them go.
+ *
+ * While rows are held, applied_lsn stays at the floor of the oldest hold:
+ * all before it is applied.  The relations written meanwhile record how far
+ * they got in htap_progress, with their rows, so that a restart from that
+ * floor does not apply their changes twice.
+ */
+typedef struct RelHold
+{
+    Oid relid;                 /* hash key */
+    MemoryContext cxt;         /* the batches, deleted once applied */
+    List *batches;             /* BatchEntry *, copied from pending buffers */
+    uint64 nrows;              /* row versions for the mirror */
+    Size bytes;
+    TimestampTz first_change;
+    XLogRecPtr floor_lsn;      /* everything before was applied when it began */
+} RelHold;
+
+static HTAB *rel_holds = NULL;
+
+/* End of the last pending buffer processed, held rows or not */
+static XLogRecPtr flushed_lsn = InvalidXLogRecPtr;
+
+/* Relations written since htap_progress was last brought up to date */
+static List *progress_relids = NIL;
+
+#define holds_exist() (rel_holds && hash_get_num_entries(rel_holds) > 0)
+#define holds_enabled() (r2c_mode == R2C_MODE_STREAM && r2c_stripe_fill > 0)
+
+static int
+txn_apply_batch(BatchEntry *be)
+{
+    MemoryContext oldcxt;
+
+    /* Rows decoded with the new column types need the rewritten mirror */
+    if (retype_pending(be->relid))
+        retype_run(be->relid);
+
+    if (r2c_codec_sample_rows > 0 && be->kind == BATCH_INSERT)
+        codec_sample(be);
+
+    if (!list_member_oid(progress_relids, be->relid))
+    {
+        oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+        progress_relids = lappend_oid(progress_relids, be->relid);
+        MemoryContextSwitchTo(oldcxt);
+    }
+
+    if (apply_pool)
+    {
+        apply_pool_send_batch(be);
+        return be->nrows;
+    }
+    return batch_apply(be);
+}
+
+/*
+ * Rows of r to hold for its mirror, 0 when the mirror is not columnar.  A
+ * partitioned mirror goes by the options of one of its partitions.
+ */
+static int64
+hold_target_rows(RelInfo *r)
+{
+    if (r->stripe_rows < 0)
+    {
+        char *mirror = psprintf("%s_col", r->relname);
+        char *sql = psprintf("SELECT o.stripe_row_limit::int8, o.chunk_group_row_limit::int8 "
+                             "FROM columnar.options o WHERE o.relation = to_regclass(%1$s) "
+                             "OR o.relation IN (SELECT i.inhrelid FROM pg_inherits i "
+                             "WHERE i.inhparent = to_regclass(%1$s)) LIMIT 1",
+                             quote_literal_cstr(quote_identifier(mirror)));
+
+        r->stripe_rows = 0;
+        if (SPI_execute("SELECT 1 WHERE to_regclass('columnar.options') IS NOT NULL",
+                        true, 0) == SPI_OK_SELECT && SPI_processed > 0 &&
+            SPI_execute(sql, true, 0) == SPI_OK_SELECT && SPI_processed > 0)
+        {
+            bool isnull;
+
+            r->stripe_rows = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0],
+                                                         SPI_tuptable->tupdesc, 1, &isnull));
+            r->chunk_group_rows = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0],
+                                                              SPI_tuptable->tupdesc, 2, &isnull));
+        }
+        SPI_freetuptable(SPI_tuptable);
+        pfree(sql);
+        pfree(mirror);
+    }
+
+    if (r->stripe_rows <= 0)
+        return 0;
+    return Max((int64) (r->stripe_rows * r2c_stripe_fill), r->chunk_group_rows);
+}
+
+static int
+hold_apply(RelHold *h)
+{
+    ListCell *lc;
+    int rows = 0;
+
+    foreach (lc, h->batches)
+        rows += txn_apply_batch((BatchEntry *) lfirst(lc));
+    buffered_bytes -= h->bytes;
+    MemoryContextDelete(h->cxt);
+    hash_search(rel_holds, &h->relid, HASH_REMOVE, NULL);
+    return rows;
+}
+
+/* Apply the holds that waited long enough, or all of them */
+static int
+holds_apply(bool all)
+{
+    HASH_SEQ_STATUS seq;
+    RelHold *h;
+    TimestampTz now = GetCurrentTimestamp();
+    Oid compacting;
+    int rows = 0;
+
+    if (!holds_exist())
+        return 0;
+
+    compacting = stat_compact_relid();
+    hash_seq_init(&seq, rel_holds);
+    while ((h = hash_seq_search(&seq)) != NULL)
+        if (all ||
+            (h->relid != compacting && !retype_pending(h->relid) &&
+             TimestampDifferenceExceeds(h->first_change, now, r2c_max_hold_ms)))
+            rows += hold_apply(h);
+    return rows;
+}
+
+/* When the oldest held row came in, 0 when nothing is held */
+static TimestampTz
+holds_oldest(void)
+{
+    HASH_SEQ_STATUS seq;
+    RelHold *h;
+    TimestampTz oldest = 0;
+
+    if (!holds_exist())
+        return 0;
+
+    /* Rows waiting for a retype are not let go for their age */
+    hash_seq_init(&seq, rel_holds);
+    while ((h = hash_seq_search(&seq)) != NULL)
+        if (!retype_pending(h->relid) && (oldest == 0 || h->first_change < oldest))
+            oldest = h->first_change;
+    return oldest;
+}
+
+static bool
+holds_due(void)
+{
+    TimestampTz oldest = holds_oldest();
+
+    return oldest != 0 &&
+           (stat_flush_requested() || buffer_limit_reached() ||
+            TimestampDifferenceExceeds(oldest, GetCurrentTimestamp(), r2c_max_hold_ms));
+}
+
+/* How far applied_lsn may go with end processed: not past any hold */
+static XLogRecPtr
+holds_floor(XLogRecPtr end)
+{
+    HASH_SEQ_STATUS seq;
+    RelHold *h;
+
+    if (!holds_exist())
+        return end;
+
+    hash_seq_init(&seq, rel_holds);
+    while ((h = hash_seq_search(&seq)) != NULL)
+        end = Min(end, h->floor_lsn);
+    return end;
+}
+
+/*
+ * Should the rows of relid in txn be held?  If not, and some are held
+ * already, those are applied first.
+ */
+static bool
+hold_wanted(TxnBuf *txn, Oid relid, int *rows)
+{
+    RelInfo *r = hash_search(relmap, &relid, HASH_FIND, NULL);
+    RelHold *h = rel_holds ? hash_search(rel_holds, &relid, HASH_FIND, NULL) : NULL;
+    uint64 nrows = h ? h->nrows : 0;
+    int64 target;
+    ListCell *lc;
+
+    /* The compactor has its mirror locked: writing to it would just wait */
+    if (relid == stat_compact_relid() || retype_pending(relid))
+        return true;
+
+    target = r ? hold_target_rows(r) : 0;
+    if (target > 0)
+    {
+        foreach (lc, txn->batches)
+        {
+            BatchEntry *be = (BatchEntry *) lfirst(lc);
+
+            if (be->relid == relid && be->kind == BATCH_INSERT)
+                nrows += be->nrows;
+        }
+        if (nrows < (uint64) target)
+            return true;
+    }
+
+    if (h)
+        *rows += hold_apply(h);
+    return false;
+}
+
+/* Move the batches of relid from txn to its hold */
+static void
+hold_keep(TxnBuf *txn, Oid relid)
+{
+    bool found;
+    RelHold *h;
+    ListCell *lc;
+    MemoryContext oldcxt;
+
+    if (!rel_holds)
+    {
+        HASHCTL ctl;
+
+        MemSet(&ctl, 0, sizeof(ctl));
+        ctl.keysize = sizeof(Oid);
+        ctl.entrysize = sizeof(RelHold);
+        rel_holds = hash_create("row_to_column_holds", 64, &ctl,
+                                HASH_ELEM | HASH_BLOBS);
+    }
+
+    h = hash_search(rel_holds, &relid, HASH_ENTER, &found);
+    if (!found)
+    {
+        h->cxt = GenerationContextCreate(txn_cxt, "row_to_column hold",
+                                         ALLOCSET_DEFAULT_SIZES);
+        h->batches = NIL;
+        h->nrows = 0;
+        h->bytes = 0;
+        h->first_change = txn->first_change;
+        h->floor_lsn = flushed_lsn;
+    }
+
+    oldcxt = MemoryContextSwitchTo(h->cxt);
+    foreach (lc, txn->batches)
+    {
+        BatchEntry *be = (BatchEntry *) lfirst(lc);
+        BatchEntry *hbe = NULL;
+        ListCell *hlc;
+
+        if (be->relid != relid)
+            continue;
+
+        foreach (hlc, h->batches)
+        {
+            BatchEntry *cand = (BatchEntry *) lfirst(hlc);
+            if (cand->kind == be->kind && cand->generation == be->generation)
+            {
+                hbe = cand;
+                break;
+            }
+        }
+
+        if (!hbe)
+        {
+            hbe = palloc(sizeof(BatchEntry));
+            *hbe = *be;
+            hbe->table = pstrdup(be->table);
+            hbe->colnames = palloc(be->ncols * sizeof(char *));
+            for (int i = 0; i < be->ncols; i++)
+                hbe->colnames[i] = pstrdup(be->colnames[i]);
+            hbe->coltypes = palloc(be->ncols * sizeof(Oid));
+            memcpy(hbe->coltypes, be->coltypes, be->ncols * sizeof(Oid));
+            initStringInfo(&hbe->data);
+            hbe->nrows = 0;
+            h->batches = lappend(h->batches, hbe);
+        }
+
+        appendBinaryStringInfo(&hbe->data, be->data.data, be->data.len);
+        hbe->nrows += be->nrows;
+        batch_lsn_add(hbe, be->first_lsn, be->last_lsn);
+        if (be->kind == BATCH_INSERT)
+            h->nrows += be->nrows;
+        h->bytes += be->data.len;
+        buffered_bytes += be->data.len;
+    }
+    MemoryContextSwitchTo(oldcxt);
+}
+
+/*
+ * How far each relation written since the last progress_write() is applied,
+ * everything before lsn being done: up to its hold if its later rows were
+ * held again, as RelLsn *s.  Invalid lsn, none.
+ */
+static List *
+progress_pending(XLogRecPtr lsn)
+{
+    List *progress = NIL;
+    ListCell *lc;
+
+    if (XLogRecPtrIsInvalid(lsn))
+        return NIL;
+
+    foreach (lc, progress_relids)
+    {
+        Oid relid = lfirst_oid(lc);
+        RelHold *h = rel_holds ? hash_search(rel_holds, &relid, HASH_FIND, NULL) : NULL;
+        RelLsn *rl = palloc(sizeof(RelLsn));
+
+        rl->relid = relid;
+        rl->lsn = h ? Min(lsn, h->floor_lsn) : lsn;
+        progress = lappend(progress, rl);
+    }
+    return progress;
+}
+
+/* Record progress (RelLsn *) in htap_progress */
+static void
+progress_record(List *progress)
+{
+    ListCell *lc;
+
+    foreach (lc, progress)
+    {
+        RelLsn *rl = (RelLsn *) lfirst(lc);
+        char *sql = psprintf("INSERT INTO htap_progress (relid, lsn) "
+                             "VALUES (%u, '%X/%X') ON CONFLICT (relid) DO UPDATE "
+                             "SET lsn = GREATEST(htap_progress.lsn, EXCLUDED.lsn)",
+                             rl->relid, LSN_FORMAT_ARGS(rl->lsn));
+
+        if (SPI_execute(sql, false, 0) < 0)
+        {
+            elog(LOG, "SPI_execute failed: %s", sql);
+            stat_count_error();
+        }
+        pfree(sql);
+    }
+}
+
+/*
+ * Record in htap_progress that the relations written since the last call
+ * are applied up to lsn.  Only needed while rows are held, as applied_lsn
+ * covers them otherwise; the apply workers have recorded it already, see
+ * PARALLEL APPLY.
+ */
+static void
+progress_write(XLogRecPtr lsn)
+{
+    if (!apply_pool && holds_exist())
+        progress_record(progress_pending(lsn));
+
+    list_free(progress_relids);
+    progress_relids = NIL;
+}
+
+/* Is be the last of txn's batches of its relation, no DDL of all after it? */
+static bool
+ddl_ends_relation(TxnBuf *txn, BatchEntry *be)
+{
+    ListCell *lc;
+    bool after = false;
+
+    foreach (lc, txn->batches)
+    {
+        BatchEntry *other = (BatchEntry *) lfirst(lc);
+
+        if (other == be)
+            after = true;
+        else if (after && (other->relid == be->relid ||
+                           (batch_is_ddl(other) && !OidIsValid(other->relid))))
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Run DDL barrier be, the rows before it being applied.  A retype that
+ * ends its relation's part of txn is left to the compactor unless drain.
+ */
+static void
+ddl_apply(TxnBuf *txn, BatchEntry *be, bool drain)
+{
+    MemoryContext oldcxt;
+
+    if (!OidIsValid(be->relid))
+    {
+        while (retype_relids != NIL)
+            retype_run(linitial_oid(retype_relids));
+
+        /*
+         * Every worker commits what it has before the statement and one
+         * runs it.  Those commits record progress as txn_pending_flush()
+         * has the workers do, or a restart would apply held rows again.
+         */
+        if (apply_pool)
+        {
+            apply_pool_sync(progress_pending(flushed_lsn));
+            apply_pool_send_sql(0, InvalidOid, be->data.data);
+            apply_pool_sync(progress_pending(flushed_lsn));
+        }
+        else
+            ddl_run(InvalidOid, be->data.data);
+        return;
+    }
+
+    if (retype_pending(be->relid))
+        retype_run(be->relid);
+
+    /* It is applied with them as far as a restart is concerned */
+    if (!list_member_oid(progress_relids, be->relid))
+    {
+        oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+        progress_relids = lappend_oid(progress_relids, be->relid);
+        MemoryContextSwitchTo(oldcxt);
+    }
+
+    if (be->kind == BATCH_RETYPE && !drain && r2c_compaction &&
+        ddl_ends_relation(txn, be))
+        retype_queue(be->relid, be->data.data);
+    else
+        ddl_run(be->relid, be->data.data);
+}
+
+/*
+ * Execute a single transaction buffer; with drain, or when it carries DDL
+ * of all relations, without holding any rows back.  Relations with DDL in
+ * it are not held either: their rows before the DDL have to be applied,
+ * what was held of them first.
+ */
+static int
+txn_process_buffer(TxnBuf *txn, bool drain)
+{
+    ListCell *lc;
+    List *held = NIL;
+    List *ready = NIL;
+    int rows = 0;
+
+    if (!txn)
+        return 0;
+
+    R2C_PROBE2(flush__start, txn->nrows, txn->bytes);
+    pgstat_report_wait_start(htap_wait_event(HTAP_WAIT_APPLY));
+
+    foreach (lc, txn->batches)
+    {
+        BatchEntry *be = (BatchEntry *) lfirst(lc);
+
+        if (batch_is_ddl(be) && !OidIsValid(be->relid))
+            drain = true;
+    }
+    drain = drain || txn->spill || !holds_enabled() ||
+            stat_flush_requested() || buffer_limit_reached();
+    retypes_refresh();
+    rows += holds_apply(drain);
+
+    foreach (lc, txn->batches)
+    {
+        BatchEntry *be = (BatchEntry *) lfirst(lc);
+        RelHold *h;
+
+        if (drain || !batch_is_ddl(be) || list_member_oid(ready, be->relid))
+            continue;
+        ready = lappend_oid(ready, be->relid);
+        if (rel_holds && (h = hash_search(rel_holds, &be->relid, HASH_FIND, NULL)) != NULL)
+            rows += hold_apply(h);
+    }
+
+    /*
+     * Write each per-relation batch through the table AM, and run DDL
+     * (ddl_queue entries) through SPI where it stands
+     */
+    foreach (lc, txn->batches)
+    {
+        BatchEntry *be = (BatchEntry *) lfirst(lc);
+
+        if (batch_is_ddl(be))
+        {
+            ddl_apply(txn, be, drain);
+            continue;
+        }
+
+        if (!drain && !list_member_oid(ready, be->relid))
+        {
+            if (!list_member_oid(held, be->relid))
+            {
+                if (hold_wanted(txn, be->relid, &rows))
+                    held = lappend_oid(held, be->relid);
+                else
+                    ready = lappend_oid(ready, be->relid);
+            }
+            if (list_member_oid(held, be->relid))
+                continue;
+        }
+
+        /* Its spilled rows first, a segment at a time */
+        if (be->spilled)
+        {
+            StringInfoData rest = be->data;
+            int rest_rows = be->nrows;
+            XLogRecPtr rest_first = be->first_lsn;
+            XLogRecPtr rest_last = be->last_lsn;
+            ListCell *slc;
+
+            foreach (slc, be->spilled)
+            {
+                spill_load(txn, be, (SpillSegment *) lfirst(slc));
+                rows += txn_apply_batch(be);
+                pfree(be->data.data);
+            }
+            be->data = rest;
+            be->nrows = rest_rows;
+            be->first_lsn = rest_first;
+            be->last_lsn = rest_last;
+            if (be->nrows == 0)
+                continue;
+        }
+        rows += txn_apply_batch(be);
+    }
+
+    foreach (lc, held)
+        hold_keep(txn, lfirst_oid(lc));
+
+    MemoryContextDelete(txn->cxt);
+
+    pgstat_report_wait_end();
+    R2C_PROBE1(flush__done, rows);
+    return rows;
+}
+
+/*
+ * Committed transactions are not applied one by one.  They are merged into
+ * a single pending buffer, one batch per relation, which is applied once it
+ * holds row_to_column.flush_rows rows or flush_bytes of data, or its oldest
+ * change is flush_interval_ms old.  A transaction carrying DDL closes the
+ * pending buffer, so that its relations' rows after it are in the buffers
+ * that follow, see ddl_apply().
+ */
+static TxnBuf *txn_pending = NULL;
+
+/* Move committed transactions from the head of the list into txn_pending */
+static void txn_coalesce(void)
+{
+    while (txn_head && txn_head->committed)
+    {
+        TxnBuf *txn = txn_head;
+        ListCell *lc;
+        MemoryContext oldcxt;
+        bool moved = false;
+
+        /* Nor are spilled buffers, whose rows are in their own file */
+        if (txn_pending && (txn_pending->nddls > 0 || txn_pending->spill || txn->spill))
+            break;
+
+        txn_head = txn->next;
+        txn->next = NULL;
+
+        if (!txn_pending)
+        {
+            txn_pending = txn;
+            continue;
+        }
+
+        oldcxt = MemoryContextSwitchTo(txn_pending->cxt);
+
+        foreach (lc, txn->batches)
+        {
+            BatchEntry *be = (BatchEntry *) lfirst(lc);
+            BatchEntry *pbe = NULL;
+
+            /* Rows after DDL of their relation go after it, in a batch of their own */
+            if (!batch_is_ddl(be))
+                pbe = batch_find(txn_pending->batches, be->relid, be->kind, be->generation);
+
+            if (pbe)
+            {
+                appendBinaryStringInfo(&pbe->data, be->data.data, be->data.len);
+                pbe->nrows += be->nrows;
+                batch_lsn_add(pbe, be->first_lsn, be->last_lsn);
+                pfree(be->data.data);
+            }
+            else
+            {
+                txn_pending->batches = lappend(txn_pending->batches, be);
+                moved = true;
+            }
+        }
+        txn_pending->nddls += txn->nddls;
+
+        MemoryContextSwitchTo(oldcxt);
+
+        txn_pending->nrows += txn->nrows;
+        txn_pending->bytes += txn->bytes;
+        txn_pending->end_lsn = txn->end_lsn;
+        txn_pending->commit_time = txn->commit_time;
+        txn_pending->ntxns += txn->ntxns;
+
+        /* What the pending buffer took over now goes away with it */
+        if (moved)
+            MemoryContextSetParent(txn->cxt, txn_pending->cxt);
+        else
+            MemoryContextDelete(txn->cxt);
+    }
+    if (!txn_head)
+        txn_tail = NULL;
+}
+
+/* Has the pending buffer reached one of its flush thresholds? */
+static bool txn_pending_due(void)
+{
+    if (!txn_pending)
+        return false;
+
+    return txn_pending->nddls > 0 ||
+           txn_pending->spill ||
+           (txn_head && txn_head->committed && txn_head->spill) ||
+           buffer_limit_reached() ||
+           stat_flush_requested() ||
+           txn_pending->nrows >= (uint64) r2c_flush_rows ||
+           txn_pending->bytes >= (Size) r2c_flush_bytes * 1024 ||
+           TimestampDifferenceExceeds(txn_pending->first_change,
+                                      GetCurrentTimestamp(),
+                                      r2c_flush_interval_ms);
+}
+
+/* Apply the pending buffer in the current transaction */
+static void txn_pending_flush(void)
+{
+    TimestampTz start_time = GetCurrentTimestamp();
+    TxnBuf *txn = txn_pending;
+    XLogRecPtr last_end = txn->end_lsn;
+    int ntxns = txn->ntxns;
+    int total_rows;
+
+    local_stats.transactions += ntxns;
+    local_stats.bytes += txn->bytes;
+    local_stats.last_commit_time = txn->commit_time;
+
+    txn_pending = NULL;
+    buffered_bytes -= txn_memory(txn);
+    total_rows = txn_process_buffer(txn, false);
+
+    /* Nothing counts as applied until the apply workers have committed it */
+    if (apply_pool)
+        apply_pool_sync(progress_pending(last_end));
+    flushed_lsn = last_end;
+    progress_write(last_end);
+    applied_advance(holds_floor(last_end));
+    if (r2c_fresh_reads)
+        fresh_apply_xid = GetTopTransactionId();
+
+    TimestampTz end_time = GetCurrentTimestamp();
+
+    local_stats.rows += total_rows;
+    local_stats.batches++;
+    local_stats.apply_us += end_time - start_time;
+    local_stats.last_apply_time = end_time;
+    double elapsed_ms = TimestampDifferenceMilliseconds(start_time, end_time);
+    double elapsed_sec = elapsed_ms / 1000.0;
+
+    if (elapsed_sec > 0)
+        elog(DEBUG1, "BGWorker throughput: %.2f rows/sec (total %d rows from %d transactions in %.3f ms)",
+             total_rows / elapsed_sec, total_rows, ntxns, elapsed_ms);
+}
+
+/*
+ * Take in all committed transactions at the head of the list and apply
+ * the pending buffer whenever it is due, or in any case with force.
+ */
+static void txn_process_all(bool force)
+{
+    txn_coalesce();
+    while (txn_pending && (force || txn_pending_due()))
+    {
+        txn_pending_flush();
+        txn_coalesce();
+    }
+
+    /* Held rows are let go on their own when nothing new comes for them */
+    if (holds_exist() && (force || holds_due()))
+    {
+        local_stats.rows += holds_apply(force || stat_flush_requested() ||
+                                        buffer_limit_reached());
+        if (apply_pool)
+            apply_pool_sync(progress_pending(flushed_lsn));
+        progress_write(flushed_lsn);
+        applied_advance(holds_floor(flushed_lsn));
+    }
+}
+
+/* ---------- STREAMED TRANSACTIONS ---------- */
+/*
+ * With row_to_column.streaming, pgoutput sends a large transaction while it
+ * is still in progress, in blocks between STREAM START and STREAM STOP.
+ * Those changes are spilled to a temporary file per transaction as they
+ * arrive, so the worker's memory stays flat whatever the transaction's
+ * size; STREAM COMMIT has them read back and applied, STREAM ABORT throws
+ * them away.  A subtransaction's changes come after those spilled before
+ * its first one, so aborting it cuts the file back to that point.
+ */
+typedef struct StreamSubxact
+{
+    TransactionId xid;
+    uint64 nchanges;                     /* spilled before its first change */
+    Size bytes;
+    int fileno;                          /* where its first change starts */
+    off_t offset;
+} StreamSubxact;
+
+typedef struct StreamTxn
+{
+    TransactionId xid;                   /* top-level transaction, hash key */
+    BufFile *file;                       /* length, LSN, message, back to back */
+    uint64 nchanges;
+    Size bytes;
+    List *subxacts;                      /* StreamSubxact *, in order of first change */
+    XLogRecPtr commit_lsn;               /* from STREAM COMMIT */
+    XLogRecPtr end_lsn;
+    TimestampTz commit_time;
+} StreamTxn;
+
+static HTAB *stream_txns = NULL;
+static MemoryContext stream_cxt = NULL;
+static StreamTxn *stream_current = NULL;   /* between STREAM START and STOP */
+static StreamTxn *stream_committed = NULL; /* STREAM COMMIT seen, to be applied */
+
+#define streams_open() (stream_txns && hash_get_num_entries(stream_txns) > 0)
+
+static void
+stream_txn_free(StreamTxn *st)
+{
+    BufFileClose(st->file);
+    list_free_deep(st->subxacts);
+    if (stream_current == st)
+        stream_current = NULL;
+    hash_search(stream_txns, &st->xid, HASH_REMOVE, NULL);
+}
+
+static void
+stream_start(TransactionId xid, bool first_segment)
+{
+    bool found;
+    StreamTxn *st;
+    MemoryContext oldcxt;
+
+    if (!stream_txns)
+    {
+        HASHCTL ctl;
+
+        stream_cxt = AllocSetContextCreate(TopMemoryContext,
+                                           "row_to_column streams",
+                                           ALLOCSET_SMALL_SIZES);
+        MemSet(&ctl, 0, sizeof(ctl));
+        ctl.keysize = sizeof(TransactionId);
+        ctl.entrysize = sizeof(StreamTxn);
+        ctl.hcxt = stream_cxt;
+        stream_txns = hash_create("row_to_column_streams", 16,
+                                  &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    }
+
+    st = hash_search(stream_txns, &xid, HASH_ENTER, &found);
+
+    /* The walsender starts over with transactions it streamed before */
+    if (found && first_segment)
+    {
+        BufFileClose(st->file);
+        list_free_deep(st->subxacts);
+        found = false;
+    }
+
+    if (!found)
+    {
+        if (!first_segment)
+        {
+            hash_search(stream_txns, &xid, HASH_REMOVE, NULL);
+            ereport(ERROR,
+                    (errmsg("row_to_column missed the start of streamed transaction %u", xid)));
+        }
+
+        oldcxt = MemoryContextSwitchTo(stream_cxt);
+        st->file = BufFileCreateTemp(true);
+        MemoryContextSwitchTo(oldcxt);
+        st->nchanges = 0;
+        st->bytes = 0;
+        st->subxacts = NIL;
+        st->commit_lsn = InvalidXLogRecPtr;
+        st->end_lsn = InvalidXLogRecPtr;
+        st->commit_time = 0;
+    }
+
+    stream_current = st;
+}
+
+/* Spill a change of (sub)transaction xid, without the xid it came with */
+static void
+stream_spill(StreamTxn *st, TransactionId xid, XLogRecPtr lsn, char tag,
+             const char *data, int len)
+{
+    int32 total = len + 1;
+
+    if (xid != st->xid &&
+        (st->subxacts == NIL ||
+         ((StreamSubxact *) llast(st->subxacts))->xid != xid))
+    {
+        ListCell *lc;
+        StreamSubxact *sub = NULL;
+
+        foreach (lc, st->subxacts)
+        {
+            if (((StreamSubxact *) lfirst(lc))->xid == xid)
+            {
+                sub = lfirst(lc);
+                break;
+            }
+        }
+
+        if (!sub)
+        {
+            MemoryContext oldcxt = MemoryContextSwitchTo(stream_cxt);
+
+            sub = palloc(sizeof(StreamSubxact));
+            sub->xid = xid;
+            sub->nchanges = st->nchanges;
+            sub->bytes = st->bytes;
+            BufFileTell(st->file, &sub->fileno, &sub->offset);
+            st->subxacts = lappend(st->subxacts, sub);
+            MemoryContextSwitchTo(oldcxt);
+        }
+    }
+
+    spill_write(st->file, &total, sizeof(total));
+    spill_write(st->file, &lsn, sizeof(lsn));
+    spill_write(st->file, &tag, 1);
+    spill_write(st->file, data, len);
+    st->nchanges++;
+    st->bytes += total;
+}
+
+static void
+stream_abort(TransactionId xid, TransactionId subxid)
+{
+    StreamTxn *st = stream_txns ? hash_search(stream_txns, &xid, HASH_FIND, NULL) : NULL;
+
+    if (!st)
+        return;
+
+    if (subxid == xid)
+    {
+        stream_txn_free(st);
+        return;
+    }
+
+    /* The changes spilled after it are of its own subtransactions */
+    for (int i = list_length(st->subxacts) - 1; i >= 0; i--)
+    {
+        StreamSubxact *sub = list_nth(st->subxacts, i);
+
+        if (sub->xid != subxid)
+            continue;
+
+        spill_seek(st->file, sub->fileno, sub->offset);
+        st->nchanges = sub->nchanges;
+        st->bytes = sub->bytes;
+        while (list_length(st->subxacts) > i)
+        {
+            pfree(llast(st->subxacts));
+            st->subxacts = list_delete_last(st->subxacts);
+        }
+        break;
+    }
+}
+
+/* ---------- PGOUTPUT DECODER ---------- */
+
+/* Step over one TupleData at the cursor */
+static void tupledata_skip(StringInfo msg)
+{
+    int ncols = pq_getmsgint(msg, 2);
+
+    for (int i = 0; i < ncols; i++)
+    {
+        char ck = pq_getmsgbyte(msg);
+        if (ck != 'n' && ck != 'u')
+            pq_getmsgbytes(msg, pq_getmsgint(msg, 4));
+    }
+}
+
+/*
+ * An UPDATE sends unchanged TOASTed values as 'u'.  The mirror needs the
+ * full row version, so take them from the old tuple when the publisher
+ * sent one (REPLICA IDENTITY FULL); without it batch_fill_unchanged()
+ * takes them from the row's previous version when the batch is applied.
+ */
+static bool tupledata_has_unchanged(const char *tup, int len)
+{
+    StringInfoData t;
+    int ncols;
+
+    t.data = (char *) tup;
+    t.len = t.maxlen = len;
+    t.cursor = 0;
+
+    ncols = pq_getmsgint(&t, 2);
+    for (int i = 0; i < ncols; i++)
+    {
+        char ck = pq_getmsgbyte(&t);
+        if (ck == 'u')
+            return true;
+        if (ck != 'n')
+            pq_getmsgbytes(&t, pq_getmsgint(&t, 4));
+    }
+    return false;
+}
+
+static void tupledata_merge(StringInfo out, const char *newtup, int newlen,
+                            const char *oldtup, int oldlen)
+{
+    StringInfoData n, o;
+    int ncols, oldcols;
+
+    n.data = (char *) newtup;
+    n.len = n.maxlen = newlen;
+    n.cursor = 0;
+    o.data = (char *) oldtup;
+    o.len = o.maxlen = oldlen;
+    o.cursor = 0;
+
+    ncols = pq_getmsgint(&n, 2);
+    oldcols = pq_getmsgint(&o, 2);
+    pq_sendint16(out, ncols);
+
+    for (int i = 0; i < ncols; i++)
+    {
+        int nstart = n.cursor, ostart = o.cursor;
+        char nk = pq_getmsgbyte(&n);
+        char ok = 'u';
+
+        if (nk != 'n' && nk != 'u')
+            pq_getmsgbytes(&n, pq_getmsgint(&n, 4));
+        if (i < oldcols)
+        {
+            ok = pq_getmsgbyte(&o);
+            if (ok != 'n' && ok != 'u')
+                pq_getmsgbytes(&o, pq_getmsgint(&o, 4));
+        }
+
+        if (nk == 'u' && ok != 'u')
+            appendBinaryStringInfo(out, o.data + ostart, o.cursor - ostart);
+        else
+            appendBinaryStringInfo(out, n.data + nstart, n.cursor - nstart);
+    }
+}
+
+/*
+ * A known relation with a mirror; ddl_queue, htap_sync and htap_rollups
+ * rows are not data
+ */
+#define is_mirrored(r) ((r) && strcmp((r)->relname, "ddl_queue") != 0 && \
+                        strcmp((r)->relname, "htap_sync") != 0 && \
+                        strcmp((r)->relname, "htap_rollups") != 0)
+
+/* The leading (relid, lsn) columns of the row at the cursor */
+static Oid rel_lsn_decode(StringInfo msg, XLogRecPtr *lsnp)
+{
+    int ncols = pq_getmsgint(msg, 2);
+    Oid relid = InvalidOid;
+    XLogRecPtr lsn = InvalidXLogRecPtr;
+
+    for (int i = 0; i < ncols; i++)
+    {
+        char ck = pq_getmsgbyte(msg);
+        StringInfoData val;
+
+        if (ck == 'n' || ck == 'u')
+            continue;
+        val.len = val.maxlen = pq_getmsgint(msg, 4);
+        val.data = (char *) pq_getmsgbytes(msg, val.len);
+        val.cursor = 0;
+
+        if (ck == 'b')
+        {
+            if (i == 0)
+                relid = pq_getmsgint(&val, 4);
+            else if (i == 1)
+                lsn = pq_getmsgint64(&val);
+        }
+        else if (i <= 1)
+        {
+            char *str = pnstrdup(val.data, val.len);
+
+            if (i == 0)
+                relid = atooid(str);
+            else
+                lsn = DatumGetLSN(DirectFunctionCall1(pg_lsn_in, CStringGetDatum(str)));
+            pfree(str);
+        }
+    }
+
+    *lsnp = lsn;
+    return relid;
+}
+
+/* Keep sync_states in step with an htap_sync (relid, lsn) row at the cursor */
+static void sync_decode(StringInfo msg, bool remove)
+{
+    XLogRecPtr lsn;
+    Oid relid = rel_lsn_decode(msg, &lsn);
+    RelLsn *ss;
+
+    if (!OidIsValid(relid))
+        return;
+
+    if (remove)
+    {
+        hash_search(sync_states, &relid, HASH_REMOVE, NULL);
+        return;
+    }
+
+    ss = hash_search(sync_states, &relid, HASH_ENTER, NULL);
+    ss->lsn = lsn;
+    if (XLogRecPtrIsInvalid(lsn))
+        elog(LOG, "row_to_column: relation %u is being copied", relid);
+    else
+        elog(LOG, "row_to_column: relation %u copied up to %X/%X",
+             relid, LSN_FORMAT_ARGS(lsn));
+}
+
+/* Whether txn's changes to relid were applied before a restart */
+static bool relation_progressed(TxnBuf *txn, Oid relid)
+{
+    RelLsn *rl;
+
+    return hash_get_num_entries(rel_progress) > 0 &&
+           (rl = hash_search(rel_progress, &relid, HASH_FIND, NULL)) != NULL &&
+           txn->final_lsn < rl->lsn;
+}
+
+/*
+ * Whether txn's changes to relid are in its mirror already: covered by an
+ * initial copy, or applied before a restart
+ */
+static bool relation_skip(TxnBuf *txn, Oid relid)
+{
+    RelLsn *rl;
+
+    if (hash_get_num_entries(sync_states) > 0 &&
+        (rl = hash_search(sync_states, &relid, HASH_FIND, NULL)) != NULL &&
+        (XLogRecPtrIsInvalid(rl->lsn) || txn->final_lsn < rl->lsn))
+        return true;
+
+    return relation_progressed(txn, relid);
+}
+
+/* In a transaction the mirrors have from before a restart */
+static bool decode_skipping = false;
+
+/* lsn is the WAL position of the change, stamped on the rows it produces */
+static void decode_pgoutput(XLogRecPtr lsn, char *data, int len)
+{
+    if (!data)
+        return;
+
+    StringInfoData msg;
+    msg.data = data;
+    msg.len = len;
+    msg.maxlen = msg.len;
+    msg.cursor = 0;
+
+    if (msg.len <= 0)
+        return;
+
+    char tag = pq_getmsgbyte(&msg);
+
+    /* Within a stream block, changes come with their xid and are spilled */
+    if (stream_current && strchr("RYIUDT", tag))
+    {
+        TransactionId xid = pq_getmsgint(&msg, 4);
+
+        stream_spill(stream_current, xid, lsn, tag,
+                     msg.data + msg.cursor, msg.len - msg.cursor);
+        return;
+    }
+
+    if (decode_skipping && strchr("IUDT", tag))
+        return;
+
+    switch (tag)
+    {
+    case 'B': // BEGIN
+    {
+        XLogRecPtr final_lsn = pq_getmsgint64(&msg);
+        TxnBuf *new_txn;
+
+        // Poll mode peeks from the slot's confirmed_flush, which may trail
+        // what the replication origin says was applied
+        if (final_lsn < origin_start_lsn)
+        {
+            decode_skipping = true;
+            break;
+        }
+
+        new_txn = txn_create();
+        new_txn->final_lsn = final_lsn;
+        txn_push(new_txn);
+        break;
+    }
+
+    case 'C': // COMMIT
+    {
+        if (decode_skipping)
+        {
+            decode_skipping = false;
+            break;
+        }
+
+        // Mark the txn ready; committed txns are applied after the batch
+        // (poll) or as soon as the received data is drained (stream)
+        pq_getmsgbyte(&msg);    // flags
+        pq_getmsgint64(&msg);   // commit lsn
+        XLogRecPtr end_lsn = pq_getmsgint64(&msg);
+        TimestampTz commit_time = pq_getmsgint64(&msg);
+
+        if (txn_tail)
+        {
+            txn_tail->committed = true;
+            txn_tail->end_lsn = end_lsn;
+            txn_tail->commit_time = commit_time;
+        }
+        break;
+    }
+
+    case 'R': // RELATION
+    {
+        bool found;
+        RelInfo *r;
+        Oid relid = pq_getmsgint(&msg, 4);
+        pq_getmsgstring(&msg); // schema
+        r = hash_search(relmap, &relid, HASH_ENTER, &found);
+        if (found)
+        {
+            for (int i = 0; i < r->ncols; i++)
+                pfree(r->colnames[i]);
+            pfree(r->colnames);
+            pfree(r->coltypes);
+        }
+        r->relid = relid;
+        r->generation = found ? r->generation + 1 : 0;
+        r->stripe_rows = -1;
+        target_info_invalidate(relid);
+        strlcpy(r->relname, pq_getmsgstring(&msg), NAMEDATALEN);
+
+        pq_getmsgbyte(&msg); // replica identity
+        r->ncols = pq_getmsgint(&msg, 2);
+        r->colnames = MemoryContextAlloc(relmap_cxt, (r->ncols + 1) * sizeof(char *));
+        r->coltypes = MemoryContextAlloc(relmap_cxt, (r->ncols + 1) * sizeof(Oid));
+
+        for (int i = 0; i < r->ncols; i++)
+        {
+            pq_getmsgbyte(&msg); // flags
+            r->colnames[i] = MemoryContextStrdup(relmap_cxt, pq_getmsgstring(&msg));
+            r->coltypes[i] = pq_getmsgint(&msg, 4);
+            pq_getmsgint(&msg, 4); // typmod
+        }
+
+        elog(LOG, "RELATION: %s (%d cols)", r->relname, r->ncols);
+        break;
+    }
+
+    case 'I': // INSERT
+    {
+        TxnBuf *current_txn = txn_current();
+        Oid relid = pq_getmsgint(&msg, 4);
+        pq_getmsgbyte(&msg); // N for new row
+        int tuple_start = msg.cursor;
+
+        RelInfo *r = hash_search(relmap, &relid, HASH_FIND, NULL);
+        if (!r)
+            return;
+
+        if (strcmp(r->relname, "ddl_queue") == 0)
+        {
+            int ncols = pq_getmsgint(&msg, 2);
+            const char *sql = NULL;
+            int sql_len = 0;
+            char kind = BATCH_DDL;
+            Oid ddl_relid = InvalidOid;
+
+            for (int i = 0; i < ncols; i++)
+            {
+                char ck = pq_getmsgbyte(&msg);
+                if (ck == 'n' || ck == 'u')
+                    continue;
+                int len = pq_getmsgint(&msg, 4);
+                const char *val = pq_getmsgbytes(&msg, len);
+                if (i == 1) // second column = DDL SQL
+                {
+                    sql = val;
+                    sql_len = len;
+                }
+                else if (i == 2) // ddl_type, text in either format
+                {
+                    if (len == 10 && memcmp(val, "ALTER TYPE", 10) == 0)
+                        kind = BATCH_RETYPE;
+                }
+                else if (i == 4) // relid of the mirrored table
+                {
+                    if (ck == 'b')
+                    {
+                        StringInfoData v = {(char *) val, len, len, 0};
+
+                        ddl_relid = pq_getmsgint(&v, 4);
+                    }
+                    else
+                    {
+                        char *str = pnstrdup(val, len);
+
+                        ddl_relid = atooid(str);
+                        pfree(str);
+                    }
+                }
+            }
+
+            /* Its mirror had it before a restart, with the rows around it */
+            if (sql && !(OidIsValid(ddl_relid) && relation_progressed(current_txn, ddl_relid)))
+                txn_append_ddl(current_txn, ddl_relid, kind, sql, sql_len);
+            return;
+        }
+
+        if (strcmp(r->relname, "htap_sync") == 0)
+        {
+            sync_decode(&msg, false);
+            return;
+        }
+
+        if (strcmp(r->relname, "htap_rollups") == 0)
+        {
+            XLogRecPtr since;
+            Oid rollup_relid = rel_lsn_decode(&msg, &since);
+            bool found;
+            RelLsn *rl;
+
+            if (!OidIsValid(rollup_relid))
+                return;
+            rl = hash_search(rollup_relids, &rollup_relid, HASH_ENTER, &found);
+            if (!found)
+                rl->lsn = since;
+            return;
+        }
+
+        if (relation_skip(current_txn, relid))
+            return;
+
+        // Regular table INSERT: keep the tuple as-is, the apply engine
+        // converts it straight into a slot for the _col relation
+        txn_append_row(current_txn, txn_get_batch(current_txn, r, BATCH_INSERT),
+                       lsn, msg.data + tuple_start, msg.len - tuple_start);
+        if (hash_get_num_entries(rollup_relids) > 0 &&
+            hash_search(rollup_relids, &relid, HASH_FIND, NULL))
+            txn_append_row(current_txn, txn_get_batch(current_txn, r, BATCH_ROLLUP),
+                           lsn, msg.data + tuple_start, msg.len - tuple_start);
+        break;
+    }
+
+    case 'U': // UPDATE: retire the old identity, add the new version
+    {
+        TxnBuf *current_txn = txn_current();
+        Oid relid = pq_getmsgint(&msg, 4);
+        char kind = pq_getmsgbyte(&msg);
+        int old_start = -1, old_len = 0;
+
+        if (kind == 'K' || kind == 'O')
+        {
+            old_start = msg.cursor;
+            tupledata_skip(&msg);
+            old_len = msg.cursor - old_start;
+            pq_getmsgbyte(&msg); // N
+        }
+        int new_start = msg.cursor;
+        int new_len = msg.len - new_start;
+
+        RelInfo *r = hash_search(relmap, &relid, HASH_FIND, NULL);
+        if (r && strcmp(r->relname, "htap_sync") == 0)
+        {
+            msg.cursor = new_start;
+            sync_decode(&msg, false);
+            return;
+        }
+        if (!is_mirrored(r) || relation_skip(current_txn, relid))
+            return;
+
+        // Without an old tuple the identity did not change, the new
+        // tuple carries it
+        if (old_start >= 0)
+            txn_append_row(current_txn, txn_get_batch(current_txn, r, BATCH_DELETE),
+                           lsn, msg.data + old_start, old_len);
+        else
+            txn_append_row(current_txn, txn_get_batch(current_txn, r, BATCH_DELETE),
+                           lsn, msg.data + new_start, new_len);
+
+        if (kind == 'O' &&
+            tupledata_has_unchanged(msg.data + new_start, new_len))
+        {
+            StringInfoData merged;
+
+            initStringInfo(&merged);
+            tupledata_merge(&merged, msg.data + new_start, new_len,
+                            msg.data + old_start, old_len);
+            txn_append_row(current_txn, txn_get_batch(current_txn, r, BATCH_INSERT),
+                           lsn, merged.data, merged.len);
+            pfree(merged.data);
+        }
+        else
+            txn_append_row(current_txn, txn_get_batch(current_txn, r, BATCH_INSERT),
+                           lsn, msg.data + new_start, new_len);
+        break;
+    }
+
+    case 'D': // DELETE: retire the identity
+    {
+        TxnBuf *current_txn = txn_current();
+        Oid relid = pq_getmsgint(&msg, 4);
+        pq_getmsgbyte(&msg); // K or O
+        int tuple_start = msg.cursor;
+
+        RelInfo *r = hash_search(relmap, &relid, HASH_FIND, NULL);
+        if (r && strcmp(r->relname, "htap_sync") == 0)
+        {
+            sync_decode(&msg, true);
+            return;
+        }
+        if (!is_mirrored(r) || relation_skip(current_txn, relid))
+            return;
+
+        txn_append_row(current_txn, txn_get_batch(current_txn, r, BATCH_DELETE),
+                       lsn, msg.data + tuple_start, msg.len - tuple_start);
+        break;
+    }
+
+    case 'T': // TRUNCATE: hide everything older than this change
+    {
+        TxnBuf *current_txn = txn_current();
+        int nrelids = pq_getmsgint(&msg, 4);
+        pq_getmsgbyte(&msg); // options (CASCADE, RESTART IDENTITY)
+
+        for (int i = 0; i < nrelids; i++)
+        {
+            Oid relid = pq_getmsgint(&msg, 4);
+            RelInfo *r = hash_search(relmap, &relid, HASH_FIND, NULL);
+            char *mirror;
+            char *sql;
+
+            if (!is_mirrored(r) || relation_skip(current_txn, relid))
+                continue;
+
+            // Rows already in the mirror stay until compacted, the live
+            // view filters them by the truncation watermark
+            mirror = psprintf("%s_col", r->relname);
+            sql = psprintf("INSERT INTO htap_truncations (mirror, lsn) "
+                           "SELECT m, '%X/%X' FROM to_regclass(%s) m WHERE m IS NOT NULL "
+                           "ON CONFLICT (mirror) DO UPDATE "
+                           "SET lsn = GREATEST(htap_truncations.lsn, EXCLUDED.lsn)",
+                           LSN_FORMAT_ARGS(lsn),
+                           quote_literal_cstr(quote_identifier(mirror)));
+            txn_append_ddl(current_txn, relid, BATCH_DDL, sql, strlen(sql));
+            pfree(sql);
+            pfree(mirror);
+        }
+        break;
+    }
+
+    case 'Y': // TYPE: values are converted with the local type's functions
+        break;
+
+    case 'S': // STREAM START: changes of an in-progress transaction follow
+    {
+        TransactionId xid = pq_getmsgint(&msg, 4);
+
+        stream_start(xid, pq_getmsgbyte(&msg) == 1);
+        break;
+    }
+
+    case 'E': // STREAM STOP
+        stream_current = NULL;
+        break;
+
+    case 'c': // STREAM COMMIT: the caller applies the spilled changes
+    {
+        TransactionId xid = pq_getmsgint(&msg, 4);
+        StreamTxn *st = stream_txns ? hash_search(stream_txns, &xid, HASH_FIND, NULL) : NULL;
+
+        pq_getmsgbyte(&msg); // flags
+        if (!st)
+        {
+            elog(LOG, "STREAM COMMIT of unknown transaction %u", xid);
+            stat_count_error();
+            break;
+        }
+        st->commit_lsn = pq_getmsgint64(&msg);
+        st->end_lsn = pq_getmsgint64(&msg);
+        st->commit_time = pq_getmsgint64(&msg);
+        stream_committed = st;
+        break;
+    }
+
+    case 'A': // STREAM ABORT: of the transaction, or one of its subtransactions
+    {
+        TransactionId xid = pq_getmsgint(&msg, 4);
+
+        stream_abort(xid, pq_getmsgint(&msg, 4));
+        break;
+    }
+
+    default:
+        elog(LOG, "Unknown WAL tag: %c", tag);
+        break;
+    }
+}
+
+/* ---------- POLL MODE ---------- */
+#define POLL_FETCH_ROWS 1000 /* change rows pulled from the cursor at a time */
+
+/*
+ * Changes are peeked, not consumed: the transaction applying them records
+ * how far it got in the worker's replication origin, and only after it has
+ * committed is the slot advanced to there, once per cycle.  A cycle that
+ * fails or a crash before the advance leaves the changes on the slot, and
+ * the next cycle skips the transactions the origin says are applied.
+ */
+static XLogRecPtr poll_slot_lsn = InvalidXLogRecPtr;
+
+static void
+poll_slot_advance(void)
+{
+    Oid argtypes[2] = {TEXTOID, PG_LSNOID};
+    Datum args[2];
+
+    if (applied_lsn <= poll_slot_lsn)
+        return;
+
+    StartTransactionCommand();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    SPI_connect();
+
+    args[0] = CStringGetTextDatum(worker_conf.slot_name);
+    args[1] = LSNGetDatum(applied_lsn);
+    /* The slot cannot be moved back, which it would be after a restart */
+    SPI_execute_with_args("SELECT pg_replication_slot_advance(slot_name, $2) "
+                          "FROM pg_replication_slots "
+                          "WHERE slot_name = $1 AND confirmed_flush_lsn < $2",
+                          2, argtypes, args, NULL, false, 0);
+
+    SPI_finish();
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+
+    poll_slot_lsn = applied_lsn;
+}
+
+/*
+ * Partitioned mirrors need their next partitions before rows arrive for
+ * them.  Every PARTITION_MAINTAIN_MS the worker runs
+ * htap_partition_maintain() in a transaction of its own between applies.
+ */
+#define PARTITION_MAINTAIN_MS 60000L
+
+static TimestampTz partition_maintained = 0;
+
+static void
+partition_maintain_step(void)
+{
+    MemoryContext oldcxt = CurrentMemoryContext;
+
+    if (!TimestampDifferenceExceeds(partition_maintained, GetCurrentTimestamp(),
+                                    PARTITION_MAINTAIN_MS))
+        return;
+    partition_maintained = GetCurrentTimestamp();
+
+    StartTransactionCommand();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    SPI_connect();
+
+    /* It logs its own failures rather than raising them */
+    SPI_execute("SELECT htap_partition_maintain()", false, 0);
+
+    SPI_finish();
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+
+    MemoryContextSwitchTo(oldcxt);
+}
+
+/*
+ * Each cycle takes at most row_to_column.max_changes_per_cycle changes from
+ * the slot and reads them through a cursor in POLL_FETCH_ROWS chunks, so
+ * the result set is never materialized in SPI memory all at once.  Decoded
+ * buffers are applied as soon as they reach max_bytes_per_cycle rather than
+ * at the end of the cycle, which keeps the worker's memory flat no matter
+ * how large the backlog on the slot is.  What decoding allocates besides
+ * the buffers lives in decode_cxt and is reset after every chunk.
+ */
+static void row_to_column_poll(void)
+{
+    MemoryContext decode_cxt = AllocSetContextCreate(TopMemoryContext,
+                                                     "row_to_column decode",
+                                                     ALLOCSET_DEFAULT_SIZES);
+
+    while (!got_sigterm)
+    {
+        Portal portal;
+        Oid argtypes[5] = {INT4OID, TEXTOID, TEXTOID, TEXTOID, TEXTOID};
+        Datum args[5];
+        uint64 nchanges = 0;
+        TimestampTz start;
+        XLogRecPtr horizon;
+        MemoryContext oldcxt;
+
+        if (ConfigReloadPending)
+        {
+            ConfigReloadPending = false;
+            ProcessConfigFile(PGC_SIGHUP);
+        }
+
+        StartTransactionCommand();
+        PushActiveSnapshot(GetTransactionSnapshot());
+        SPI_connect();
+
+        if (r2c_fresh_reads)
+            fresh_capture(GetActiveSnapshot());
+
+        // Every transaction committed before this is decoded by the call
+        // below, unless the change limit cuts it short
+        horizon = GetFlushRecPtr(NULL);
+
+        args[0] = Int32GetDatum(r2c_max_changes_per_cycle);
+        args[1] = CStringGetTextDatum(psprintf("%d", r2c_requested_proto_version()));
+        args[2] = CStringGetTextDatum(r2c_binary ? "true" : "false");
+        args[3] = CStringGetTextDatum(worker_conf.slot_name);
+        args[4] = CStringGetTextDatum(quote_identifier(worker_conf.publication));
+
+        portal = SPI_cursor_open_with_args(
+            NULL,
+            "SELECT lsn, data FROM pg_logical_slot_peek_binary_changes("
+            "$4, NULL, $1, "
+            "'proto_version', $2, "
+            "'binary', $3, "
+            "'publication_names', $5)",
+            5, argtypes, args,
+            r2c_max_changes_per_cycle > 0 ? "     " : "n    ",
+            true, 0);
+
+        for (;;)
+        {
+            uint64 nbytes = 0;
+
+            R2C_PROBE0(fetch__start);
+            pgstat_report_wait_start(htap_wait_event(HTAP_WAIT_FETCH));
+            start = GetCurrentTimestamp();
+            SPI_cursor_fetch(portal, true, POLL_FETCH_ROWS);
+            local_stats.fetch_us += stat_elapsed_us(start);
+            pgstat_report_wait_end();
+            R2C_PROBE1(fetch__done, SPI_processed);
+            if (SPI_processed == 0)
+                break;
+            nchanges += SPI_processed;
+
+            // Decode this chunk of WAL messages → build transaction buffers
+            start = GetCurrentTimestamp();
+            oldcxt = MemoryContextSwitchTo(decode_cxt);
+            for (uint64 i = 0; i < SPI_processed; i++)
+            {
+                bool isnull;
+                XLogRecPtr lsn = DatumGetLSN(SPI_getbinval(
+                    SPI_tuptable->vals[i],
+                    SPI_tuptable->tupdesc,
+                    1, &isnull));
+                Datum d = SPI_getbinval(
+                    SPI_tuptable->vals[i],
+                    SPI_tuptable->tupdesc,
+                    2, &isnull);
+                if (!isnull)
+                {
+                    bytea *data = DatumGetByteaP(d);
+                    decode_pgoutput(lsn, VARDATA_ANY(data), VARSIZE_ANY_EXHDR(data));
+                    nbytes += VARSIZE_ANY_EXHDR(data);
+                    buffer_spill();
+                }
+                if (lsn > local_stats.received_lsn)
+                    local_stats.received_lsn = lsn;
+            }
+            MemoryContextSwitchTo(oldcxt);
+            MemoryContextReset(decode_cxt);
+            R2C_PROBE2(decode__done, SPI_processed, nbytes);
+            SPI_freetuptable(SPI_tuptable);
+            local_stats.decode_us += stat_elapsed_us(start);
+
+            // Apply whatever has reached a flush threshold, including the
+            // memory cap
+            txn_process_all(false);
+        }
+        SPI_cursor_close(portal);
+
+        // The origin's progress is recorded when this transaction commits,
+        // so nothing may be left pending across cycles
+        txn_process_all(true);
+
+        SPI_finish();
+        PopActiveSnapshot();
+        stat_commit();
+
+        if (!txn_head &&
+            (r2c_max_changes_per_cycle == 0 ||
+             nchanges < (uint64) r2c_max_changes_per_cycle))
+            applied_advance(horizon);
+        poll_slot_advance();
+        partition_maintain_step();
+        if (r2c_fresh_reads)
+            fresh_publish();
+        stat_report();
+
+        // A cycle cut short by the change limit goes round again at once.
+        // An idle one sleeps, only briefly while a waiter is not satisfied
+        // yet: its WAL may just not have been flushed
+        if (nchanges == 0)
+        {
+            WaitLatch(MyLatch,
+                      WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+                      stat_flush_requested() ? 10L : 1000L,
+                      htap_wait_event(HTAP_WAIT_IDLE));
+            ResetLatch(MyLatch);
+        }
+    }
+}
+
+/* ---------- STREAM MODE ---------- */
+#define STREAM_NAPTIME_MS 1000L
+#define STREAM_REPLY_REQUEST_MS 100L /* keepalive requests for waiters */
+
+/*
+ * Report write/flush/apply positions to the walsender, which moves the
+ * slot's confirmed_flush forward.  Everything received is flushed once no
+ * transaction is left buffered or pending; otherwise only what was applied.
+ */
+static void
+stream_send_feedback(WalReceiverConn *conn, XLogRecPtr recvpos, bool force,
+                     bool requestReply)
+{
+    static StringInfo reply = NULL;
+    static XLogRecPtr last_recvpos = InvalidXLogRecPtr;
+    static XLogRecPtr last_flushpos = InvalidXLogRecPtr;
+    static TimestampTz send_time = 0;
+
+    TimestampTz now = GetCurrentTimestamp();
+    XLogRecPtr flushpos = (txn_head || txn_pending || streams_open() || holds_exist())
+                              ? applied_lsn : recvpos;
+
+    if (!force &&
+        recvpos == last_recvpos &&
+        flushpos == last_flushpos &&
+        !TimestampDifferenceExceeds(send_time, now,
+                                    wal_receiver_status_interval * 1000))
+        return;
+
+    if (!reply)
+    {
+        MemoryContext oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+        reply = makeStringInfo();
+        MemoryContextSwitchTo(oldcxt);
+    }
+    else
+        resetStringInfo(reply);
+
+    pq_sendbyte(reply, 'r');
+    pq_sendint64(reply, recvpos);  /* write */
+    pq_sendint64(reply, flushpos); /* flush */
+    pq_sendint64(reply, flushpos); /* apply */
+    pq_sendint64(reply, now);      /* sendTime */
+    pq_sendbyte(reply, requestReply);
+
+    walrcv_send(conn, reply->data, reply->len);
+
+    last_recvpos = recvpos;
+    last_flushpos = flushpos;
+    send_time = now;
+}
+
+/*
+ * Merge the committed transactions received so far into the pending buffer,
+ * and apply it if it is due.  Merging needs no transaction, so one is only
+ * started when there is something to write.
+ */
+static void
+stream_apply_committed(MemoryContext decode_cxt)
+{
+    txn_coalesce();
+    if (!txn_pending_due() && !holds_due())
+        return;
+
+    StartTransactionCommand();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    SPI_connect();
+
+    txn_process_all(false);
+
+    SPI_finish();
+    PopActiveSnapshot();
+    stat_commit();
+    stat_report();
+
+    MemoryContextSwitchTo(decode_cxt);
+}
+
+/* Publish the applied snapshot once caught up with it, then take the next */
+static void
+stream_fresh_step(MemoryContext decode_cxt)
+{
+    fresh_publish();
+    if (!XLogRecPtrIsInvalid(fresh_candidate_lsn))
+        return;
+
+    StartTransactionCommand();
+    fresh_capture(GetTransactionSnapshot());
+    CommitTransactionCommand();
+
+    MemoryContextSwitchTo(decode_cxt);
+}
+
+/*
+ * Apply the transaction of a STREAM COMMIT, in one local transaction with
+ * everything committed before it.  Its changes are decoded back from the
+ * spill file flush_bytes at a time, each part written out before the next
+ * is read, so the transaction is never held in memory as a whole.
+ */
+static void
+stream_replay(MemoryContext decode_cxt)
+{
+    StreamTxn *st = stream_committed;
+    TxnBuf *txn;
+
+    stream_committed = NULL;
+
+    StartTransactionCommand();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    SPI_connect();
+
+    txn_process_all(true);
+
+    spill_seek(st->file, 0, 0);
+    txn = txn_create();
+    txn->final_lsn = st->commit_lsn;
+    txn_push(txn);
+
+    for (uint64 i = 0; i < st->nchanges; i++)
+    {
+        MemoryContext oldcxt = MemoryContextSwitchTo(decode_cxt);
+        int32 len;
+        XLogRecPtr lsn;
+        char *data;
+
+        spill_read(st->file, &len, sizeof(len));
+        spill_read(st->file, &lsn, sizeof(lsn));
+        data = palloc(len);
+        spill_read(st->file, data, len);
+        decode_pgoutput(lsn, data, len);
+        MemoryContextSwitchTo(oldcxt);
+        MemoryContextReset(decode_cxt);
+
+        /* Nothing else is buffered: txn_process_all() took it all above */
+        if (txn->bytes >= (Size) r2c_flush_bytes * 1024 || buffer_limit_reached())
+        {
+            txn_head = txn_tail = NULL;
+            buffered_bytes -= txn_memory(txn);
+            local_stats.bytes += txn->bytes;
+            local_stats.rows += txn_process_buffer(txn, true);
+
+            txn = txn_create();
+            txn->final_lsn = st->commit_lsn;
+            txn_push(txn);
+        }
+    }
+
+    txn->committed = true;
+    txn->end_lsn = st->end_lsn;
+    txn->commit_time = st->commit_time;
+    txn_process_all(true);
+
+    elog(LOG, "row_to_column applied streamed transaction %u (" UINT64_FORMAT " changes)",
+         st->xid, st->nchanges);
+    stream_txn_free(st);
+
+    SPI_finish();
+    PopActiveSnapshot();
+    stat_commit();
+    stat_report();
+
+    MemoryContextSwitchTo(decode_cxt);
+}
+
+static int
+stream_receive(WalReceiverConn *conn, char **buf, pgsocket *fd)
+{
+    TimestampTz start = GetCurrentTimestamp();
+    int len;
+
+    R2C_PROBE0(fetch__start);
+    pgstat_report_wait_start(htap_wait_event(HTAP_WAIT_FETCH));
+    len = walrcv_receive(conn, buf, fd);
+    pgstat_report_wait_end();
+    local_stats.fetch_us += stat_elapsed_us(start);
+    R2C_PROBE1(fetch__done, len > 0 ? 1 : 0);
+    return len;
+}
+
+/* row_to_column.conninfo for this worker's database; a later dbname wins */
+static char *
+stream_conninfo(void)
+{
+    StringInfoData buf;
+
+    initStringInfo(&buf);
+    appendStringInfo(&buf, "%s dbname='", r2c_conninfo);
+    for (const char *c = worker_conf.database; *c; c++)
+    {
+        if (*c == '\'' || *c == '\\')
+            appendStringInfoChar(&buf, '\\');
+        appendStringInfoChar(&buf, *c);
+    }
+    appendStringInfoChar(&buf, '\'');
+
+    return buf.data;
+}
+
+/*
+ * Receive changes from the walsender like a logical apply worker does,
+ * applying each transaction as soon as its COMMIT has arrived instead of
+ * waiting for the next poll.
+ */
+static void row_to_column_stream(void)
+{
+    WalReceiverConn *conn;
+    WalRcvStreamOptions options;
+    MemoryContext decode_cxt;
+    XLogRecPtr last_received = InvalidXLogRecPtr;
+    TimestampTz last_reply_request = 0;
+    char *err = NULL;
+    char *conninfo = stream_conninfo();
+    pgsocket fd = PGINVALID_SOCKET;
+
+    load_file("libpqwalreceiver", false);
+
+#if PG_VERSION_NUM >= 170000
+    conn = walrcv_connect(conninfo, true, true, false,
+                          "row_to_column", &err);
+#elif PG_VERSION_NUM >= 160000
+    conn = walrcv_connect(conninfo, true, false, "row_to_column", &err);
+#else
+    conn = walrcv_connect(conninfo, true, "row_to_column", &err);
+#endif
+    if (conn == NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_CONNECTION_FAILURE),
+                 errmsg("row_to_column could not connect to the walsender: %s", err)));
+
+    /*
+     * Start after what the origin says was applied, or from the slot's
+     * confirmed_flush position if that is further on
+     */
+    MemSet(&options, 0, sizeof(options));
+    options.logical = true;
+    options.startpoint = origin_start_lsn;
+    options.slotname = worker_conf.slot_name;
+    options.proto.logical.proto_version = r2c_requested_proto_version();
+    options.proto.logical.binary = r2c_binary;
+#if PG_VERSION_NUM >= 160000
+    options.proto.logical.streaming_str = r2c_streaming ? "on" : NULL;
+#else
+    options.proto.logical.streaming = r2c_streaming;
+#endif
+    options.proto.logical.publication_names =
+        list_make1(makeString(worker_conf.publication));
+
+    if (!walrcv_startstreaming(conn, &options))
+        ereport(ERROR,
+                (errmsg("row_to_column could not start streaming from slot \"%s\"",
+                        worker_conf.slot_name)));
+
+    elog(LOG, "row_to_column streaming from slot \"%s\"", worker_conf.slot_name);
+
+    /* Scratch space of the decoder, reset after each message */
+    decode_cxt = AllocSetContextCreate(TopMemoryContext,
+                                       "row_to_column decode",
+                                       ALLOCSET_DEFAULT_SIZES);
+    MemoryContextSwitchTo(decode_cxt);
+
+    while (!got_sigterm)
+    {
+        bool endofstream = false;
+        char *buf;
+        int len;
+        int rc;
+        long timeout;
+        TimestampTz start;
+
+        if (ConfigReloadPending)
+        {
+            ConfigReloadPending = false;
+            ProcessConfigFile(PGC_SIGHUP);
+        }
+
+        for (len = stream_receive(conn, &buf, &fd); len != 0;
+             len = stream_receive(conn, &buf, &fd))
+        {
+            StringInfoData s;
+            char c;
+
+            if (len < 0)
+            {
+                ereport(LOG, (errmsg("row_to_column data stream from publisher has ended")));
+                endofstream = true;
+                break;
+            }
+
+            s.data = buf;
+            s.len = len;
+            s.cursor = 0;
+            s.maxlen = -1;
+
+            c = pq_getmsgbyte(&s);
+            if (c == 'w')
+            {
+                XLogRecPtr start_lsn = pq_getmsgint64(&s);
+                XLogRecPtr end_lsn = pq_getmsgint64(&s);
+
+                pq_getmsgint64(&s); /* sendTime */
+
+                if (last_received < start_lsn)
+                    last_received = start_lsn;
+                if (last_received < end_lsn)
+                    last_received = end_lsn;
+
+                start = GetCurrentTimestamp();
+                decode_pgoutput(start_lsn, s.data + s.cursor, s.len - s.cursor);
+                buffer_spill();
+                MemoryContextReset(decode_cxt);
+                local_stats.decode_us += stat_elapsed_us(start);
+                R2C_PROBE2(decode__done, 1, s.len - s.cursor);
+
+                if (stream_committed)
+                    stream_replay(decode_cxt);
+
+                /* Don't let a long burst pile up before it is applied */
+                if (buffer_limit_reached())
+                    stream_apply_committed(decode_cxt);
+            }
+            else if (c == 'k')
+            {
+                XLogRecPtr end_lsn = pq_getmsgint64(&s);
+                bool reply_requested;
+
+                pq_getmsgint64(&s); /* sendTime */
+                reply_requested = pq_getmsgbyte(&s);
+
+                if (last_received < end_lsn)
+                    last_received = end_lsn;
+
+                stream_apply_committed(decode_cxt);
+                stream_send_feedback(conn, last_received, reply_requested, false);
+            }
+        }
+
+        /* Received data drained: apply and confirm what is complete */
+        stream_apply_committed(decode_cxt);
+        if (!txn_head && !txn_pending && !streams_open() && !holds_exist())
+            applied_advance(last_received);
+        stream_send_feedback(conn, last_received, false, false);
+        local_stats.received_lsn = last_received;
+        if (r2c_fresh_reads)
+            stream_fresh_step(decode_cxt);
+        partition_maintain_step();
+        stat_report();
+
+        /*
+         * A waiter wants a position beyond what has been received.  The
+         * walsender moves past WAL it does not publish without telling us,
+         * so ask it for a keepalive carrying its current position.
+         */
+        if (stat_flush_requested() &&
+            TimestampDifferenceExceeds(last_reply_request, GetCurrentTimestamp(),
+                                       STREAM_REPLY_REQUEST_MS))
+        {
+            stream_send_feedback(conn, last_received, true, true);
+            last_reply_request = GetCurrentTimestamp();
+        }
+
+        if (endofstream)
+            break;
+
+        /* Wake up in time to flush the pending buffer on its deadline */
+        timeout = stat_flush_requested() ? STREAM_REPLY_REQUEST_MS : STREAM_NAPTIME_MS;
+        if (txn_pending)
+        {
+            long age = TimestampDifferenceMilliseconds(txn_pending->first_change,
+                                                       GetCurrentTimestamp());
+            timeout = Max(Min(timeout, r2c_flush_interval_ms - age), 0);
+        }
+        if (holds_exist())
+        {
+            long age = TimestampDifferenceMilliseconds(holds_oldest(),
+                                                       GetCurrentTimestamp());
+            timeout = Max(Min(timeout, r2c_max_hold_ms - age), 0);
+        }
+
+        rc = WaitLatchOrSocket(MyLatch,
+                               WL_SOCKET_READABLE | WL_LATCH_SET |
+                               WL_TIMEOUT | WL_POSTMASTER_DEATH,
+                               fd, timeout, htap_wait_event(HTAP_WAIT_IDLE));
+
+        if (rc & WL_POSTMASTER_DEATH)
+            proc_exit(1);
+        if (rc & WL_LATCH_SET)
+            ResetLatch(MyLatch);
+    }
+
+    walrcv_disconnect(conn);
+}
+
+/* ---------- BGWORKER MAIN ---------- */
+/* Read the (relid, lsn) rows of table, if it exists, into hash */
+static void
+rel_lsns_load(HTAB *hash, const char *table)
+{
+    char *sql = psprintf("SELECT 1 WHERE to_regclass('%s') IS NOT NULL", table);
+
+    if (SPI_execute(sql, true, 0) == SPI_OK_SELECT && SPI_processed > 0 &&
+        SPI_execute(psprintf("SELECT relid, lsn FROM %s", table), true, 0) == SPI_OK_SELECT)
+    {
+        for (uint64 i = 0; i < SPI_processed; i++)
+        {
+            HeapTuple tup = SPI_tuptable->vals[i];
+            TupleDesc desc = SPI_tuptable->tupdesc;
+            bool isnull;
+            Oid relid = DatumGetObjectId(SPI_getbinval(tup, desc, 1, &isnull));
+            Datum lsn = SPI_getbinval(tup, desc, 2, &isnull);
+            RelLsn *rl = hash_search(hash, &relid, HASH_ENTER, NULL);
+
+            rl->lsn = isnull ? InvalidXLogRecPtr : DatumGetLSN(lsn);
+        }
+    }
+}
+
+/* Relations whose rows wait for a retype, see DDL BARRIERS */
+static void
+retypes_load(void)
+{
+    MemoryContext oldcxt;
+
+    if (SPI_execute("SELECT relid FROM htap_retypes", true, 0) != SPI_OK_SELECT)
+        return;
+
+    oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+    for (uint64 i = 0; i < SPI_processed; i++)
+    {
+        bool isnull;
+        Oid relid = DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[i],
+                                                   SPI_tuptable->tupdesc, 1, &isnull));
+
+        if (!retype_pending(relid))
+            retype_relids = lappend_oid(retype_relids, relid);
+    }
+    MemoryContextSwitchTo(oldcxt);
+}
+
+/* Relations with a codec already, see CODEC SAMPLING */
+static void
+codecs_load(void)
+{
+    if (SPI_execute("SELECT relid FROM htap_codecs", true, 0) != SPI_OK_SELECT)
+        return;
+
+    for (uint64 i = 0; i < SPI_processed; i++)
+    {
+        bool isnull;
+        Oid relid = DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[i],
+                                                   SPI_tuptable->tupdesc, 1, &isnull));
+
+        codec_sample_get(relid)->done = true;
+    }
+}
+
+/*
+ * Pick up conversions still in progress, how far each relation got, which
+ * have rollups, which wait for a retype and which have a codec; the decoder
+ * follows them from here
+ */
+static void
+relation_skips_load(void)
+{
+    StartTransactionCommand();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    SPI_connect();
+
+    rel_lsns_load(sync_states, "htap_sync");
+    rel_lsns_load(rel_progress, "htap_progress");
+    rel_lsns_load(rollup_relids, "htap_rollups");
+    retypes_load();
+    codecs_load();
+
+    SPI_finish();
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+}
+
+/*
+ * The worker's replication origin, R2C_ORIGIN_PREFIX and its slot's name,
+ * records with each commit that applied changes the applied position it
+ * reached; a restart goes on from there.
+ */
+#define R2C_ORIGIN_PREFIX "row_to_column_"
+
+static void
+origin_setup(void)
+{
+    char *name = psprintf(R2C_ORIGIN_PREFIX "%s", worker_conf.slot_name);
+    RepOriginId origin;
+
+    StartTransactionCommand();
+    origin = replorigin_by_name(name, true);
+    if (origin == InvalidRepOriginId)
+        origin = replorigin_create(name);
+    CommitTransactionCommand();
+
+#if PG_VERSION_NUM >= 160000
+    replorigin_session_setup(origin, 0);
+#else
+    replorigin_session_setup(origin);
+#endif
+    replorigin_session_origin = origin;
+    origin_active = true;
+
+    origin_start_lsn = replorigin_session_get_progress(false);
+    applied_lsn = origin_start_lsn;
+    local_stats.applied_lsn = applied_lsn;
+
+    elog(LOG, "row_to_column origin \"%s\" applied up to %X/%X",
+         name, LSN_FORMAT_ARGS(origin_start_lsn));
+}
+
+/* Let the launcher see this worker has gone */
+static void
+worker_shmem_exit(int code, Datum arg)
+{
+    SpinLockAcquire(&htap_stats->mutex);
+    htap_stats->pid = 0;
+    htap_stats->worker_latch = NULL;
+    SpinLockRelease(&htap_stats->mutex);
+}
+
+/* Started by the launcher for entry arg of row_to_column.workers */
+PGDLLEXPORT void row_to_column_main(Datum arg)
+{
+    am_htap_worker = true;
+    pqsignal(SIGTERM, handle_sigterm);
+    pqsignal(SIGHUP, SignalHandlerForConfigReload);
+    BackgroundWorkerUnblockSignals();
+
+    stat_attach(DatumGetInt32(arg));
+    SpinLockAcquire(&htap_stats->mutex);
+    worker_conf = htap_stats->conf;
+    htap_stats->pid = MyProcPid;
+    htap_stats->worker_latch = MyLatch;
+    SpinLockRelease(&htap_stats->mutex);
+    before_shmem_exit(worker_shmem_exit, 0);
+
+    BackgroundWorkerInitializeConnection(worker_conf.database, NULL, 0);
+
+    elog(LOG, "row_to_column BGWorker started for database \"%s\" (%s mode)",
+         worker_conf.database, r2c_mode == R2C_MODE_STREAM ? "stream" : "poll");
+
+    fresh_init();
+    origin_setup();
+    relation_skips_load();
+
+    if (r2c_apply_workers > 0)
+        apply_pool_start(r2c_apply_workers);
+
+    if (r2c_mode == R2C_MODE_STREAM)
+        row_to_column_stream();
+    else
+        row_to_column_poll();
+
+    elog(LOG, "row_to_column BGWorker exiting");
+    proc_exit(0);
+}
+
+/* ---------- APPLY WORKER MAIN ---------- */
+static void
+apply_worker_begin(void)
+{
+    if (IsTransactionState())
+        return;
+
+    StartTransactionCommand();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    SPI_connect();
+}
+
+static void
+apply_worker_commit(void)
+{
+    if (!IsTransactionState())
+        return;
+
+    SPI_finish();
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+}
+
+PGDLLEXPORT void row_to_column_apply_main(Datum arg)
+{
+    dsm_segment *seg;
+    shm_toc *toc;
+    ApplyShared *shared;
+    shm_mq *mq;
+    shm_mq_handle *mqh;
+    int worker;
+
+    memcpy(&worker, MyBgworkerEntry->bgw_extra, sizeof(int));
+    am_htap_worker = true;
+
+    pqsignal(SIGTERM, die);
+    BackgroundWorkerUnblockSignals();
+
+    seg = dsm_attach(DatumGetUInt32(arg));
+    if (seg == NULL)
+        ereport(ERROR,
+                (errmsg("row_to_column apply worker %d could not map the leader's segment",
+                        worker)));
+
+    toc = shm_toc_attach(R2C_SHM_MAGIC, dsm_segment_address(seg));
+    if (toc == NULL)
+        ereport(ERROR,
+                (errmsg("row_to_column apply worker %d found a bad segment", worker)));
+
+    shared = shm_toc_lookup(toc, R2C_KEY_SHARED, false);
+    mq = shm_toc_lookup(toc, R2C_KEY_QUEUE(worker), false);
+    shm_mq_set_receiver(mq, MyProc);
+    mqh = shm_mq_attach(mq, seg, NULL);
+
+    stat_attach(shared->stats_index);
+    BackgroundWorkerInitializeConnectionByOid(shared->database_id, InvalidOid, 0);
+
+    for (;;)
+    {
+        Size len;
+        void *data;
+        StringInfoData msg;
+        char tag;
+
+        /* The leader detaching (exit or error) ends us, uncommitted work is lost */
+        if (shm_mq_receive(mqh, &len, &data, false) != SHM_MQ_SUCCESS)
+            break;
+
+        msg.data = data;
+        msg.len = len;
+        msg.maxlen = len;
+        msg.cursor = 0;
+        tag = pq_getmsgbyte(&msg);
+
+        switch (tag)
+        {
+        case APPLY_MSG_BATCH:
+        {
+            BatchEntry be = {0};
+
+            apply_worker_begin();
+
+            be.relid = pq_getmsgint(&msg, 4);
+            be.kind = pq_getmsgbyte(&msg);
+            be.nrows = pq_getmsgint(&msg, 4);
+            be.first_lsn = pq_getmsgint64(&msg);
+            be.last_lsn = pq_getmsgint64(&msg);
+            be.table = msg.data + msg.cursor;
+            msg.cursor += strlen(be.table) + 1;
+            be.ncols = pq_getmsgint(&msg, 2);
+            be.colnames = palloc(be.ncols * sizeof(char *));
+            be.coltypes = palloc(be.ncols * sizeof(Oid));
+            for (int i = 0; i < be.ncols; i++)
+            {
+                be.colnames[i] = msg.data + msg.cursor;
+                msg.cursor += strlen(be.colnames[i]) + 1;
+                be.coltypes[i] = pq_getmsgint(&msg, 4);
+            }
+
+            /* The apply engine writes into the buffer, take a private copy */
+            initStringInfo(&be.data);
+            appendBinaryStringInfo(&be.data, msg.data + msg.cursor,
+                                   msg.len - msg.cursor);
+            batch_apply(&be);
+            pfree(be.data.data);
+            pfree(be.colnames);
+            pfree(be.coltypes);
+            break;
+        }
+
+        case APPLY_MSG_SQL:
+        {
+            const char *sql;
+
+            pq_getmsgint(&msg, 4); /* the relid, which picked this worker */
+            sql = msg.data + msg.cursor;
+            apply_worker_begin();
+            if (SPI_execute(sql, false, 0) < 0)
+            {
+                elog(LOG, "SPI_execute failed: %s", sql);
+                stat_count_error();
+            }
+            break;
+        }
+
+        case APPLY_MSG_SYNC:
+        {
+            uint64 id = pq_getmsgint64(&msg);
+            List *progress = NIL;
+
+            while (msg.cursor < msg.len)
+            {
+                RelLsn *rl = palloc(sizeof(RelLsn));
+
+                rl->relid = pq_getmsgint(&msg, 4);
+                rl->lsn = pq_getmsgint64(&msg);
+                progress = lappend(progress, rl);
+            }
+
+            /* Committed with the rows, the decoder skips them after a crash */
+            if (IsTransactionState())
+                progress_record(progress);
+            list_free_deep(progress);
+            apply_worker_commit();
+
+            SpinLockAcquire(&shared->mutex);
+            shared->synced[worker] = id;
+            SpinLockRelease(&shared->mutex);
+            SetLatch(&shared->leader->procLatch);
+            break;
+        }
+
+        default:
+            elog(ERROR, "row_to_column apply worker %d got unknown message \"%c\"",
+                 worker, tag);
+        }
+    }
+
+    proc_exit(0);
+}
+
+/* ---------- INITIAL COPY ---------- */
+/*
+ * htap_convert() fills the mirror of an existing table with dynamic
+ * workers.  The leader exports its snapshot and hands out the heap in
+ * chunks of COPY_CHUNK_BLOCKS blocks; each worker imports the snapshot and
+ * copies the chunks it claims with INSERT ... SELECT over a ctid range.
+ * Rows are stamped 0/0, below any LSN a later change of theirs gets.
+ */
+#define COPY_CHUNK_BLOCKS 1024
+#define COPY_SQL_LEN      (16 * 1024)
+
+typedef struct CopyShared
+{
+    Oid database_id;
+    Oid user_id;
+    Oid relid;                           /* the table copied */
+    PGPROC *leader;
+    char snapshot[NAMEDATALEN];          /* exported by the leader */
+    BlockNumber nblocks;
+    int nworkers;
+    slock_t mutex;
+    BlockNumber next_block;              /* first block not handed out */
+    int imported;                        /* workers holding the snapshot */
+    int finished;                        /* workers done and committed */
+    uint64 rows;
+    char sql[COPY_SQL_LEN];              /* $1, $2: ctid range of a chunk */
+} CopyShared;
+
+static void
+copy_report(CopyShared *shared, int *counter, uint64 rows)
+{
+    SpinLockAcquire(&shared->mutex);
+    (*counter)++;
+    shared->rows += rows;
+    SpinLockRelease(&shared->mutex);
+    SetLatch(&shared->leader->procLatch);
+}
+
+PGDLLEXPORT void row_to_column_copy_main(Datum arg)
+{
+    dsm_segment *seg;
+    CopyShared *shared;
+    SPIPlanPtr plan;
+    Oid argtypes[2] = {TIDOID, TIDOID};
+    uint64 rows = 0;
+
+    pqsignal(SIGTERM, die);
+    BackgroundWorkerUnblockSignals();
+
+    seg = dsm_attach(DatumGetUInt32(arg));
+    if (seg == NULL)
+        ereport(ERROR,
+                (errmsg("row_to_column copy worker could not map the leader's segment")));
+    shared = dsm_segment_address(seg);
+
+    BackgroundWorkerInitializeConnectionByOid(shared->database_id, shared->user_id, 0);
+
+    /* Only a repeatable read transaction may take over a snapshot */
+    SetConfigOption("default_transaction_isolation", "repeatable read",
+                    PGC_USERSET, PGC_S_SESSION);
+    StartTransactionCommand();
+    ImportSnapshot(shared->snapshot);
+    PushActiveSnapshot(GetTransactionSnapshot());
+    copy_report(shared, &shared->imported, 0);
+
+    SPI_connect();
+    plan = SPI_prepare(shared->sql, 2, argtypes);
+    if (plan == NULL)
+        elog(ERROR, "row_to_column copy worker could not prepare \"%s\"", shared->sql);
+
+    for (;;)
+    {
+        BlockNumber start;
+        ItemPointerData from, to;
+        Datum values[2];
+
+        CHECK_FOR_INTERRUPTS();
+
+        SpinLockAcquire(&shared->mutex);
+        start = shared->next_block;
+        if (start < shared->nblocks)
+            shared->next_block = start + Min(COPY_CHUNK_BLOCKS, shared->nblocks - start);
+        SpinLockRelease(&shared->mutex);
+
+        if (start >= shared->nblocks)
+            break;
+
+        ItemPointerSet(&from, start, 0);
+        ItemPointerSet(&to, Min(start + COPY_CHUNK_BLOCKS, shared->nblocks), 0);
+        values[0] = PointerGetDatum(&from);
+        values[1] = PointerGetDatum(&to);
+
+        if (SPI_execute_plan(plan, values, NULL, false, 0) != SPI_OK_INSERT)
+            elog(ERROR, "row_to_column copy worker could not copy blocks %u to %u",
+                 start, Min(start + COPY_CHUNK_BLOCKS, shared->nblocks) - 1);
+        rows += SPI_processed;
+    }
+
+    SPI_finish();
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+
+    copy_report(shared, &shared->finished, rows);
+    dsm_detach(seg);
+    proc_exit(0);
+}
+
+/* ---------- COMPACTION WORKER ---------- */
+/*
+ * With row_to_column.compaction the postmaster also starts a compactor.
+ * Every compaction_naptime, inside compaction_window, it looks for mirrors
+ * of at least compaction_min_stripes stripes averaging less than
+ * compaction_fill of their stripe_row_limit, and rewrites each with
+ * htap_compact() into full stripes.  While it does, the apply worker is
+ * told to hold that relation's rows (stream mode) rather than queue up
+ * behind the mirror's lock; other relations carry on.
+ *
+ * On every wake, in or out of the window, it also runs the statements the
+ * worker left in htap_retypes, see DDL BARRIERS; the worker sets its latch
+ * when it queues one.
+ */
+#define COMPACT_CANDIDATES_SQL \
+    "SELECT p.tablename::text, to_regclass(quote_ident(p.tablename))::oid " \
+    "FROM pg_publication_tables p " \
+    "JOIN columnar.options o ON o.relation = to_regclass(quote_ident(p.tablename || '_col')) " \
+    "JOIN LATERAL (SELECT count(*) AS n, avg(s.row_count) AS r FROM columnar.stripe s " \
+    "              WHERE s.relation = o.relation) st ON true " \
+    "WHERE p.pubname = $3 AND st.n >= $1 " \
+    "AND st.r < $2 * o.stripe_row_limit " \
+    "ORDER BY st.n DESC"
+
+static void
+compact_set_relid(Oid relid)
+{
+    if (!htap_stats)
+        return;
+
+    SpinLockAcquire(&htap_stats->mutex);
+    htap_stats->compact_relid = relid;
+    SpinLockRelease(&htap_stats->mutex);
+}
+
+static void
+compact_shmem_exit(int code, Datum arg)
+{
+    SpinLockAcquire(&htap_stats->mutex);
+    htap_stats->compact_relid = InvalidOid;
+    htap_stats->compactor_pid = 0;
+    htap_stats->compactor_latch = NULL;
+    SpinLockRelease(&htap_stats->mutex);
+}
+
+static bool
+compact_in_window(void)
+{
+    int sh, sm, eh, em;
+    int now, start, end;
+    struct pg_tm tm;
+    fsec_t fsec;
+    int tz;
+
+    if (!r2c_compaction_window || r2c_compaction_window[0] == '\0')
+        return true;
+    if (sscanf(r2c_compaction_window, "%d:%d-%d:%d", &sh, &sm, &eh, &em) != 4 ||
+        timestamp2tm(GetCurrentTimestamp(), &tz, &tm, &fsec, NULL, NULL) != 0)
+        return false;
+
+    now = tm.tm_hour * 60 + tm.tm_min;
+    start = sh * 60 + sm;
+    end = eh * 60 + em;
+    return start <= end ? (now >= start && now < end)
+                        : (now >= start || now < end);
+}
+
+static void
+compact_table(const char *name, Oid relid)
+{
+    Oid argtypes[1] = {TEXTOID};
+    Datum args[1];
+    TimestampTz start = GetCurrentTimestamp();
+    int64 rows = 0;
+
+    compact_set_relid(relid);
+
+    StartTransactionCommand();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    SPI_connect();
+
+    args[0] = CStringGetTextDatum(name);
+    if (SPI_execute_with_args("SELECT htap_compact($1)", 1, argtypes, args,
+                              NULL, false, 0) == SPI_OK_SELECT && SPI_processed > 0)
+    {
+        bool isnull;
+
+        rows = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0],
+                                           SPI_tuptable->tupdesc, 1, &isnull));
+    }
+
+    SPI_finish();
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+
+    compact_set_relid(InvalidOid);
+
+    elog(LOG, "row_to_column compacted %s_col: " INT64_FORMAT " rows in %ld ms",
+         name, rows,
+         TimestampDifferenceMilliseconds(start, GetCurrentTimestamp()));
+}
+
+static void
+compact_round(MemoryContext cxt)
+{
+    List *names = NIL;
+    List *relids = NIL;
+    ListCell *lc1, *lc2;
+
+    MemoryContextReset(cxt);
+
+    StartTransactionCommand();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    SPI_connect();
+
+    if (SPI_execute("SELECT 1 WHERE to_regclass('columnar.stripe') IS NOT NULL "
+                    "AND to_regclass('columnar.options') IS NOT NULL",
+                    true, 0) == SPI_OK_SELECT && SPI_processed > 0)
+    {
+        Oid argtypes[3] = {INT4OID, FLOAT8OID, TEXTOID};
+        Datum args[3];
+
+        args[0] = Int32GetDatum(r2c_compaction_min_stripes);
+        args[1] = Float8GetDatum(r2c_compaction_fill);
+        args[2] = CStringGetTextDatum(worker_conf.publication);
+        if (SPI_execute_with_args(COMPACT_CANDIDATES_SQL, 3, argtypes, args,
+                                  NULL, true, 0) == SPI_OK_SELECT)
+        {
+            MemoryContext oldcxt = MemoryContextSwitchTo(cxt);
+
+            for (uint64 i = 0; i < SPI_processed; i++)
+            {
+                bool isnull;
+                Datum relid = SPI_getbinval(SPI_tuptable->vals[i],
+                                            SPI_tuptable->tupdesc, 2, &isnull);
+
+                if (isnull)
+                    continue;
+                names = lappend(names, SPI_getvalue(SPI_tuptable->vals[i],
+                                                    SPI_tuptable->tupdesc, 1));
+                relids = lappend_oid(relids, DatumGetObjectId(relid));
+            }
+            MemoryContextSwitchTo(oldcxt);
+        }
+    }
+
+    SPI_finish();
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+
+    forboth (lc1, names, lc2, relids)
+    {
+        if (got_sigterm || !compact_in_window())
+            break;
+        compact_table(lfirst(lc1), lfirst_oid(lc2));
+    }
+}
+
+/*
+ * Run the oldest statement in htap_retypes; the row stays locked until it
+ * commits, so a worker that needs it run meanwhile waits and finds it gone.
+ * Returns whether there was one.
+ */
+static bool
+retype_round(void)
+{
+    Oid relid = InvalidOid;
+    char *sql = NULL;
+    TimestampTz start = GetCurrentTimestamp();
+
+    StartTransactionCommand();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    SPI_connect();
+
+    if (SPI_execute("SELECT relid FROM htap_retypes "
+                    "ORDER BY requested_at LIMIT 1 FOR UPDATE SKIP LOCKED",
+                    false, 0) == SPI_OK_SELECT && SPI_processed > 0)
+    {
+        bool isnull;
+        Oid argtypes[1] = {OIDOID};
+        Datum args[1];
+
+        relid = DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[0],
+                                               SPI_tuptable->tupdesc, 1, &isnull));
+        compact_set_relid(relid);
+
+        args[0] = ObjectIdGetDatum(relid);
+        if (SPI_execute_with_args("DELETE FROM htap_retypes WHERE relid = $1 RETURNING ddl_sql",
+                                  1, argtypes, args, NULL, false, 0) == SPI_OK_DELETE_RETURNING &&
+            SPI_processed > 0)
+            sql = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1);
+        if (sql && SPI_execute(sql, false, 0) < 0)
+        {
+            elog(LOG, "SPI_execute failed: %s", sql);
+            stat_count_error();
+        }
+    }
+
+    SPI_finish();
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+
+    if (!OidIsValid(relid))
+        return false;
+
+    compact_set_relid(InvalidOid);
+    elog(LOG, "row_to_column rewrote the mirror of relation %u in %ld ms",
+         relid, TimestampDifferenceMilliseconds(start, GetCurrentTimestamp()));
+    return true;
+}
+
+/* Started by the launcher next to the main worker of entry arg */
+PGDLLEXPORT void row_to_column_compact_main(Datum arg)
+{
+    MemoryContext cxt;
+    TimestampTz last_round = 0;
+
+    pqsignal(SIGTERM, handle_sigterm);
+    pqsignal(SIGHUP, SignalHandlerForConfigReload);
+    BackgroundWorkerUnblockSignals();
+
+    stat_attach(DatumGetInt32(arg));
+    SpinLockAcquire(&htap_stats->mutex);
+    worker_conf = htap_stats->conf;
+    htap_stats->compact_relid = InvalidOid;
+    htap_stats->compactor_pid = MyProcPid;
+    htap_stats->compactor_latch = MyLatch;
+    SpinLockRelease(&htap_stats->mutex);
+
+    /* Don't leave the apply worker holding rows for a compactor that died */
+    before_shmem_exit(compact_shmem_exit, 0);
+
+    BackgroundWorkerInitializeConnection(worker_conf.database, NULL, 0);
+
+    cxt = AllocSetContextCreate(TopMemoryContext, "row_to_column compaction",
+                                ALLOCSET_SMALL_SIZES);
+
+    elog(LOG, "row_to_column compactor started");
+
+    while (!got_sigterm)
+    {
+        int rc = WaitLatch(MyLatch,
+                           WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+                           r2c_compaction_naptime * 1000L,
+                           htap_wait_event(HTAP_WAIT_COMPACTOR_IDLE));
+
+        if (rc & WL_POSTMASTER_DEATH)
+            proc_exit(1);
+        ResetLatch(MyLatch);
+
+        if (ConfigReloadPending)
+        {
+            ConfigReloadPending = false;
+            ProcessConfigFile(PGC_SIGHUP);
+        }
+
+        while (!got_sigterm && retype_round())
+            CHECK_FOR_INTERRUPTS();
+
+        /* A retype's wake doesn't count as the naptime */
+        if (!got_sigterm && compact_in_window() &&
+            TimestampDifferenceExceeds(last_round, GetCurrentTimestamp(),
+                                       r2c_compaction_naptime * 1000))
+        {
+            compact_round(cxt);
+            last_round = GetCurrentTimestamp();
+        }
+    }
+
+    proc_exit(0);
+}
+
+/* ---------- LAUNCHER ---------- */
+/*
+ * row_to_column.workers lists the databases to replicate, each with the
+ * logical slot and publication its worker reads.  The launcher, the only
+ * worker registered at startup, gives every entry an HtapStats and starts
+ * a main worker (and with row_to_column.compaction a compactor) connected
+ * to its database, so databases are replicated side by side.  A process
+ * that stops is started again LAUNCHER_RESTART_MS after its last start.
+ * On reload, the processes of entries that went away or changed are
+ * stopped before their HtapStats is handed on; unchanged entries keep
+ * running, wherever they moved to in the list.
+ */
+#define LAUNCHER_RESTART_MS 5000L
+#define LAUNCHER_STOP_POLL_MS 100L
+
+typedef struct LauncherProc
+{
+    BackgroundWorkerHandle *handle; /* NULL if started by an earlier launcher */
+    TimestampTz last_start;
+} LauncherProc;
+
+static LauncherProc launcher_workers[R2C_MAX_WORKERS];
+static LauncherProc launcher_compactors[R2C_MAX_WORKERS];
+
+/* pid is what the process published; it may be ours or an earlier launcher's */
+static bool
+launcher_running(LauncherProc *lp, int pid)
+{
+    pid_t handle_pid;
+
+    if (pid != 0)
+        return true;
+    return lp->handle != NULL &&
+           GetBackgroundWorkerPid(lp->handle, &handle_pid) != BGWH_STOPPED;
+}
+
+static void
+launcher_start(LauncherProc *lp, int index, bool compactor)
+{
+    BackgroundWorker worker;
+    const char *what = compactor ? "compactor" : "worker";
+
+    MemSet(&worker, 0, sizeof(worker));
+    worker.bgw_flags =
+        BGWORKER_BACKEND_DATABASE_CONNECTION | BGWORKER_SHMEM_ACCESS;
+    worker.bgw_start_time = BgWorkerStart_ConsistentState;
+    worker.bgw_restart_time = BGW_NEVER_RESTART;
+    worker.bgw_notify_pid = MyProcPid;
+    worker.bgw_main_arg = Int32GetDatum(index);
+    snprintf(worker.bgw_name, BGW_MAXLEN, "row_to_column %s for database %s",
+             what, htap_workers[index].conf.database);
+    snprintf(worker.bgw_type, BGW_MAXLEN, "row_to_column %s", what);
+    snprintf(worker.bgw_library_name, BGW_MAXLEN, "row_to_column");
+    snprintf(worker.bgw_function_name, BGW_MAXLEN,
+             compactor ? "row_to_column_compact_main" : "row_to_column_main");
+
+    if (lp->handle)
+        pfree(lp->handle);
+    lp->handle = NULL;
+    lp->last_start = GetCurrentTimestamp();
+
+    if (!RegisterDynamicBackgroundWorker(&worker, &lp->handle))
+        ereport(WARNING,
+                (errmsg("row_to_column could not start a %s for database \"%s\"",
+                        what, htap_workers[index].conf.database),
+                 errhint("Consider increasing max_worker_processes.")));
+}
+
+/* Start the process unless it runs, or started too recently; shorten *timeout to its turn */
+static void
+launcher_ensure(LauncherProc *lp, int index, bool compactor, int pid, long *timeout)
+{
+    long elapsed;
+
+    if (launcher_running(lp, pid))
+        return;
+
+    elapsed = lp->last_start == 0 ? LAUNCHER_RESTART_MS
+                                  : TimestampDifferenceMilliseconds(lp->last_start,
+                                                                    GetCurrentTimestamp());
+    if (elapsed >= LAUNCHER_RESTART_MS)
+        launcher_start(lp, index, compactor);
+    else
+        *timeout = Min(*timeout, LAUNCHER_RESTART_MS - elapsed);
+}
+
+/* Stop the processes of entry index and wait until they are gone */
+static void
+launcher_stop(int index)
+{
+    HtapStats *hs = &htap_workers[index];
+    LauncherProc *procs[2] = {&launcher_workers[index], &launcher_compactors[index]};
+
+    for (;;)
+    {
+        int pids[2];
+        bool running = false;
+        int rc;
+
+        SpinLockAcquire(&hs->mutex);
+        pids[0] = hs->pid;
+        pids[1] = hs->compactor_pid;
+        SpinLockRelease(&hs->mutex);
+
+        for (int k = 0; k < 2; k++)
+        {
+            if (procs[k]->handle)
+                TerminateBackgroundWorker(procs[k]->handle);
+            if (pids[k] != 0)
+                kill(pids[k], SIGTERM);
+            running |= launcher_running(procs[k], pids[k]);
+        }
+        if (!running)
+            break;
+
+        rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+                       LAUNCHER_STOP_POLL_MS, htap_wait_event(HTAP_WAIT_LAUNCHER_IDLE));
+        if (rc & WL_POSTMASTER_DEATH)
+            proc_exit(1);
+        ResetLatch(MyLatch);
+    }
+
+    for (int k = 0; k < 2; k++)
+    {
+        if (procs[k]->handle)
+            pfree(procs[k]->handle);
+        procs[k]->handle = NULL;
+        procs[k]->last_start = 0;
+    }
+}
+
+/* Clear an entry that is not in use, to be handed to conf */
+static void
+launcher_entry_set(HtapStats *hs, const R2CWorkerConf *conf, Oid database_id)
+{
+    SpinLockAcquire(&hs->mutex);
+    MemSet(&hs->in_use, 0, sizeof(HtapStats) - offsetof(HtapStats, in_use));
+    if (conf)
+    {
+        hs->in_use = true;
+        hs->database_id = database_id;
+        hs->conf = *conf;
+    }
+    SpinLockRelease(&hs->mutex);
+}
+
+/*
+ * Drop the horizon slot of database_id, see fresh_init(), unless an entry
+ * in use still has the database.  Its xmin would hold back vacuum there
+ * for good once no worker moves it.
+ */
+static void
+launcher_drop_horizon(Oid database_id)
+{
+    char name[NAMEDATALEN];
+    ReplicationSlot *slot;
+    bool drop;
+
+    for (int i = 0; i < R2C_MAX_WORKERS; i++)
+        if (htap_workers[i].in_use && htap_workers[i].database_id == database_id)
+            return;
+
+    snprintf(name, NAMEDATALEN, R2C_HORIZON_SLOT "_%u", database_id);
+
+    LWLockAcquire(ReplicationSlotControlLock, LW_SHARED);
+    slot = SearchNamedReplicationSlot(name, false);
+    drop = slot != NULL && slot->active_pid == 0;
+    LWLockRelease(ReplicationSlotControlLock);
+
+    if (drop)
+    {
+        ReplicationSlotDrop(name, true);
+        elog(LOG, "row_to_column dropped replication slot \"%s\"", name);
+    }
+}
+
+/* Match the entries in use to row_to_column.workers */
+static void
+launcher_configure(void)
+{
+    R2CWorkerConf confs[R2C_MAX_WORKERS];
+    bool placed[R2C_MAX_WORKERS];
+    Oid removed[R2C_MAX_WORKERS];
+    int nremoved = 0;
+    const char *detail = NULL;
+    int n = r2c_workers_parse(r2c_workers, confs, &detail);
+
+    /* The check hook let nothing else through */
+    if (n < 0)
+        n = 0;
+    MemSet(placed, 0, sizeof(placed));
+
+    for (int i = 0; i < R2C_MAX_WORKERS; i++)
+    {
+        HtapStats *hs = &htap_workers[i];
+        bool keep = false;
+
+        if (!hs->in_use)
+            continue;
+        for (int c = 0; c < n && !keep; c++)
+            if (!placed[c] && memcmp(&hs->conf, &confs[c], sizeof(R2CWorkerConf)) == 0)
+                placed[c] = keep = true;
+        if (keep)
+            continue;
+
+        elog(LOG, "row_to_column stopping the worker for database \"%s\"",
+             hs->conf.database);
+        launcher_stop(i);
+        removed[nremoved++] = hs->database_id;
+        launcher_entry_set(hs, NULL, InvalidOid);
+    }
+
+    for (int c = 0; c < n; c++)
+    {
+        Oid database_id;
+        int i;
+
+        if (placed[c])
+            continue;
+        for (i = 0; i < R2C_MAX_WORKERS && htap_workers[i].in_use; i++)
+            ;
+        Assert(i < R2C_MAX_WORKERS);
+
+        StartTransactionCommand();
+        database_id = get_database_oid(confs[c].database, true);
+        CommitTransactionCommand();
+
+        if (!OidIsValid(database_id))
+        {
+            ereport(WARNING,
+                    (errmsg("database \"%s\" in row_to_column.workers does not exist",
+                            confs[c].database)));
+            continue;
+        }
+
+        launcher_entry_set(&htap_workers[i], &confs[c], database_id);
+        launcher_workers[i].last_start = 0;
+        launcher_compactors[i].last_start = 0;
+    }
+
+    /* After the new entries: a changed one keeps its database's slot */
+    for (int k = 0; k < nremoved; k++)
+        launcher_drop_horizon(removed[k]);
+}
+
+PGDLLEXPORT void row_to_column_launcher_main(Datum arg)
+{
+    pqsignal(SIGTERM, handle_sigterm);
+    pqsignal(SIGHUP, SignalHandlerForConfigReload);
+    BackgroundWorkerUnblockSignals();
+
+    /* Only to look up databases in the shared catalog */
+    BackgroundWorkerInitializeConnection(NULL, NULL, 0);
+
+    elog(LOG, "row_to_column launcher started");
+    launcher_configure();
+
+    while (!got_sigterm)
+    {
+        long timeout = LAUNCHER_RESTART_MS;
+        int rc;
+
+        if (ConfigReloadPending)
+        {
+            ConfigReloadPending = false;
+            ProcessConfigFile(PGC_SIGHUP);
+            launcher_configure();
+        }
+
+        for (int i = 0; i < R2C_MAX_WORKERS; i++)
+        {
+            HtapStats *hs = &htap_workers[i];
+            int pid, compactor_pid;
+
+            if (!hs->in_use)
+                continue;
+
+            SpinLockAcquire(&hs->mutex);
+            pid = hs->pid;
+            compactor_pid = hs->compactor_pid;
+            SpinLockRelease(&hs->mutex);
+
+            launcher_ensure(&launcher_workers[i], i, false, pid, &timeout);
+            if (r2c_compaction)
+                launcher_ensure(&launcher_compactors[i], i, true, compactor_pid, &timeout);
+        }
+
+        /* Workers starting or stopping set the latch too */
+        rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+                       timeout, htap_wait_event(HTAP_WAIT_LAUNCHER_IDLE));
+        if (rc & WL_POSTMASTER_DEATH)
+            proc_exit(1);
+        ResetLatch(MyLatch);
+    }
+
+    proc_exit(0);
+}
+
+/* ---------- SQL FUNCTIONS ---------- */
+PG_FUNCTION_INFO_V1(htap_stat);
+PG_FUNCTION_INFO_V1(htap_stat_tables);
+
+static void
+stat_check_loaded(void)
+{
+    if (!htap_workers)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("row_to_column must be loaded via shared_preload_libraries")));
+}
+
+/* Take the statistics and applied snapshot of this database's worker */
+static void
+stat_attach_database(void)
+{
+    stat_check_loaded();
+
+    for (int i = 0; i < R2C_MAX_WORKERS; i++)
+    {
+        bool match;
+
+        SpinLockAcquire(&htap_workers[i].mutex);
+        match = htap_workers[i].in_use && htap_workers[i].database_id == MyDatabaseId;
+        SpinLockRelease(&htap_workers[i].mutex);
+
+        if (match)
+        {
+            stat_attach(i);
+            return;
+        }
+    }
+
+    ereport(ERROR,
+            (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+             errmsg("no row_to_column worker replicates database \"%s\"",
+                    get_database_name(MyDatabaseId)),
+             errhint("Add the database to row_to_column.workers.")));
+}
+
+/* Pipeline counters behind pg_stat_htap; times are in milliseconds */
+Datum
+htap_stat(PG_FUNCTION_ARGS)
+{
+    TupleDesc tupdesc;
+    Datum values[16];
+    bool nulls[16];
+    HtapStats s;
+
+    stat_attach_database();
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "return type must be a row type");
+
+    SpinLockAcquire(&htap_stats->mutex);
+    memcpy(&s, htap_stats, sizeof(HtapStats));
+    SpinLockRelease(&htap_stats->mutex);
+
+    MemSet(nulls, 0, sizeof(nulls));
+    values[0] = Int32GetDatum(s.pid);
+    nulls[0] = s.pid == 0;
+    values[1] = LSNGetDatum(s.received_lsn);
+    nulls[1] = XLogRecPtrIsInvalid(s.received_lsn);
+    values[2] = LSNGetDatum(s.applied_lsn);
+    nulls[2] = XLogRecPtrIsInvalid(s.applied_lsn);
+    values[3] = TimestampTzGetDatum(s.last_commit_time);
+    nulls[3] = s.last_commit_time == 0;
+    values[4] = TimestampTzGetDatum(s.last_apply_time);
+    nulls[4] = s.last_apply_time == 0;
+    values[5] = Int64GetDatum(s.transactions);
+    values[6] = Int64GetDatum(s.rows);
+    values[7] = Int64GetDatum(s.bytes);
+    values[8] = Int64GetDatum(s.batches);
+    values[9] = Float8GetDatum(s.fetch_us / 1000.0);
+    values[10] = Float8GetDatum(s.decode_us / 1000.0);
+    values[11] = Float8GetDatum(s.apply_us / 1000.0);
+    values[12] = Float8GetDatum(s.commit_us / 1000.0);
+    values[13] = Int64GetDatum(s.errors);
+    values[14] = CStringGetTextDatum(s.conf.slot_name);
+    values[15] = CStringGetTextDatum(s.conf.publication);
+
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/* One row per mirrored relation behind pg_stat_htap_tables */
+Datum
+htap_stat_tables(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    HASH_SEQ_STATUS status;
+    HtapTableStats *ts;
+
+    stat_check_loaded();
+    InitMaterializedSRF(fcinfo, 0);
+
+    LWLockAcquire(htap_workers[0].lock, LW_SHARED);
+    hash_seq_init(&status, htap_table_stats);
+    while ((ts = hash_seq_search(&status)) != NULL)
+    {
+        Datum values[6];
+        bool nulls[6];
+
+        if (ts->key.database_id != MyDatabaseId)
+            continue;
+
+        MemSet(nulls, 0, sizeof(nulls));
+        values[0] = ObjectIdGetDatum(ts->key.relid);
+        values[1] = Int64GetDatum(ts->rows_inserted);
+        values[2] = Int64GetDatum(ts->rows_deleted);
+        values[3] = Int64GetDatum(ts->batches);
+        values[4] = Float8GetDatum(ts->apply_us / 1000.0);
+        values[5] = TimestampTzGetDatum(ts->last_apply_time);
+        nulls[5] = ts->last_apply_time == 0;
+
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+    }
+    LWLockRelease(htap_workers[0].lock);
+
+    return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(htap_publication);
+
+/* Publication the worker of this database reads, for the SQL functions */
+Datum
+htap_publication(PG_FUNCTION_ARGS)
+{
+    R2CWorkerConf confs[R2C_MAX_WORKERS];
+    const char *detail = NULL;
+    char *database = get_database_name(MyDatabaseId);
+    int n = r2c_workers_parse(r2c_workers, confs, &detail);
+
+    for (int i = 0; i < n; i++)
+        if (strcmp(confs[i].database, database) == 0)
+            PG_RETURN_TEXT_P(cstring_to_text(confs[i].publication));
+
+    PG_RETURN_TEXT_P(cstring_to_text(R2C_PUBLICATION));
+}
+
+PG_FUNCTION_INFO_V1(htap_wait_for_lsn);
+PG_FUNCTION_INFO_V1(htap_wait_for_current);
+
+/*
+ * Wait until the worker has applied everything up to target, or timeout_ms
+ * (0: no limit) has passed.  The worker is asked to apply what it holds at
+ * once rather than when its flush thresholds say so.
+ */
+static bool
+stat_wait_for_lsn(XLogRecPtr target, int64 timeout_ms)
+{
+    TimestampTz deadline = 0;
+    bool reached = false;
+
+    stat_attach_database();
+    if (timeout_ms > 0)
+        deadline = TimestampTzPlusMilliseconds(GetCurrentTimestamp(), timeout_ms);
+
+    ConditionVariablePrepareToSleep(&htap_stats->applied_cv);
+    for (;;)
+    {
+        XLogRecPtr applied;
+        Latch *latch;
+        long sleep_ms = 1000;
+
+        SpinLockAcquire(&htap_stats->mutex);
+        applied = htap_stats->applied_lsn;
+        if (applied < target && htap_stats->flush_request_lsn < target)
+            htap_stats->flush_request_lsn = target;
+        latch = htap_stats->worker_latch;
+        SpinLockRelease(&htap_stats->mutex);
+
+        if (applied >= target)
+        {
+            reached = true;
+            break;
+        }
+
+        if (deadline != 0)
+        {
+            long remaining = TimestampDifferenceMilliseconds(GetCurrentTimestamp(),
+                                                             deadline);
+            if (remaining <= 0)
+                break;
+            sleep_ms = Min(sleep_ms, remaining);
+        }
+
+        /* Also covers a worker that restarted since the last round */
+        if (latch)
+            SetLatch(latch);
+
+        ConditionVariableTimedSleep(&htap_stats->applied_cv, sleep_ms,
+                                    htap_wait_event(HTAP_WAIT_APPLIED_LSN));
+    }
+    ConditionVariableCancelSleep();
+
+    return reached;
+}
+
+Datum
+htap_wait_for_lsn(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(stat_wait_for_lsn(PG_GETARG_LSN(0), PG_GETARG_INT64(1)));
+}
+
+/* Wait for everything written so far, by any session */
+Datum
+htap_wait_for_current(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(stat_wait_for_lsn(GetXLogInsertRecPtr(), PG_GETARG_INT64(0)));
+}
+
+PG_FUNCTION_INFO_V1(htap_delta);
+
+#define FRESH_SCAN_ATTEMPTS 3 /* scans skipping all-visible pages */
+
+/*
+ * A copy of the applied snapshot the reader's snapshot can be combined
+ * with, or NULL.  The mirrors the reader sees must hold everything the
+ * applied snapshot sees, so the transaction that last wrote to them has to
+ * be visible to the reader.
+ */
+static Snapshot
+fresh_reader_snapshot(Snapshot reader, uint64 *generation)
+{
+    HtapAppliedSnapshot *s = applied_snapshot;
+    Snapshot snap = NULL;
+    TransactionId applied_xid = InvalidTransactionId;
+
+    LWLockAcquire(applied_snapshot_lock, LW_SHARED);
+    *generation = s->generation;
+    if (s->valid)
+    {
+        snap = palloc0(sizeof(SnapshotData));
+        snap->snapshot_type = SNAPSHOT_MVCC;
+        snap->xmin = s->xmin;
+        snap->xmax = s->xmax;
+        snap->xcnt = s->xcnt;
+        snap->xip = palloc((s->xcnt + 1) * sizeof(TransactionId));
+        memcpy(snap->xip, s->xids, s->xcnt * sizeof(TransactionId));
+        snap->subxcnt = s->subxcnt;
+        snap->subxip = palloc((s->subxcnt + 1) * sizeof(TransactionId));
+        memcpy(snap->subxip, s->xids + s->xcnt, s->subxcnt * sizeof(TransactionId));
+        /* The reader's own changes are never applied */
+        snap->curcid = FirstCommandId;
+        applied_xid = s->applied_xid;
+    }
+    LWLockRelease(applied_snapshot_lock);
+
+    if (snap && TransactionIdIsValid(applied_xid) &&
+        (XidInMVCCSnapshot(applied_xid, reader) ||
+         !TransactionIdDidCommit(applied_xid)))
+        snap = NULL;
+
+    return snap;
+}
+
+static uint64
+fresh_generation(void)
+{
+    uint64 generation;
+
+    LWLockAcquire(applied_snapshot_lock, LW_SHARED);
+    generation = applied_snapshot->generation;
+    LWLockRelease(applied_snapshot_lock);
+
+    return generation;
+}
+
+static void
+fresh_emit(ReturnSetInfo *rsinfo, TupleDesc desc, bool is_new, HeapTuple tuple)
+{
+    Datum values[2];
+    bool nulls[2] = {false, false};
+
+    values[0] = BoolGetDatum(is_new);
+    values[1] = heap_copy_tuple_as_datum(tuple, desc);
+    tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+    heap_freetuple(tuple);
+}
+
+/* Emit the tuples of rel visible to exactly one of the two snapshots */
+static void
+fresh_scan(Relation rel, Snapshot reader, Snapshot applied, bool skip_visible,
+           ReturnSetInfo *rsinfo)
+{
+    TupleDesc desc = RelationGetDescr(rel);
+    BlockNumber nblocks = RelationGetNumberOfBlocks(rel);
+    BufferAccessStrategy strategy = GetAccessStrategy(BAS_BULKREAD);
+    Buffer vmbuffer = InvalidBuffer;
+
+    for (BlockNumber blkno = 0; blkno < nblocks; blkno++)
+    {
+        Buffer buf;
+        Page page;
+        OffsetNumber maxoff;
+        List *added = NIL;
+        List *retired = NIL;
+        ListCell *lc;
+
+        CHECK_FOR_INTERRUPTS();
+
+        if (skip_visible && VM_ALL_VISIBLE(rel, blkno, &vmbuffer))
+            continue;
+
+        buf = ReadBufferExtended(rel, MAIN_FORKNUM, blkno, RBM_NORMAL, strategy);
+        LockBuffer(buf, BUFFER_LOCK_SHARE);
+        page = BufferGetPage(buf);
+        maxoff = PageGetMaxOffsetNumber(page);
+
+        for (OffsetNumber off = FirstOffsetNumber; off <= maxoff;
+             off = OffsetNumberNext(off))
+        {
+            ItemId lp = PageGetItemId(page, off);
+            HeapTupleData tuple;
+            bool in_reader;
+            bool in_applied;
+
+            if (!ItemIdIsNormal(lp))
+                continue;
+
+            tuple.t_data = (HeapTupleHeader) PageGetItem(page, lp);
+            tuple.t_len = ItemIdGetLength(lp);
+            tuple.t_tableOid = RelationGetRelid(rel);
+            ItemPointerSet(&tuple.t_self, blkno, off);
+
+            in_reader = HeapTupleSatisfiesVisibility(&tuple, reader, buf);
+            in_applied = applied != NULL &&
+                         HeapTupleSatisfiesVisibility(&tuple, applied, buf);
+
+            if (in_reader != in_applied)
+            {
+                HeapTuple copy = heap_copytuple(&tuple);
+
+                if (in_reader)
+                    added = lappend(added, copy);
+                else
+                    retired = lappend(retired, copy);
+            }
+        }
+
+        UnlockReleaseBuffer(buf);
+
+        /* Detoasting may need buffers, so not under the lock above */
+        foreach (lc, added)
+            fresh_emit(rsinfo, desc, true, lfirst(lc));
+        foreach (lc, retired)
+            fresh_emit(rsinfo, desc, false, lfirst(lc));
+        list_free(added);
+        list_free(retired);
+    }
+
+    if (BufferIsValid(vmbuffer))
+        ReleaseBuffer(vmbuffer);
+    FreeAccessStrategy(strategy);
+}
+
+/*
+ * htap_delta(row of a table): the versions of its rows the mirror does not
+ * reflect yet.  is_new is true for ones the caller sees and the mirror does
+ * not have, false for ones the mirror has and the caller no longer sees.
+ * Without a usable applied snapshot every visible row comes back as new,
+ * preceded by a row with a NULL is_new: the mirror is not to be used.
+ */
+Datum
+htap_delta(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    Oid relid = get_typ_typrelid(get_fn_expr_argtype(fcinfo->flinfo, 0));
+    Snapshot reader = GetActiveSnapshot();
+    Snapshot applied = NULL;
+    Relation rel;
+
+    stat_attach_database();
+    if (!r2c_fresh_reads)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("htap_delta() requires row_to_column.fresh_reads to be on")));
+    if (!OidIsValid(relid))
+        ereport(ERROR,
+                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                 errmsg("argument of htap_delta() must be a row of a table")));
+
+    InitMaterializedSRF(fcinfo, 0);
+
+    rel = table_open(relid, AccessShareLock);
+    if (rel->rd_rel->relkind != RELKIND_RELATION ||
+        rel->rd_rel->relam != HEAP_TABLE_AM_OID)
+        ereport(ERROR,
+                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                 errmsg("\"%s\" is not a heap table",
+                        RelationGetRelationName(rel))));
+
+    for (int attempt = 0;; attempt++)
+    {
+        uint64 generation;
+        bool skip_visible;
+
+        applied = fresh_reader_snapshot(reader, &generation);
+        skip_visible = applied != NULL && attempt < FRESH_SCAN_ATTEMPTS;
+
+        fresh_scan(rel, reader, applied, skip_visible, rsinfo);
+
+        /* Pages may have become all-visible past what we skipped by */
+        if (!skip_visible || fresh_generation() == generation)
+            break;
+        tuplestore_clear(rsinfo->setResult);
+    }
+
+    if (!applied)
+    {
+        Datum values[2] = {0, 0};
+        bool nulls[2] = {true, true};
+
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+    }
+
+    table_close(rel, AccessShareLock);
+
+    return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(htap_copy_begin);
+PG_FUNCTION_INFO_V1(htap_copy_finish);
+
+/* The initial copy started by this session, between begin and finish */
+static dsm_segment *copy_seg = NULL;
+static BackgroundWorkerHandle **copy_handles = NULL;
+
+static void
+copy_stop(void)
+{
+    CopyShared *shared = dsm_segment_address(copy_seg);
+
+    for (int i = 0; i < shared->nworkers; i++)
+        TerminateBackgroundWorker(copy_handles[i]);
+    pfree(copy_handles);
+    copy_handles = NULL;
+    dsm_detach(copy_seg);
+    copy_seg = NULL;
+}
+
+/*
+ * Wait for *counter to reach the number of workers.  A worker that exits
+ * without finishing fails the copy; so does an interrupt, after stopping
+ * the workers.
+ */
+static void
+copy_wait(int *counter, const char *what)
+{
+    CopyShared *shared = dsm_segment_address(copy_seg);
+
+    PG_TRY();
+    {
+        for (;;)
         {
-            WaitLatch(MyLatch,
-                      WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
-                      1000L, 0);
+            int stopped = 0;
+            int done, finished;
+
+            /* A worker counts itself before it exits, so look at them first */
+            for (int i = 0; i < shared->nworkers; i++)
+            {
+                pid_t pid;
+
+                if (GetBackgroundWorkerPid(copy_handles[i], &pid) == BGWH_STOPPED)
+                    stopped++;
+            }
+
+            SpinLockAcquire(&shared->mutex);
+            done = *counter;
+            finished = shared->finished;
+            SpinLockRelease(&shared->mutex);
+
+            if (done >= shared->nworkers)
+                break;
+            if (stopped > finished)
+                ereport(ERROR,
+                        (errmsg("row_to_column copy worker exited before %s", what),
+                         errdetail("See its messages in the server log.")));
+
+            WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                      1000, htap_wait_event(HTAP_WAIT_COPY));
             ResetLatch(MyLatch);
+            CHECK_FOR_INTERRUPTS();
         }
+    }
+    PG_CATCH();
+    {
+        copy_stop();
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+}
+
+/*
+ * htap_copy_begin(tbl, nworkers) starts copying tbl into its mirror as of
+ * the current snapshot, and returns the WAL insert position.  The caller
+ * holds off writers (a SHARE lock) until it commits, so every transaction
+ * committed below that position is in the copy, and none above it.
+ */
+Datum
+htap_copy_begin(PG_FUNCTION_ARGS)
+{
+    Oid relid = PG_GETARG_OID(0);
+    int nworkers = PG_GETARG_INT32(1);
+    Relation rel;
+    TupleDesc desc;
+    StringInfoData cols;
+    char *nsp;
+    char *mirror;
+    CopyShared *shared;
+    XLogRecPtr lsn;
+    int started = 0;
 
-        if (ret < 0)
-            elog(WARNING, "Failed to fetch logical changes");
+    if (nworkers < 1 || nworkers > max_worker_processes)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("parallel_workers must be between 1 and %d",
+                        max_worker_processes)));
 
-        // Decode all WAL messages → build transaction buffers
-        for (uint64 i = 0; i < SPI_processed; i++)
+    if (copy_seg)
+    {
+        ereport(NOTICE,
+                (errmsg("stopping the initial copy left over in this session")));
+        copy_stop();
+    }
+
+    rel = table_open(relid, AccessShareLock);
+    desc = RelationGetDescr(rel);
+
+    initStringInfo(&cols);
+    for (int i = 0; i < desc->natts; i++)
+    {
+        Form_pg_attribute att = TupleDescAttr(desc, i);
+
+        if (att->attisdropped)
+            continue;
+        if (cols.len > 0)
+            appendStringInfoString(&cols, ", ");
+        appendStringInfoString(&cols, quote_identifier(NameStr(att->attname)));
+    }
+
+    nsp = get_namespace_name(RelationGetNamespace(rel));
+    mirror = psprintf("%s_col", RelationGetRelationName(rel));
+
+    copy_seg = dsm_create(sizeof(CopyShared), 0);
+    dsm_pin_mapping(copy_seg);
+    shared = dsm_segment_address(copy_seg);
+    MemSet(shared, 0, sizeof(CopyShared));
+    shared->database_id = MyDatabaseId;
+    shared->user_id = GetUserId();
+    shared->relid = relid;
+    shared->leader = MyProc;
+    shared->nblocks = RelationGetNumberOfBlocks(rel);
+    SpinLockInit(&shared->mutex);
+
+    if (snprintf(shared->sql, COPY_SQL_LEN,
+                 "INSERT INTO %s (%s, _htap_lsn) SELECT %s, '0/0' FROM %s "
+                 "WHERE ctid >= $1 AND ctid < $2",
+                 quote_qualified_identifier(nsp, mirror), cols.data, cols.data,
+                 quote_qualified_identifier(nsp, RelationGetRelationName(rel))) >= COPY_SQL_LEN)
+    {
+        dsm_detach(copy_seg);
+        copy_seg = NULL;
+        ereport(ERROR,
+                (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+                 errmsg("too many columns in \"%s\" for the initial copy",
+                        RelationGetRelationName(rel))));
+    }
+
+    table_close(rel, NoLock);
+
+    /* Nothing commits in between under the caller's lock, so these agree */
+    strlcpy(shared->snapshot, ExportSnapshot(GetActiveSnapshot()), NAMEDATALEN);
+    lsn = GetXLogInsertRecPtr();
+
+    copy_handles = MemoryContextAllocZero(TopMemoryContext,
+                                          nworkers * sizeof(BackgroundWorkerHandle *));
+    for (int i = 0; i < nworkers; i++)
+    {
+        BackgroundWorker worker;
+
+        MemSet(&worker, 0, sizeof(worker));
+        worker.bgw_flags =
+            BGWORKER_BACKEND_DATABASE_CONNECTION | BGWORKER_SHMEM_ACCESS;
+        worker.bgw_start_time = BgWorkerStart_ConsistentState;
+        worker.bgw_restart_time = BGW_NEVER_RESTART;
+        worker.bgw_notify_pid = MyProcPid;
+        worker.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(copy_seg));
+
+        snprintf(worker.bgw_name, BGW_MAXLEN, "row_to_column copy worker %d", i);
+        snprintf(worker.bgw_type, BGW_MAXLEN, "row_to_column copy");
+        snprintf(worker.bgw_library_name, BGW_MAXLEN, "row_to_column");
+        snprintf(worker.bgw_function_name, BGW_MAXLEN, "row_to_column_copy_main");
+
+        /* Go with fewer workers when the slots run out */
+        if (!RegisterDynamicBackgroundWorker(&worker, &copy_handles[i]))
+            break;
+        started++;
+    }
+    shared->nworkers = started;
+
+    if (started == 0)
+    {
+        copy_stop();
+        ereport(ERROR,
+                (errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+                 errmsg("could not register any row_to_column copy worker"),
+                 errhint("You may need to increase max_worker_processes.")));
+    }
+    if (started < nworkers)
+        ereport(NOTICE,
+                (errmsg("copying with %d of %d workers", started, nworkers)));
+
+    /* The snapshot goes away with our transaction */
+    copy_wait(&shared->imported, "taking the snapshot");
+
+    PG_RETURN_LSN(lsn);
+}
+
+/* Wait for the workers of htap_copy_begin() and return the rows copied */
+Datum
+htap_copy_finish(PG_FUNCTION_ARGS)
+{
+    CopyShared *shared;
+    uint64 rows;
+
+    if (!copy_seg)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("no initial copy is running in this session")));
+
+    shared = dsm_segment_address(copy_seg);
+    copy_wait(&shared->finished, "committing its rows");
+    rows = shared->rows;
+    /* htap_convert() marks it copied in this transaction: see route_mirror_whole() */
+    CacheInvalidateRelcacheByRelid(shared->relid);
+    copy_stop();
+
+    PG_RETURN_INT64((int64) rows);
+}
+
+/* ---------- MIRROR ROUTING ---------- */
+
+/*
+ * With row_to_column.route_to_mirror on, the planner reads big SELECTs that
+ * aggregate a mirrored table from its <tbl>_col_live view instead of the
+ * heap, as long as the worker is within route_max_lag of the WAL insert
+ * position.  A table that the query filters by a column an index of it
+ * leads with is left to the heap too: the planner can then fetch just the
+ * rows it needs, which beats scanning a whole live view.  The
+ * range table entry of the table is turned into a subquery on the view the
+ * way the rewriter expands views, with the view's columns laid out at the
+ * table's attribute numbers so that the rest of the query is left as is.
+ *
+ * The lag is only looked at when planning.  A cached plan that reads a
+ * mirror is marked transient and planned again in the next transaction.
+ */
+static planner_hook_type prev_planner_hook = NULL;
+
+/* Does this database have a worker that is close enough to the WAL insert position? */
+static bool
+route_lag_ok(void)
+{
+    XLogRecPtr applied = InvalidXLogRecPtr;
+    XLogRecPtr insert;
+
+    if (!htap_workers)
+        return false;
+
+    for (int i = 0; i < R2C_MAX_WORKERS; i++)
+    {
+        bool match;
+
+        SpinLockAcquire(&htap_workers[i].mutex);
+        match = htap_workers[i].in_use && htap_workers[i].database_id == MyDatabaseId;
+        if (match && htap_workers[i].pid != 0)
+            applied = htap_workers[i].applied_lsn;
+        SpinLockRelease(&htap_workers[i].mutex);
+
+        if (match)
+            break;
+    }
+    if (XLogRecPtrIsInvalid(applied))
+        return false;
+
+    insert = GetXLogInsertRecPtr();
+    return insert <= applied || (insert - applied) / 1024 <= (uint64) r2c_route_max_lag;
+}
+
+typedef struct RouteVarContext
+{
+    Index varno;
+    int sublevels_up;
+} RouteVarContext;
+
+/* Is the whole row or a system column of range table entry varno used? */
+static bool
+route_var_walker(Node *node, RouteVarContext *ctx)
+{
+    if (node == NULL)
+        return false;
+
+    if (IsA(node, Var))
+    {
+        Var *var = (Var *) node;
+
+        return var->varno == ctx->varno &&
+               var->varlevelsup == ctx->sublevels_up &&
+               var->varattno <= 0;
+    }
+
+    if (IsA(node, Query))
+    {
+        bool used;
+
+        ctx->sublevels_up++;
+        used = query_tree_walker((Query *) node, route_var_walker, ctx, 0);
+        ctx->sublevels_up--;
+        return used;
+    }
+
+    return expression_tree_walker(node, route_var_walker, ctx);
+}
+
+/* node, under binary-compatible casts, if it is a column of varno */
+static AttrNumber
+route_qual_column(Node *node, Index varno)
+{
+    while (node && IsA(node, RelabelType))
+        node = (Node *) ((RelabelType *) node)->arg;
+
+    if (node && IsA(node, Var) &&
+        ((Var *) node)->varno == varno && ((Var *) node)->varlevelsup == 0)
+        return ((Var *) node)->varattno;
+    return InvalidAttrNumber;
+}
+
+/* Is node a value known when the query runs? */
+static bool
+route_qual_value(Node *node)
+{
+    while (node && IsA(node, RelabelType))
+        node = (Node *) ((RelabelType *) node)->arg;
+
+    return node && (IsA(node, Const) || IsA(node, Param));
+}
+
+/* Does an index of indexes lead with column attno and have operator opno for it? */
+static bool
+route_index_leads(List *indexes, AttrNumber attno, Oid opno)
+{
+    ListCell *lc;
+    bool leads = false;
+
+    if (attno <= 0 || !OidIsValid(opno))
+        return false;
+
+    foreach (lc, indexes)
+    {
+        Relation index = index_open(lfirst_oid(lc), AccessShareLock);
+
+        leads = index->rd_index->indnkeyatts > 0 &&
+                index->rd_index->indkey.values[0] == attno &&
+                op_in_opfamily(opno, index->rd_opfamily[0]);
+        index_close(index, AccessShareLock);
+        if (leads)
+            break;
+    }
+    return leads;
+}
+
+/*
+ * Does qual, or one of the quals it ANDs, compare a column of varno with a
+ * value by an operator an index of it has: an equality, a range or an IN?
+ */
+static bool
+route_qual_indexed(Node *qual, Index varno, List *indexes)
+{
+    if (qual == NULL)
+        return false;
+
+    if (IsA(qual, List) || (IsA(qual, BoolExpr) && ((BoolExpr *) qual)->boolop == AND_EXPR))
+    {
+        List *args = IsA(qual, List) ? (List *) qual : ((BoolExpr *) qual)->args;
+        ListCell *lc;
+
+        foreach (lc, args)
+            if (route_qual_indexed(lfirst(lc), varno, indexes))
+                return true;
+        return false;
+    }
+
+    if (IsA(qual, OpExpr) && list_length(((OpExpr *) qual)->args) == 2)
+    {
+        OpExpr *op = (OpExpr *) qual;
+        Node *left = linitial(op->args);
+        Node *right = lsecond(op->args);
+
+        if (route_qual_value(right))
+            return route_index_leads(indexes, route_qual_column(left, varno), op->opno);
+        if (route_qual_value(left))
+            return route_index_leads(indexes, route_qual_column(right, varno),
+                                     get_commutator(op->opno));
+        return false;
+    }
+
+    if (IsA(qual, ScalarArrayOpExpr))
+    {
+        ScalarArrayOpExpr *op = (ScalarArrayOpExpr *) qual;
+
+        return op->useOr && route_qual_value(lsecond(op->args)) &&
+               route_index_leads(indexes, route_qual_column(linitial(op->args), varno),
+                                 op->opno);
+    }
+
+    return false;
+}
+
+/* The same for the WHERE and inner join conditions of a join tree */
+static bool
+route_jointree_indexed(Node *jtnode, Index varno, List *indexes)
+{
+    ListCell *lc;
+
+    if (jtnode == NULL)
+        return false;
+
+    if (IsA(jtnode, FromExpr))
+    {
+        FromExpr *f = (FromExpr *) jtnode;
+
+        if (route_qual_indexed(f->quals, varno, indexes))
+            return true;
+        foreach (lc, f->fromlist)
+            if (route_jointree_indexed(lfirst(lc), varno, indexes))
+                return true;
+    }
+    else if (IsA(jtnode, JoinExpr))
+    {
+        JoinExpr *j = (JoinExpr *) jtnode;
+
+        if (j->jointype == JOIN_INNER && route_qual_indexed(j->quals, varno, indexes))
+            return true;
+        return route_jointree_indexed(j->larg, varno, indexes) ||
+               route_jointree_indexed(j->rarg, varno, indexes);
+    }
+    return false;
+}
+
+/*
+ * The answers of route_mirror_whole() by relid, for planning not to query
+ * them every time.  Changing what of a table is published invalidates its
+ * relcache entry, and so does htap_copy_finish() for the table whose copy
+ * it completes.
+ */
+typedef struct RouteWhole
+{
+    Oid relid; /* hash key */
+    bool whole;
+} RouteWhole;
+
+static HTAB *route_wholes = NULL;
+static uint64 route_wholes_invals = 0;
+
+static void
+route_whole_relcache_cb(Datum arg, Oid relid)
+{
+    HASH_SEQ_STATUS status;
+    RouteWhole *rw;
+
+    route_wholes_invals++;
+
+    if (OidIsValid(relid))
+    {
+        hash_search(route_wholes, &relid, HASH_REMOVE, NULL);
+        return;
+    }
+
+    hash_seq_init(&status, route_wholes);
+    while ((rw = hash_seq_search(&status)) != NULL)
+        hash_search(route_wholes, &rw->relid, HASH_REMOVE, NULL);
+}
+
+/*
+ * Is the mirror of rel complete: every column and row published, and not
+ * waiting for htap_convert() to finish its copy?
+ */
+static bool
+route_mirror_whole(Relation rel)
+{
+    Oid relid = RelationGetRelid(rel);
+    Oid argtypes[2] = {TEXTOID, OIDOID};
+    Datum args[2];
+    bool whole = false;
+    uint64 invals = route_wholes_invals;
+    RouteWhole *rw;
+
+    if (!route_wholes)
+    {
+        HASHCTL ctl;
+
+        MemSet(&ctl, 0, sizeof(ctl));
+        ctl.keysize = sizeof(Oid);
+        ctl.entrysize = sizeof(RouteWhole);
+        ctl.hcxt = CacheMemoryContext;
+        route_wholes = hash_create("row_to_column whole mirrors", 16, &ctl,
+                                   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+        CacheRegisterRelcacheCallback(route_whole_relcache_cb, (Datum) 0);
+    }
+
+    rw = hash_search(route_wholes, &relid, HASH_FIND, NULL);
+    if (rw)
+        return rw->whole;
+
+    args[0] = CStringGetTextDatum(RelationGetRelationName(rel));
+    args[1] = ObjectIdGetDatum(RelationGetRelid(rel));
+
+    SPI_connect();
+    if (SPI_execute_with_args("SELECT htap_pub_spec($1) = '' AND NOT EXISTS "
+                              "(SELECT 1 FROM htap_sync s "
+                              "WHERE s.relid = $2 AND s.copied_at IS NULL)",
+                              2, argtypes, args, NULL, true, 1) == SPI_OK_SELECT &&
+        SPI_processed > 0)
+    {
+        bool isnull;
+        Datum d = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull);
+
+        whole = !isnull && DatumGetBool(d);
+    }
+    SPI_finish();
+
+    /* Not after an invalidation came in meanwhile: the answer may be older */
+    if (invals == route_wholes_invals)
+    {
+        rw = hash_search(route_wholes, &relid, HASH_ENTER, NULL);
+        rw->whole = whole;
+    }
+    return whole;
+}
+
+/*
+ * The query of the <tbl>_col_live view of rel, with the table's columns at
+ * their attribute numbers, or NULL when a column is missing or differs.
+ */
+static Query *
+route_view_query(Relation rel, Oid view)
+{
+    TupleDesc desc = RelationGetDescr(rel);
+    Relation view_rel = table_open(view, AccessShareLock);
+    Query *query = copyObject(get_view_query(view_rel));
+    List *tlist = NIL;
+
+    table_close(view_rel, NoLock);
+
+    for (int i = 0; i < desc->natts; i++)
+    {
+        Form_pg_attribute att = TupleDescAttr(desc, i);
+        Expr *expr = NULL;
+        ListCell *lc;
+
+        if (att->attisdropped)
+            expr = (Expr *) makeNullConst(INT4OID, -1, InvalidOid);
+        else
         {
-            bool isnull;
-            Datum d = SPI_getbinval(
-                SPI_tuptable->vals[i],
-                SPI_tuptable->tupdesc,
-                1, &isnull);
-            if (!isnull)
-                decode_pgoutput(DatumGetByteaP(d));
+            foreach (lc, query->targetList)
+            {
+                TargetEntry *te = (TargetEntry *) lfirst(lc);
+
+                if (!te->resjunk && strcmp(te->resname, NameStr(att->attname)) == 0)
+                {
+                    expr = te->expr;
+                    break;
+                }
+            }
+            if (expr == NULL ||
+                exprType((Node *) expr) != att->atttypid ||
+                exprTypmod((Node *) expr) != att->atttypmod ||
+                exprCollation((Node *) expr) != att->attcollation)
+                return NULL;
         }
 
-        // Execute all transaction buffers in order
-        txn_process_all();
+        tlist = lappend(tlist, makeTargetEntry(expr, i + 1,
+                                               pstrdup(NameStr(att->attname)), false));
+    }
+    query->targetList = tlist;
 
-        SPI_finish();
-        PopActiveSnapshot();
-        CommitTransactionCommand();
+    return query;
+}
+
+/* Read range table entry rti of parse from its mirror if it has a suitable one */
+static bool
+route_rte(Query *parse, Index rti)
+{
+    RangeTblEntry *rte = rt_fetch(rti, parse->rtable);
+    RouteVarContext ctx;
+    Relation rel;
+    Query *view_query = NULL;
+    List *indexes;
+    char *view_name;
+    Oid view;
+
+    if (rte->rtekind != RTE_RELATION || rte->relkind != RELKIND_RELATION ||
+        rte->tablesample != NULL || has_subclass(rte->relid))
+        return false;
+
+    view_name = psprintf("%s_col_live", get_rel_name(rte->relid));
+    view = get_relname_relid(view_name, get_rel_namespace(rte->relid));
+    pfree(view_name);
+    if (!OidIsValid(view) || get_rel_relkind(view) != RELKIND_VIEW)
+        return false;
+
+    /* The mirror has no ctid, and its row type is not the table's */
+    ctx.varno = rti;
+    ctx.sublevels_up = 0;
+    if (query_tree_walker(parse, route_var_walker, &ctx, 0))
+        return false;
+
+    /* Locked by the parser already */
+    rel = table_open(rte->relid, NoLock);
+    indexes = RelationGetIndexList(rel);
+    if (!rel->rd_rel->relrowsecurity &&
+        rel->rd_rel->reltuples >= (float4) r2c_route_min_rows &&
+        !route_jointree_indexed((Node *) parse->jointree, rti, indexes) &&
+        route_mirror_whole(rel))
+        view_query = route_view_query(rel, view);
+    list_free(indexes);
+    table_close(rel, NoLock);
+
+    if (view_query == NULL)
+        return false;
+
+    AcquireRewriteLocks(view_query, true, false);
+
+#if PG_VERSION_NUM >= 160000
+    /* Left as ApplyRetrieveRule() leaves them: the table is still locked and checked */
+    rte->rtekind = RTE_SUBQUERY;
+    rte->subquery = view_query;
+    rte->security_barrier = false;
+    rte->relkind = 0;
+    rte->tablesample = NULL;
+    rte->inh = false;
+#else
+    {
+        /* The table's permission checks go to the rule's OLD entry, as for views */
+        RangeTblEntry *old = rt_fetch(PRS2_OLD_VARNO, view_query->rtable);
+
+        old->relid = rte->relid;
+        old->relkind = RELKIND_RELATION;
+        old->rellockmode = rte->rellockmode;
+        old->requiredPerms = rte->requiredPerms;
+        old->checkAsUser = rte->checkAsUser;
+        old->selectedCols = rte->selectedCols;
+        old->insertedCols = rte->insertedCols;
+        old->updatedCols = rte->updatedCols;
+        old->extraUpdatedCols = rte->extraUpdatedCols;
+
+        rte->rtekind = RTE_SUBQUERY;
+        rte->subquery = view_query;
+        rte->security_barrier = false;
+        rte->relid = InvalidOid;
+        rte->relkind = 0;
+        rte->rellockmode = 0;
+        rte->tablesample = NULL;
+        rte->inh = false;
+        rte->requiredPerms = 0;
+        rte->checkAsUser = InvalidOid;
+        rte->selectedCols = NULL;
+        rte->insertedCols = NULL;
+        rte->updatedCols = NULL;
+        rte->extraUpdatedCols = NULL;
     }
+#endif
 
-    elog(LOG, "row_to_column BGWorker exiting");
-    proc_exit(0);
+    return true;
+}
+
+/*
+ * Route the tables of parse to their mirrors if it is a read-only query
+ * that aggregates.  A transaction that wrote or that keeps one snapshot has
+ * to see the heap.
+ */
+static bool
+route_query(Query *parse)
+{
+    bool routed = false;
+
+    if (parse->commandType != CMD_SELECT || parse->hasModifyingCTE ||
+        parse->rowMarks != NIL ||
+        !(parse->hasAggs || parse->hasWindowFuncs ||
+          parse->groupClause != NIL || parse->groupingSets != NIL))
+        return false;
+
+    if (am_htap_worker || IsolationUsesXactSnapshot() ||
+        TransactionIdIsValid(GetTopTransactionIdIfAny()) ||
+        !route_lag_ok())
+        return false;
+
+    for (Index rti = 1; rti <= list_length(parse->rtable); rti++)
+        if (route_rte(parse, rti))
+            routed = true;
+
+    return routed;
+}
+
+static PlannedStmt *
+route_planner(Query *parse, const char *query_string, int cursorOptions,
+              ParamListInfo boundParams)
+{
+    bool routed = r2c_route_to_mirror && route_query(parse);
+    PlannedStmt *result;
+
+    if (prev_planner_hook)
+        result = prev_planner_hook(parse, query_string, cursorOptions, boundParams);
+    else
+        result = standard_planner(parse, query_string, cursorOptions, boundParams);
+
+    if (routed)
+        result->transientPlan = true;
+
+    return result;
 }
 
 /* ---------- MODULE INIT ---------- */
@@ -467,12 +7914,320 @@ void _PG_init(void)
     HASHCTL ctl;
     BackgroundWorker worker;
 
+    DefineCustomEnumVariable("row_to_column.mode",
+                             "How the worker receives changes from the slot.",
+                             "poll calls pg_logical_slot_get_binary_changes() in a loop; "
+                             "stream connects to a walsender with START_REPLICATION.",
+                             &r2c_mode,
+                             R2C_MODE_POLL,
+                             r2c_mode_options,
+                             PGC_POSTMASTER,
+                             0,
+                             NULL, NULL, NULL);
+
+    DefineCustomStringVariable("row_to_column.workers",
+                               "Databases to replicate, with the slot and publication of each.",
+                               "A comma-separated list of database:slot[:publication] "
+                               "entries; the publication defaults to " R2C_PUBLICATION ".",
+                               &r2c_workers,
+                               "postgres:sample_slot2:" R2C_PUBLICATION,
+                               PGC_SIGHUP,
+                               GUC_SUPERUSER_ONLY,
+                               r2c_workers_check, NULL, NULL);
+
+    DefineCustomStringVariable("row_to_column.conninfo",
+                               "Connection string the workers use for stream mode.",
+                               "Each worker adds the dbname of its entry of "
+                               "row_to_column.workers.",
+                               &r2c_conninfo,
+                               "",
+                               PGC_POSTMASTER,
+                               GUC_SUPERUSER_ONLY,
+                               NULL, NULL, NULL);
+
+    DefineCustomIntVariable("row_to_column.max_changes_per_cycle",
+                            "Maximum number of changes taken from the slot per poll cycle.",
+                            "0 takes everything available.",
+                            &r2c_max_changes_per_cycle,
+                            100000,
+                            0, INT_MAX,
+                            PGC_SIGHUP,
+                            0,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("row_to_column.max_bytes_per_cycle",
+                            "Decoded data buffered before it is applied.",
+                            "Committed transactions are applied as soon as the "
+                            "buffers reach this size instead of at the end of the cycle.",
+                            &r2c_max_bytes_per_cycle,
+                            65536,
+                            64, MAX_KILOBYTES,
+                            PGC_SIGHUP,
+                            GUC_UNIT_KB,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("row_to_column.max_buffer_memory",
+                            "Decoded data kept in memory before the largest buffers spill to disk.",
+                            "Transactions still in progress cannot be applied; past this, "
+                            "their rows are written to temporary files and read back when "
+                            "they are applied. Committed rows waiting for "
+                            "max_bytes_per_cycle and held rows stay in memory on top of it.",
+                            &r2c_max_buffer_memory,
+                            262144,
+                            1024, MAX_KILOBYTES,
+                            PGC_SIGHUP,
+                            GUC_UNIT_KB,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("row_to_column.apply_workers",
+                            "Number of parallel apply workers.",
+                            "With 0 the main worker applies changes itself; otherwise it "
+                            "only decodes and hands batches out by relation.",
+                            &r2c_apply_workers,
+                            0,
+                            0, 64,
+                            PGC_POSTMASTER,
+                            0,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("row_to_column.flush_rows",
+                            "Rows merged from committed transactions before they are applied.",
+                            "Small transactions are applied together in one batch per "
+                            "relation, which gives the columnar mirror fuller stripes.",
+                            &r2c_flush_rows,
+                            100000,
+                            1, INT_MAX,
+                            PGC_SIGHUP,
+                            0,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("row_to_column.flush_bytes",
+                            "Data merged from committed transactions before it is applied.",
+                            NULL,
+                            &r2c_flush_bytes,
+                            16384,
+                            1, MAX_KILOBYTES,
+                            PGC_SIGHUP,
+                            GUC_UNIT_KB,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("row_to_column.flush_interval_ms",
+                            "Longest a committed change waits before it is applied.",
+                            "In poll mode everything is also applied at the end of each "
+                            "cycle, as the slot is consumed when the cycle commits.",
+                            &r2c_flush_interval_ms,
+                            1000,
+                            0, INT_MAX,
+                            PGC_SIGHUP,
+                            GUC_UNIT_MS,
+                            NULL, NULL, NULL);
+
+    DefineCustomRealVariable("row_to_column.stripe_fill",
+                             "Share of a columnar stripe to collect per relation before applying.",
+                             "In stream mode a relation's rows are held back until they fill "
+                             "this much of its mirror's stripe_row_limit, at least a chunk "
+                             "group, so that each transaction writes full stripes. 0 turns "
+                             "holding off.",
+                             &r2c_stripe_fill,
+                             1.0,
+                             0.0, 1.0,
+                             PGC_SIGHUP,
+                             0,
+                             NULL, NULL, NULL);
+
+    DefineCustomIntVariable("row_to_column.max_hold_ms",
+                            "Longest a row is held back to fill a stripe.",
+                            NULL,
+                            &r2c_max_hold_ms,
+                            30000,
+                            0, INT_MAX,
+                            PGC_SIGHUP,
+                            GUC_UNIT_MS,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("row_to_column.codec_sample_rows",
+                            "Rows of each mirror to sample before choosing its compression.",
+                            "The worker tries each codec on the values of the first rows it "
+                            "inserts into a mirror and sets the best with "
+                            "htap_set_compression(). 0 leaves compression alone.",
+                            &r2c_codec_sample_rows,
+                            0,
+                            0, 1000000,
+                            PGC_SIGHUP,
+                            0,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("row_to_column.codec_min_mbps",
+                            "Slowest encoding, in MB/s of sampled values, a chosen codec may have.",
+                            NULL,
+                            &r2c_codec_min_mbps,
+                            50,
+                            1, INT_MAX,
+                            PGC_SIGHUP,
+                            0,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("row_to_column.proto_version",
+                            "pgoutput protocol version requested from the slot.",
+                            "Stream mode reads it when it connects.",
+                            &r2c_proto_version,
+                            1,
+                            1, LOGICALREP_PROTO_MAX_VERSION_NUM,
+                            PGC_SIGHUP,
+                            0,
+                            NULL, NULL, NULL);
+
+    DefineCustomBoolVariable("row_to_column.binary",
+                             "Request column values in binary format.",
+                             "Values are then converted with the types' receive functions "
+                             "instead of being parsed from text. Needs proto_version 2 "
+                             "or later; a lower setting is raised to 2.",
+                             &r2c_binary,
+                             false,
+                             PGC_SIGHUP,
+                             0,
+                             NULL, NULL, NULL);
+
+    DefineCustomBoolVariable("row_to_column.fresh_reads",
+                             "Publish an applied snapshot for htap_fresh().",
+                             "The worker then holds back the xmin horizon at what it has "
+                             "applied, through the physical slot htap_horizon, so that "
+                             "VACUUM leaves dead rows behind while it lags.",
+                             &r2c_fresh_reads,
+                             false,
+                             PGC_POSTMASTER,
+                             0,
+                             NULL, NULL, NULL);
+
+    DefineCustomBoolVariable("row_to_column.streaming",
+                             "Receive large transactions while they are in progress.",
+                             "Stream mode then spills their changes to temporary files "
+                             "and applies them at commit, instead of having the walsender "
+                             "hold them back until then. Needs proto_version 2 or later; "
+                             "a lower setting is raised to 2. Read when it connects.",
+                             &r2c_streaming,
+                             false,
+                             PGC_SIGHUP,
+                             0,
+                             NULL, NULL, NULL);
+
+    DefineCustomBoolVariable("row_to_column.route_to_mirror",
+                             "Read aggregating queries from the columnar mirrors.",
+                             "SELECTs with aggregates, GROUP BY or window functions then "
+                             "scan the <tbl>_col_live view of a mirrored table instead "
+                             "of the table, while the worker is within route_max_lag, "
+                             "unless they filter it by a column an index leads with.",
+                             &r2c_route_to_mirror,
+                             false,
+                             PGC_USERSET,
+                             0,
+                             NULL, NULL, NULL);
+
+    DefineCustomIntVariable("row_to_column.route_max_lag",
+                            "Furthest the worker may be behind the WAL for queries to read mirrors.",
+                            "Measured from the WAL insert position to what the worker "
+                            "has applied, when the query is planned.",
+                            &r2c_route_max_lag,
+                            16384,
+                            0, MAX_KILOBYTES,
+                            PGC_USERSET,
+                            GUC_UNIT_KB,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("row_to_column.route_min_rows",
+                            "Fewest rows a table has, by its statistics, for queries to read its mirror.",
+                            NULL,
+                            &r2c_route_min_rows,
+                            100000,
+                            0, INT_MAX,
+                            PGC_USERSET,
+                            0,
+                            NULL, NULL, NULL);
+
+    DefineCustomBoolVariable("row_to_column.compaction",
+                             "Start a worker that rewrites mirrors made of small stripes.",
+                             NULL,
+                             &r2c_compaction,
+                             false,
+                             PGC_POSTMASTER,
+                             0,
+                             NULL, NULL, NULL);
+
+    DefineCustomIntVariable("row_to_column.compaction_naptime",
+                            "Time between the compactor's looks at the mirrors.",
+                            NULL,
+                            &r2c_compaction_naptime,
+                            60,
+                            1, INT_MAX / 1000,
+                            PGC_SIGHUP,
+                            GUC_UNIT_S,
+                            NULL, NULL, NULL);
+
+    DefineCustomStringVariable("row_to_column.compaction_window",
+                               "Local times of day the compactor may rewrite mirrors in.",
+                               "A range like 01:00-05:30, which may wrap past midnight. "
+                               "Empty for any time.",
+                               &r2c_compaction_window,
+                               "",
+                               PGC_SIGHUP,
+                               0,
+                               r2c_compaction_window_check, NULL, NULL);
+
+    DefineCustomIntVariable("row_to_column.compaction_min_stripes",
+                            "Fewest stripes a mirror has before it is compacted.",
+                            NULL,
+                            &r2c_compaction_min_stripes,
+                            16,
+                            2, INT_MAX,
+                            PGC_SIGHUP,
+                            0,
+                            NULL, NULL, NULL);
+
+    DefineCustomRealVariable("row_to_column.compaction_fill",
+                             "Compact mirrors whose stripes hold less than this share of "
+                             "stripe_row_limit on average.",
+                             NULL,
+                             &r2c_compaction_fill,
+                             0.5,
+                             0.0, 1.0,
+                             PGC_SIGHUP,
+                             0,
+                             NULL, NULL, NULL);
+
+    MarkGUCPrefixReserved("row_to_column");
+
+    relmap_cxt = AllocSetContextCreate(TopMemoryContext,
+                                       "row_to_column_relmap",
+                                       ALLOCSET_SMALL_SIZES);
+
     MemSet(&ctl, 0, sizeof(ctl));
     ctl.keysize = sizeof(Oid);
     ctl.entrysize = sizeof(RelInfo);
+    ctl.hcxt = relmap_cxt;
 
     relmap = hash_create("row_to_column_relmap", 128,
-                         &ctl, HASH_ELEM | HASH_BLOBS);
+                         &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+    ctl.entrysize = sizeof(RelLsn);
+    sync_states = hash_create("row_to_column_sync_states", 16,
+                              &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    rel_progress = hash_create("row_to_column_progress", 16,
+                               &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    rollup_relids = hash_create("row_to_column_rollup_relids", 16,
+                                &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+    /* The statistics area and the worker need to be set up by the postmaster */
+    if (!process_shared_preload_libraries_in_progress)
+        return;
+
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = stat_shmem_request;
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = stat_shmem_startup;
+    prev_emit_log_hook = emit_log_hook;
+    emit_log_hook = stat_emit_log;
+    prev_planner_hook = planner_hook;
+    planner_hook = route_planner;
 
     MemSet(&worker, 0, sizeof(worker));
     worker.bgw_flags =
@@ -480,9 +8235,10 @@ void _PG_init(void)
     worker.bgw_start_time = BgWorkerStart_ConsistentState;
     worker.bgw_restart_time = 5;
 
-    snprintf(worker.bgw_name, BGW_MAXLEN, "row_to_column_logger");
+    snprintf(worker.bgw_name, BGW_MAXLEN, "row_to_column launcher");
+    snprintf(worker.bgw_type, BGW_MAXLEN, "row_to_column launcher");
     snprintf(worker.bgw_library_name, BGW_MAXLEN, "row_to_column");
-    snprintf(worker.bgw_function_name, BGW_MAXLEN, "row_to_column_main");
+    snprintf(worker.bgw_function_name, BGW_MAXLEN, "row_to_column_launcher_main");
 
     RegisterBackgroundWorker(&worker);
 }